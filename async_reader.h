@@ -0,0 +1,272 @@
+#ifndef SIGNATURE_ASYNC_READER_H
+#define SIGNATURE_ASYNC_READER_H
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include <string>
+#include <utility>
+#include <vector>
+
+#ifdef __linux__
+#include <fcntl.h>
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#endif
+
+//! Positional reads kept in flight by the kernel. <br>
+//! Linux uses io_uring through the raw system calls, so there is no liburing dependency. Without
+//! it (other systems, old kernels, sandboxes which forbid it) every read is a blocking pread in
+//! submit() and wait() returns the completions in order. <br>
+//! With O_DIRECT the page cache is bypassed: buffers, offsets and sizes must be multiples of
+//! alignment, a read past the end of the file is cut short as usual
+class CAsyncReader {
+ public:
+  static constexpr uint64_t alignment = 4096;
+
+  CAsyncReader()
+      : m_fd(-1),
+        m_direct(false),
+        m_ring_fd(-1),
+        m_ring(nullptr),
+        m_ring_size(0),
+        m_sqes(nullptr),
+        m_sqes_size(0),
+        m_in_flight(0) {}
+
+  ~CAsyncReader() { close(); }
+
+  CAsyncReader(const CAsyncReader&) = delete;
+
+  CAsyncReader& operator=(CAsyncReader const&) = delete;
+
+  CAsyncReader(CAsyncReader&&) = delete;
+
+  CAsyncReader& operator=(CAsyncReader&&) = delete;
+
+  //! False where there is no positional read, the stream reader is used then
+  static constexpr bool is_supported() {
+#ifdef __linux__
+    return true;
+#else
+    return false;
+#endif
+  }
+
+  //! Opens the file for up to queue_depth reads in flight. direct asks for O_DIRECT, the file is
+  //! opened buffered if the file system refuses it. uring = false forces the pread fallback. <br>
+  //! Returns false if the file can't be opened
+  bool open(const std::string& path, uint32_t queue_depth, bool direct, bool uring = true) {
+    close();
+#ifdef __linux__
+    if (direct) {
+      m_fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC | O_DIRECT);
+      m_direct = m_fd >= 0;
+    }
+    if (m_fd < 0) {
+      m_fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    }
+    if (m_fd < 0) {
+      return false;
+    }
+    if (uring) {
+      setup_ring(std::max(queue_depth, 1u));
+    }
+    return true;
+#else
+    (void)path;
+    (void)queue_depth;
+    (void)direct;
+    (void)uring;
+    return false;
+#endif
+  }
+
+  //! Waits for the reads in flight, their buffers are no longer written
+  void close() {
+#ifdef __linux__
+    while (m_in_flight) {
+      wait();
+    }
+    if (m_ring) {
+      munmap(m_ring, m_ring_size);
+    }
+    if (m_sqes) {
+      munmap(m_sqes, m_sqes_size);
+    }
+    if (m_ring_fd >= 0) {
+      ::close(m_ring_fd);
+    }
+    if (m_fd >= 0) {
+      ::close(m_fd);
+    }
+#endif
+    m_fd = -1;
+    m_direct = false;
+    m_ring_fd = -1;
+    m_ring = nullptr;
+    m_sqes = nullptr;
+    m_completions.clear();
+  }
+
+  //! True if the reads go through io_uring
+  [[nodiscard]] bool is_uring() const { return m_ring_fd >= 0; }
+
+  //! True if the file is opened with O_DIRECT
+  [[nodiscard]] bool is_direct() const { return m_direct; }
+
+  //! Reads in flight, at most queue_depth
+  [[nodiscard]] uint32_t in_flight() const { return m_in_flight; }
+
+  //! Starts reading size bytes at offset into buffer, tag comes back with the completion
+  void submit(uint64_t tag, char* buffer, uint64_t offset, uint64_t size) {
+#ifdef __linux__
+    if (!is_uring()) {
+      int64_t result = 0;
+      while (uint64_t(result) < size) {
+        const auto done = pread(m_fd, buffer + result, size_t(size - uint64_t(result)),
+                                off_t(offset + uint64_t(result)));
+        if (done < 0 && errno == EINTR) {
+          continue;
+        }
+        if (done <= 0) {
+          result = done < 0 && !result ? -errno : result;
+          break;
+        }
+        result += done;
+      }
+      m_completions.emplace_back(tag, result);
+      m_in_flight++;
+      return;
+    }
+    // The iovec lives as long as its submission queue entry, no more than queue_depth are in use
+    const auto tail = m_sq_tail->load(std::memory_order_relaxed);
+    const auto index = tail & *m_sq_mask;
+    auto& iovec = m_iovecs[index];
+    iovec = {buffer, size_t(size)};
+    auto& sqe = m_sqes[index];
+    std::memset(&sqe, 0, sizeof(sqe));
+    sqe.opcode = IORING_OP_READV;
+    sqe.fd = m_fd;
+    sqe.off = offset;
+    sqe.addr = reinterpret_cast<uint64_t>(&iovec);
+    sqe.len = 1;
+    sqe.user_data = tag;
+    m_sq_array[index] = index;
+    m_sq_tail->store(tail + 1, std::memory_order_release);
+    m_in_flight++;
+    // An entry the kernel didn't take now (EAGAIN, EINTR) goes with the next call
+    syscall(__NR_io_uring_enter, m_ring_fd, 1, 0, 0, nullptr, 0);
+#else
+    (void)tag;
+    (void)buffer;
+    (void)offset;
+    (void)size;
+#endif
+  }
+
+  //! Blocks until a read completes, returns its tag and the bytes read or -errno. Reads complete
+  //! in any order
+  std::pair<uint64_t, int64_t> wait() {
+    std::pair<uint64_t, int64_t> completion(0, -EINVAL);
+#ifdef __linux__
+    if (!m_in_flight) {
+      return completion;
+    }
+    if (!is_uring()) {
+      completion = m_completions.front();
+      m_completions.pop_front();
+      m_in_flight--;
+      return completion;
+    }
+    auto head = m_cq_head->load(std::memory_order_relaxed);
+    while (head == m_cq_tail->load(std::memory_order_acquire)) {
+      const auto pending = uint32_t(m_iovecs.size());
+      syscall(__NR_io_uring_enter, m_ring_fd, pending, 1, IORING_ENTER_GETEVENTS, nullptr, 0);
+    }
+    const auto& cqe = m_cqes[head & *m_cq_mask];
+    completion = {cqe.user_data, cqe.res};
+    m_cq_head->store(head + 1, std::memory_order_release);
+    m_in_flight--;
+#endif
+    return completion;
+  }
+
+ private:
+#ifdef __linux__
+  //! Maps the rings, leaves is_uring() false if io_uring isn't available
+  void setup_ring(uint32_t entries) {
+    io_uring_params params = {};
+    const auto fd = int(syscall(__NR_io_uring_setup, entries, &params));
+    if (fd < 0) {
+      return;
+    }
+    const auto sq_size = params.sq_off.array + params.sq_entries * sizeof(uint32_t);
+    const auto cq_size = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+    if (!(params.features & IORING_FEAT_SINGLE_MMAP)) {
+      // Kernels before 5.4 map the rings separately, the pread fallback is used there
+      ::close(fd);
+      return;
+    }
+    m_ring_size = std::max(sq_size, cq_size);
+    m_sqes_size = params.sq_entries * sizeof(io_uring_sqe);
+    void* ring = mmap(nullptr, m_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd,
+                      IORING_OFF_SQ_RING);
+    void* sqes = mmap(nullptr, m_sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd,
+                      IORING_OFF_SQES);
+    if (ring == MAP_FAILED || sqes == MAP_FAILED) {
+      if (ring != MAP_FAILED) {
+        munmap(ring, m_ring_size);
+      }
+      if (sqes != MAP_FAILED) {
+        munmap(sqes, m_sqes_size);
+      }
+      ::close(fd);
+      return;
+    }
+    m_iovecs.resize(params.sq_entries);
+    m_ring_fd = fd;
+    m_ring = ring;
+    m_sqes = static_cast<io_uring_sqe*>(sqes);
+    auto* base = static_cast<char*>(ring);
+    m_sq_tail = reinterpret_cast<std::atomic_uint32_t*>(base + params.sq_off.tail);
+    m_sq_mask = reinterpret_cast<uint32_t*>(base + params.sq_off.ring_mask);
+    m_sq_array = reinterpret_cast<uint32_t*>(base + params.sq_off.array);
+    m_cq_head = reinterpret_cast<std::atomic_uint32_t*>(base + params.cq_off.head);
+    m_cq_tail = reinterpret_cast<std::atomic_uint32_t*>(base + params.cq_off.tail);
+    m_cq_mask = reinterpret_cast<uint32_t*>(base + params.cq_off.ring_mask);
+    m_cqes = reinterpret_cast<io_uring_cqe*>(base + params.cq_off.cqes);
+  }
+
+  std::vector<iovec> m_iovecs;
+  std::atomic_uint32_t* m_sq_tail = nullptr;
+  uint32_t* m_sq_mask = nullptr;
+  uint32_t* m_sq_array = nullptr;
+  std::atomic_uint32_t* m_cq_head = nullptr;
+  std::atomic_uint32_t* m_cq_tail = nullptr;
+  uint32_t* m_cq_mask = nullptr;
+  io_uring_cqe* m_cqes = nullptr;
+#endif
+  int m_fd;
+  bool m_direct;
+  int m_ring_fd;
+  void* m_ring;
+  size_t m_ring_size;
+#ifdef __linux__
+  io_uring_sqe* m_sqes;
+#else
+  void* m_sqes;
+#endif
+  size_t m_sqes_size;
+  uint32_t m_in_flight;
+  //! Results of the pread fallback
+  std::deque<std::pair<uint64_t, int64_t>> m_completions;
+};
+
+#endif  // SIGNATURE_ASYNC_READER_H
@@ -0,0 +1,111 @@
+#include "batch_calc.h"
+
+#include <algorithm>
+#include <fstream>
+#include <stdexcept>
+#include <thread>
+
+CBatchCalc::CBatchCalc(std::vector<HashCalc::CBatchFile> files,
+                       uint64_t block_size,
+                       const HashCalc::COptions& options,
+                       uint32_t jobs)
+    : m_files(std::move(files)),
+      m_block_size(block_size),
+      m_options(options),
+      m_jobs(jobs),
+      m_bytes(0),
+      m_cpu_micro(0) {
+  if (!m_options.verify_path.empty() || !m_options.previous_path.empty() ||
+      !m_options.merkle_tree_path.empty() || !m_options.metrics_path.empty()) {
+    throw std::invalid_argument("Batch mode doesn't take the files of a single input");
+  }
+  if (!m_jobs) {
+    m_jobs = m_options.thread_pool ? m_options.thread_pool->count() : get_threads_count();
+  }
+  const auto files_count = std::max(uint64_t(m_files.size()), uint64_t(1));
+  m_jobs = uint32_t(std::clamp(uint64_t(m_jobs), uint64_t(1), files_count));
+  // The longest files first, the short ones fill the gaps at the end
+  std::vector<std::pair<uint64_t, size_t>> sizes;
+  for (size_t i = 0; i < m_files.size(); i++) {
+    std::error_code ec;
+    const auto size = fs::file_size(m_files[i].in_path, ec);
+    sizes.emplace_back(ec ? 0 : size, i);
+  }
+  std::stable_sort(sizes.begin(), sizes.end(),
+                   [](const auto& a, const auto& b) { return a.first > b.first; });
+  std::vector<HashCalc::CBatchFile> sorted;
+  for (const auto& size : sizes) {
+    sorted.push_back(std::move(m_files[size.second]));
+  }
+  m_files.swap(sorted);
+}
+//! Every job thread signs files one by one, its CHashCalc reads on it and borrows the workers of
+//! the pool. Job threads wait for I/O and the workers, so they aren't taken from the pool
+void CBatchCalc::run() {
+  m_timer.start();
+  const auto cpu_start = get_process_cpu_micro();
+  std::atomic_size_t next(0);
+  std::vector<std::thread> jobs;
+  for (uint32_t i = 0; i < m_jobs; i++) {
+    jobs.emplace_back([this, &next] {
+      for (auto file = next++; file < m_files.size(); file = next++) {
+        sign(m_files[file]);
+      }
+    });
+  }
+  for (auto& job : jobs) {
+    job.join();
+  }
+  m_timer.stop();
+  m_cpu_micro = get_process_cpu_micro() - cpu_start;
+}
+
+void CBatchCalc::sign(const HashCalc::CBatchFile& file) {
+  auto options = m_options;
+  options.buffer_size = std::max(m_options.buffer_size / m_jobs, uint64_t(1));
+  options.print_timings = false;
+  options.progress_interval_ms = 0;
+  try {
+    const auto parent = fs::path(file.out_path).parent_path();
+    if (!parent.empty()) {
+      fs::create_directories(parent);
+    }
+    CHashCalc calc(file.in_path, file.out_path, m_block_size, options);
+    calc.run();
+    m_bytes += fs::file_size(file.in_path);
+  } catch (std::exception& e) {
+    std::unique_lock<std::mutex> lock(m_mutex);
+    m_failed.emplace_back(file.in_path, e.what());
+  }
+}
+
+std::vector<HashCalc::CBatchFile> CBatchCalc::list_files(const std::string& input,
+                                                         const std::string& out_dir,
+                                                         const std::string& suffix) {
+  std::vector<HashCalc::CBatchFile> files;
+  const auto add = [&](const fs::path& in_path, const fs::path& relative) {
+    files.push_back({in_path.string(), (fs::path(out_dir) / relative).string() + suffix});
+  };
+  if (fs::is_directory(input)) {
+    for (const auto& entry : fs::recursive_directory_iterator(input)) {
+      if (entry.is_regular_file()) {
+        add(entry.path(), fs::relative(entry.path(), input));
+      }
+    }
+    return files;
+  }
+  std::ifstream list(input);
+  if (!list.is_open()) {
+    throw std::runtime_error("Fatal error, couldn't open file list " + input);
+  }
+  for (std::string line; std::getline(list, line);) {
+    if (!line.empty() && line.back() == '\r') {
+      line.pop_back();
+    }
+    if (!line.empty()) {
+      // Absolute paths keep their directories below out_dir
+      add(line, fs::path(line).relative_path());
+    }
+  }
+  return files;
+}
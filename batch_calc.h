@@ -0,0 +1,84 @@
+#ifndef SIGNATURE_BATCH_CALC_H
+#define SIGNATURE_BATCH_CALC_H
+
+#include <atomic>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "hashcalc.h"
+#include "utils.h"
+
+namespace HashCalc {
+//! Input file of the batch and its signature
+struct CBatchFile {
+  std::string in_path;
+  std::string out_path;
+};
+}  // namespace HashCalc
+
+//! Signs many files at once. <br>
+//! Several files are in flight, each one has its reader and writer, all of their blocks are hashed
+//! by the workers of one thread pool, so small files fill the cores too. The files in flight split
+//! the buffer budget, the biggest files start first
+class CBatchCalc {
+ public:
+  //! jobs is the number of files in flight, 0 means the number of workers. <br>
+  //! Throws std::invalid_argument for the options which refer to a single file
+  CBatchCalc(std::vector<HashCalc::CBatchFile> files,
+             uint64_t block_size,
+             const HashCalc::COptions& options = {},
+             uint32_t jobs = 0);
+
+  ~CBatchCalc() = default;
+
+  CBatchCalc(const CBatchCalc&) = delete;
+
+  CBatchCalc& operator=(CBatchCalc const&) = delete;
+
+  CBatchCalc(CBatchCalc&&) = delete;
+
+  CBatchCalc& operator=(CBatchCalc&&) = delete;
+
+  //! Signs every file, errors of single files are collected in get_failed()
+  void run();
+
+  //! Inputs of a directory (recursively) or of a list file with a path per line, the signature
+  //! of in/a/b goes to out_dir/a/b + suffix
+  static std::vector<HashCalc::CBatchFile> list_files(const std::string& input,
+                                                      const std::string& out_dir,
+                                                      const std::string& suffix);
+
+  [[nodiscard]] uint64_t get_files_count() const { return m_files.size(); }
+
+  //! Files which couldn't be signed and the errors, valid after run()
+  [[nodiscard]] const std::vector<std::pair<std::string, std::string>>& get_failed() const {
+    return m_failed;
+  }
+
+  //! Bytes of the signed files, valid after run()
+  [[nodiscard]] uint64_t get_bytes() const { return m_bytes; }
+
+  //! Wall time of run()
+  [[nodiscard]] uint64_t get_micro() const { return m_timer.get_micro(); }
+
+  //! CPU time of the process during run()
+  [[nodiscard]] uint64_t get_cpu_micro() const { return m_cpu_micro; }
+
+ private:
+  void sign(const HashCalc::CBatchFile& file);
+
+  std::vector<HashCalc::CBatchFile> m_files;
+  uint64_t m_block_size;
+  HashCalc::COptions m_options;
+  uint32_t m_jobs;
+  std::atomic_uint64_t m_bytes;
+  uint64_t m_cpu_micro;
+  std::mutex m_mutex;
+  std::vector<std::pair<std::string, std::string>> m_failed;
+  CTimer m_timer;
+};
+
+#endif  // SIGNATURE_BATCH_CALC_H
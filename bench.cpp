@@ -0,0 +1,522 @@
+//! Benchmarks of the hot paths and of the whole pipeline on Google Benchmark. <br>
+//! bench --benchmark_out=results.json --benchmark_out_format=json keeps the results of a version
+//! for comparison with the next one, the context records the SHA256 backend and the cores. <br>
+//! The end-to-end runs sign files of --bench_sizes=1,4,16 GB created in --bench_dir (the temp
+//! directory by default). They are sparse, so nothing is read from the disk, --bench_dense fills
+//! them with data instead, on a tmpfs like /dev/shm they stay in memory
+#include <benchmark/benchmark.h>
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include <functional>
+#include <fstream>
+#include <iomanip>
+#include <mutex>
+#include <optional>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "chunking.h"
+#include "hashcalc.h"
+#include "hashes.h"
+#include "utils.h"
+
+namespace {
+//! Input of the hashing benchmarks, blocks are taken from it in turns
+constexpr uint64_t data_size = 16ull * 1024 * 1024;
+//! Tasks of 1 byte published per iteration of the dispatch benchmark
+constexpr uint64_t dispatch_tasks = 1ull << 20;
+constexpr uint64_t dispatch_window_blocks = 1ull << 16;
+constexpr uint32_t dispatch_windows = 3;
+
+const std::vector<char>& random_data() {
+  static const auto data = [] {
+    std::vector<char> bytes(data_size);
+    uint64_t state = 0x9E3779B97F4A7C15ull;
+    for (auto& byte : bytes) {
+      state = state * 6364136223846793005ull + 1442695040888963407ull;
+      byte = static_cast<char>(state >> 56);
+    }
+    return bytes;
+  }();
+  return data;
+}
+
+//! Hashes blocks of state.range(0) bytes
+template <typename THash>
+void hash_blocks(benchmark::State& state, THash hash) {
+  const auto& data = random_data();
+  const auto block_size = uint64_t(state.range(0));
+  CDigest digest = {};
+  uint64_t offset = 0;
+  for (auto _ : state) {
+    if (offset + block_size > data.size()) {
+      offset = 0;
+    }
+    hash(data.data() + offset, size_t(block_size), digest.data());
+    benchmark::DoNotOptimize(digest);
+    offset += block_size;
+  }
+  state.SetBytesProcessed(int64_t(state.iterations() * block_size));
+}
+
+void BM_Sha256(benchmark::State& state, HashCalc::ESha256Backend backend) {
+  hash_blocks(state, get_sha256_function(backend));
+}
+
+//! The multi-buffer kernel hashes lanes blocks per call
+void BM_Sha256Lanes(benchmark::State& state, uint32_t lanes) {
+  const auto kernel = get_sha256_lanes_function(lanes);
+  const auto& data = random_data();
+  const auto block_size = uint64_t(state.range(0));
+  std::vector<CDigest> digests(lanes);
+  const char* lanes_data[sha256_max_lanes];
+  unsigned char* lanes_digests[sha256_max_lanes];
+  for (uint32_t lane = 0; lane < lanes; lane++) {
+    lanes_digests[lane] = digests[lane].data();
+  }
+  uint64_t offset = 0;
+  for (auto _ : state) {
+    if (offset + lanes * block_size > data.size()) {
+      offset = 0;
+    }
+    for (uint32_t lane = 0; lane < lanes; lane++) {
+      lanes_data[lane] = data.data() + offset + lane * block_size;
+    }
+    kernel(lanes_data, size_t(block_size), lanes_digests);
+    benchmark::DoNotOptimize(digests.data());
+    offset += lanes * block_size;
+  }
+  state.SetBytesProcessed(int64_t(state.iterations() * lanes * block_size));
+}
+
+template <typename THasher>
+void BM_Algorithm(benchmark::State& state) {
+  hash_blocks(state, THasher::hash);
+}
+
+//! Mutex-per-task queue which CTaskManager replaced, the baseline of the dispatch rate
+class CMutexTaskManager {
+ public:
+  struct CTask {
+    uint32_t window;
+    const char* data;
+    uint64_t size;
+    uint64_t index;
+  };
+
+  std::optional<CTask> get_task() {
+    std::unique_lock lock(m_mutex);
+    m_cv.wait(lock, [this] { return !m_tasks.empty() || m_should_stop; });
+    if (m_tasks.empty()) {
+      return std::nullopt;
+    }
+    auto task = m_tasks.front();
+    m_tasks.pop_front();
+    return task;
+  }
+
+  void add_tasks(const std::vector<CTask>& tasks) {
+    {
+      std::unique_lock lock(m_mutex);
+      m_tasks.insert(m_tasks.end(), tasks.begin(), tasks.end());
+    }
+    m_cv.notify_all();
+  }
+
+  void stop() {
+    {
+      std::unique_lock lock(m_mutex);
+      m_should_stop = true;
+      m_tasks.clear();
+    }
+    m_cv.notify_all();
+  }
+
+ private:
+  std::mutex m_mutex;
+  std::condition_variable m_cv;
+  std::deque<CTask> m_tasks;
+  bool m_should_stop = false;
+};
+
+//! One iteration of a dispatch benchmark: the reader publishes windows of 1 byte blocks through
+//! add_window, threads_count workers hash them, the writer releases the windows in order
+void run_dispatch(uint32_t threads_count,
+                  const std::function<void(CBufferRing&)>& worker,
+                  const std::function<void(uint32_t, const char*)>& add_window,
+                  const std::function<void()>& stop) {
+  static const std::vector<char> data(dispatch_window_blocks, 1);
+  CBufferRing ring;
+  ring.allocate(dispatch_windows, 0);
+  std::vector<std::thread> workers;
+  for (uint32_t i = 0; i < threads_count; i++) {
+    workers.emplace_back([&] { worker(ring); });
+  }
+  std::thread writer([&] {
+    for (uint32_t window = 0; ring.wait_hashed(window); window = (window + 1) % dispatch_windows) {
+      ring.release(window);
+    }
+  });
+  uint32_t window = 0;
+  for (uint64_t published = 0; published < dispatch_tasks; published += dispatch_window_blocks) {
+    ring.wait_free(window);
+    ring.publish(window, published, dispatch_window_blocks);
+    add_window(window, data.data());
+    window = (window + 1) % dispatch_windows;
+  }
+  ring.finish();
+  writer.join();
+  stop();
+  for (auto& thread : workers) {
+    thread.join();
+  }
+}
+
+//! Dispatch rate of CTaskManager: state.range(0) workers claim batches of state.range(1) blocks
+void BM_TaskDispatch(benchmark::State& state) {
+  const auto threads_count = uint32_t(state.range(0));
+  const auto batch_size = uint64_t(state.range(1));
+  for (auto _ : state) {
+    CTaskManager manager;
+    manager.init(dispatch_windows, 1, dispatch_window_blocks, batch_size);
+    std::atomic_uint64_t sink(0);
+    run_dispatch(
+        threads_count,
+        [&](CBufferRing& ring) {
+          uint64_t local = 0;
+          while (auto task = manager.get_task()) {
+            for (uint64_t j = 0; j < task->count; j++) {
+              local += uint64_t(task->data[j]);
+            }
+            ring.task_done(task->window, task->count);
+          }
+          sink += local;
+        },
+        [&](uint32_t window, const char* data) {
+          manager.add_window(window, data, dispatch_window_blocks);
+        },
+        [&] { manager.stop(); });
+    benchmark::DoNotOptimize(sink.load());
+  }
+  state.SetItemsProcessed(int64_t(state.iterations() * dispatch_tasks));
+}
+
+//! Dispatch rate of CMutexTaskManager, a task per block, state.range(0) workers
+void BM_TaskDispatchMutex(benchmark::State& state) {
+  const auto threads_count = uint32_t(state.range(0));
+  for (auto _ : state) {
+    CMutexTaskManager manager;
+    std::vector<CMutexTaskManager::CTask> tasks;
+    tasks.reserve(dispatch_window_blocks);
+    uint64_t index = 0;
+    std::atomic_uint64_t sink(0);
+    run_dispatch(
+        threads_count,
+        [&](CBufferRing& ring) {
+          uint64_t local = 0;
+          while (auto task = manager.get_task()) {
+            local += uint64_t(*task->data);
+            ring.task_done(task->window);
+          }
+          sink += local;
+        },
+        [&](uint32_t window, const char* data) {
+          for (uint64_t i = 0; i < dispatch_window_blocks; i++) {
+            tasks.push_back({window, data + i, 1, index++});
+          }
+          manager.add_tasks(tasks);
+          tasks.clear();
+        },
+        [&] { manager.stop(); });
+    benchmark::DoNotOptimize(sink.load());
+  }
+  state.SetItemsProcessed(int64_t(state.iterations() * dispatch_tasks));
+}
+
+//! Digests the writer encodes per iteration of the hex benchmarks, 1MB chunks of lines
+constexpr uint64_t hex_digests = 10'000'000;
+
+//! Distinct digests of the hex benchmarks, encoded over and over until hex_digests
+const std::vector<CDigest>& random_digests() {
+  static const auto digests = [] {
+    std::vector<CDigest> result(1u << 16);
+    std::memcpy(result.data(), random_data().data(), result.size() * sizeof(CDigest));
+    return result;
+  }();
+  return digests;
+}
+
+//! Collection of the digests by the writer: windows of index-addressed digests are encoded into
+//! chunks of hex lines, digests of state.range(0) bytes
+void BM_HexLines(benchmark::State& state) {
+  const auto digest_length = uint64_t(state.range(0));
+  const auto& digests = random_digests();
+  std::vector<char> chunk(HashCalc::write_chunk_size);
+  const auto chunk_lines = chunk.size() / (digest_length * 2 + 1);
+  for (auto _ : state) {
+    for (uint64_t i = 0; i < hex_digests;) {
+      const auto offset = i % digests.size();
+      const auto lines = std::min({chunk_lines, digests.size() - offset, hex_digests - i});
+      digests_to_hex_lines(digests.data() + offset, lines, chunk.data(), digest_length);
+      benchmark::DoNotOptimize(chunk.data());
+      i += lines;
+    }
+  }
+  state.SetItemsProcessed(int64_t(state.iterations() * hex_digests));
+  state.SetBytesProcessed(int64_t(state.iterations() * hex_digests * (digest_length * 2 + 1)));
+}
+
+//! Previous encoder of the writer, a stream per digest
+std::string stream_digest_to_hex(const CDigest& digest) {
+  std::ostringstream os;
+  os << std::hex << std::setfill('0');
+
+  for (auto i : digest) {
+    os << std::setw(2) << static_cast<unsigned int>(i);
+  }
+  return os.str();
+}
+
+//! Baseline of HexLines/32: the lines of std::ostringstream appended to the chunk
+void BM_HexStream(benchmark::State& state) {
+  const auto& digests = random_digests();
+  if (stream_digest_to_hex(digests[1]) != digest_to_hex(digests[1])) {
+    state.SkipWithError("Encoders don't match");
+    return;
+  }
+  std::string chunk;
+  chunk.reserve(HashCalc::write_chunk_size + hex_line_length);
+  for (auto _ : state) {
+    for (uint64_t i = 0; i < hex_digests; i++) {
+      chunk += stream_digest_to_hex(digests[i % digests.size()]);
+      chunk += '\n';
+      if (chunk.size() >= HashCalc::write_chunk_size) {
+        benchmark::DoNotOptimize(chunk.data());
+        chunk.clear();
+      }
+    }
+    benchmark::DoNotOptimize(chunk.data());
+    chunk.clear();
+  }
+  state.SetItemsProcessed(int64_t(state.iterations() * hex_digests));
+  state.SetBytesProcessed(int64_t(state.iterations() * hex_digests * hex_line_length));
+}
+
+//! Cut point candidates of the content-defined chunks on one core, average state.range(0)
+void BM_ChunkCandidates(benchmark::State& state) {
+  const auto& data = random_data();
+  const auto average = uint64_t(state.range(0));
+  std::vector<uint64_t> candidates;
+  for (auto _ : state) {
+    candidates.clear();
+    Chunking::find_candidates(data.data(), data.size(), 0, 0, average, candidates);
+    benchmark::DoNotOptimize(candidates.data());
+  }
+  state.SetBytesProcessed(int64_t(state.iterations() * data.size()));
+}
+
+//! Signs the file with the pool of every core, the signature is written next to it
+void BM_SignFile(benchmark::State& state,
+                 const std::string& path,
+                 HashCalc::EReadEngine engine,
+                 HashCalc::EAlgorithm algorithm) {
+  HashCalc::COptions options;
+  options.read_engine = engine;
+  options.algorithm = algorithm;
+  options.print_timings = false;
+  const auto block_size = uint64_t(state.range(0));
+  uint64_t cpu_micro = 0;
+  uint64_t wall_micro = 0;
+  for (auto _ : state) {
+    CHashCalc calc(path, path + ".sig", block_size, options);
+    calc.run();
+    cpu_micro += calc.get_cpu_micro();
+    wall_micro += calc.get_wall_micro();
+  }
+  const auto size = fs::file_size(path);
+  state.SetBytesProcessed(int64_t(state.iterations() * size));
+  state.counters["cores_busy"] = double(cpu_micro) / double(std::max(wall_micro, uint64_t(1)));
+  std::error_code ec;
+  fs::remove(path + ".sig", ec);
+}
+
+//! Signs 256MB of memory through the library API, the digests go to a callback
+void BM_SignMemory(benchmark::State& state) {
+  const auto& data = random_data();
+  std::vector<char> input(256 * HashCalc::one_megabyte);
+  for (size_t offset = 0; offset < input.size(); offset += data.size()) {
+    std::memcpy(input.data() + offset, data.data(), std::min(data.size(), input.size() - offset));
+  }
+  HashCalc::COptions options;
+  options.print_timings = false;
+  uint64_t digests = 0;
+  for (auto _ : state) {
+    CHashCalc calc(input.data(), input.size(), uint64_t(state.range(0)), options);
+    calc.run([&digests](uint64_t, const CDigest*, uint64_t count) { digests += count; });
+  }
+  benchmark::DoNotOptimize(digests);
+  state.SetBytesProcessed(int64_t(state.iterations() * input.size()));
+}
+
+//! Sparse file of size bytes or one filled with the random data, returns false on errors
+bool create_input(const std::string& path, uint64_t size, bool dense) {
+  std::ofstream file(path, std::ios::binary | std::ios::trunc);
+  if (dense) {
+    const auto& data = random_data();
+    for (uint64_t written = 0; written < size && file; written += data.size()) {
+      file.write(data.data(), std::streamsize(std::min(data.size(), size - written)));
+    }
+  }
+  file.close();
+  std::error_code ec;
+  if (!dense) {
+    fs::resize_file(path, size, ec);
+  }
+  return file && !ec;
+}
+
+const char* engine_name(HashCalc::EReadEngine engine) {
+  switch (engine) {
+    case HashCalc::EReadEngine::stream:
+      return "stream";
+    case HashCalc::EReadEngine::mmap:
+      return "mmap";
+    case HashCalc::EReadEngine::async:
+      return "async";
+    case HashCalc::EReadEngine::pread:
+      return "pread";
+    default:
+      return "auto";
+  }
+}
+}  // namespace
+
+int main(int argc, char** argv) {
+  benchmark::Initialize(&argc, argv);
+  auto bench_dir = fs::temp_directory_path().string();
+  std::vector<uint64_t> sizes = {1};
+  auto dense = false;
+  // Options of the end-to-end runs, Initialize() has taken its own
+  int kept = 1;
+  for (int i = 1; i < argc; i++) {
+    const std::string arg = argv[i];
+    if (arg.rfind("--bench_dir=", 0) == 0) {
+      bench_dir = arg.substr(12);
+    } else if (arg.rfind("--bench_sizes=", 0) == 0) {
+      sizes.clear();
+      std::stringstream list(arg.substr(14));
+      for (std::string size; std::getline(list, size, ',');) {
+        if (const auto gigabytes = std::strtoull(size.c_str(), nullptr, 10)) {
+          sizes.push_back(gigabytes);
+        }
+      }
+    } else if (arg == "--bench_dense") {
+      dense = true;
+    } else {
+      argv[kept++] = argv[i];
+    }
+  }
+  if (benchmark::ReportUnrecognizedArguments(kept, argv)) {
+    return 1;
+  }
+  benchmark::AddCustomContext("sha256_backend",
+                              get_sha256_backend_name(get_best_sha256_backend()));
+  benchmark::AddCustomContext("sha256_lanes", std::to_string(get_best_sha256_lanes()));
+  benchmark::AddCustomContext("workers", std::to_string(CThreadPool::instance().count()));
+  benchmark::AddCustomContext("bench_files", dense ? "dense" : "sparse");
+
+  const std::vector<int64_t> block_sizes = {64, 4096, 64 * 1024, 1024 * 1024};
+  for (auto backend : {HashCalc::ESha256Backend::mbedtls, HashCalc::ESha256Backend::shani,
+                       HashCalc::ESha256Backend::armv8}) {
+    if (is_sha256_backend_supported(backend)) {
+      benchmark::RegisterBenchmark(
+          (std::string("Sha256/") + get_sha256_backend_name(backend)).c_str(), BM_Sha256,
+          backend)
+          ->ArgsProduct({block_sizes});
+    }
+  }
+  for (uint32_t lanes : {4u, 8u, 16u}) {
+    if (is_sha256_lanes_supported(lanes)) {
+      benchmark::RegisterBenchmark(("Sha256Lanes/x" + std::to_string(lanes)).c_str(),
+                                   BM_Sha256Lanes, lanes)
+          ->ArgsProduct({{64, 4096, 64 * 1024}});
+    }
+  }
+  benchmark::RegisterBenchmark("Algorithm/sha512-256", BM_Algorithm<CSha512_256>)
+      ->ArgsProduct({block_sizes});
+  benchmark::RegisterBenchmark("Algorithm/blake3", BM_Algorithm<CBlake3>)
+      ->ArgsProduct({block_sizes});
+  benchmark::RegisterBenchmark("Algorithm/xxh3-128", BM_Algorithm<CXxh3_128>)
+      ->ArgsProduct({block_sizes});
+  std::vector<int64_t> threads;
+  for (uint32_t count = 1; count <= std::max(get_threads_count() * 2, 8u); count *= 2) {
+    threads.push_back(count);
+  }
+  benchmark::RegisterBenchmark("TaskDispatch", BM_TaskDispatch)
+      ->ArgsProduct({threads, {1, int64_t(HashCalc::task_batch_size)}})
+      ->ArgNames({"threads", "batch"})
+      ->UseRealTime()
+      ->Unit(benchmark::kMillisecond);
+  benchmark::RegisterBenchmark("TaskDispatchMutex", BM_TaskDispatchMutex)
+      ->ArgsProduct({threads})
+      ->ArgNames({"threads"})
+      ->UseRealTime()
+      ->Unit(benchmark::kMillisecond);
+  benchmark::RegisterBenchmark("HexLines", BM_HexLines)
+      ->Arg(16)
+      ->Arg(32)
+      ->Unit(benchmark::kMillisecond);
+  benchmark::RegisterBenchmark("HexStream", BM_HexStream)->Unit(benchmark::kMillisecond);
+  benchmark::RegisterBenchmark("ChunkCandidates", BM_ChunkCandidates)
+      ->Arg(8192)
+      ->Unit(benchmark::kMillisecond);
+
+  benchmark::RegisterBenchmark("SignMemory", BM_SignMemory)
+      ->Arg(4096)
+      ->Arg(1024 * 1024)
+      ->UseRealTime()
+      ->Unit(benchmark::kMillisecond);
+
+  std::vector<std::string> inputs;
+  for (const auto gigabytes : sizes) {
+    const auto path =
+        (fs::path(bench_dir) / ("signature_bench_" + std::to_string(gigabytes) + "gb.bin"))
+            .string();
+    if (!create_input(path, gigabytes << 30, dense)) {
+      std::cerr << "Couldn't create " << path << std::endl;
+      return 1;
+    }
+    inputs.push_back(path);
+    const auto prefix = "SignFile/" + std::to_string(gigabytes) + "GB/";
+    for (auto engine : {HashCalc::EReadEngine::mmap, HashCalc::EReadEngine::stream,
+                        HashCalc::EReadEngine::async, HashCalc::EReadEngine::pread}) {
+      benchmark::RegisterBenchmark((prefix + engine_name(engine)).c_str(), BM_SignFile, path,
+                                   engine, HashCalc::EAlgorithm::sha256)
+          ->Arg(4096)
+          ->Arg(1024 * 1024)
+          ->Iterations(1)
+          ->UseRealTime()
+          ->Unit(benchmark::kMillisecond);
+    }
+    benchmark::RegisterBenchmark((prefix + "blake3").c_str(), BM_SignFile, path,
+                                 HashCalc::EReadEngine::automatic, HashCalc::EAlgorithm::blake3)
+        ->Arg(1024 * 1024)
+        ->Iterations(1)
+        ->UseRealTime()
+        ->Unit(benchmark::kMillisecond);
+  }
+  benchmark::RunSpecifiedBenchmarks();
+  benchmark::Shutdown();
+  for (const auto& path : inputs) {
+    std::error_code ec;
+    fs::remove(path, ec);
+  }
+  return 0;
+}
@@ -0,0 +1,176 @@
+#include "chunking.h"
+
+#ifdef _WIN32
+#include <fcntl.h>
+#include <io.h>
+#endif
+
+namespace {
+//! Block hash of hashes.h, SHA256 goes through the backend
+CSha256Function chunk_hash_function(HashCalc::EAlgorithm algorithm,
+                                    HashCalc::ESha256Backend backend) {
+  switch (algorithm) {
+    case HashCalc::EAlgorithm::sha512_256:
+      return CSha512_256::hash;
+    case HashCalc::EAlgorithm::blake3:
+      return CBlake3::hash;
+    case HashCalc::EAlgorithm::xxh3_128:
+      return CXxh3_128::hash;
+    default:
+      return get_sha256_function(backend);
+  }
+}
+}  // namespace
+//!
+//! \param in_path Incoming file path, - is the standard input
+//! \param out_path Output file path (a line per chunk)
+//! \param sizes Minimal, average and maximal chunk sizes
+//! \param options Algorithm, SHA256 backend, read engine, round size and the workers
+CChunkCalc::CChunkCalc(const std::string& in_path,
+                       const std::string& out_path,
+                       const HashCalc::CChunkSizes& sizes,
+                       const HashCalc::COptions& options)
+    : m_in_file_path(in_path),
+      m_out_file_path(out_path),
+      m_sizes(sizes),
+      m_algorithm(options.algorithm),
+      m_digest_length(get_digest_length(options.algorithm)),
+      m_hash(nullptr),
+      m_read_engine(options.read_engine),
+      m_round_size(std::max(options.buffer_size, sizes.max)),
+      m_thread_pool(options.thread_pool ? options.thread_pool : &CThreadPool::instance()),
+      m_print_timings(options.print_timings),
+      m_cutter(sizes),
+      m_in_size(0),
+      m_chunks_count(0) {
+  if (m_sizes.average < HashCalc::min_chunk_average || m_sizes.min > m_sizes.average ||
+      m_sizes.average > m_sizes.max || !m_sizes.min) {
+    throw std::invalid_argument("Chunk sizes must be 0 < min <= average <= max and average >= " +
+                                std::to_string(HashCalc::min_chunk_average));
+  }
+  if (!m_digest_length) {
+    throw std::invalid_argument("Unknown hash algorithm " + std::to_string(uint32_t(m_algorithm)));
+  }
+  if (!options.verify_path.empty() || !options.previous_path.empty() || options.write_sidecar ||
+      options.merkle || !options.merkle_tree_path.empty() ||
+      options.file_digest != HashCalc::EFileDigest::none ||
+      options.output_format != HashCalc::EOutputFormat::text) {
+    throw std::invalid_argument("Content-defined chunks make text signatures only");
+  }
+  m_hash = chunk_hash_function(m_algorithm, options.sha256_backend);
+}
+//! Maps a regular file or reads the input in rounds, the bytes of the chunk which isn't complete
+//! at the end of a round and the history of the rolling hash are moved to the front of the buffer
+void CChunkCalc::run() {
+  // An empty stream gets the first line only
+  std::error_code ec;
+  if (fs::is_regular_file(m_in_file_path, ec) && !fs::file_size(m_in_file_path, ec)) {
+    throw std::runtime_error("Fatal error, file is empty " + m_in_file_path.string());
+  }
+  if (fs::equivalent(m_in_file_path, m_out_file_path, ec)) {
+    throw std::invalid_argument("Output file is the input file " + m_out_file_path.string());
+  }
+  std::ofstream out_file(m_out_file_path, std::ios::trunc);
+  if (!out_file.is_open()) {
+    throw std::runtime_error("Fatal error, couldn't open output file " +
+                             m_out_file_path.string());
+  }
+  m_timer.start();
+  out_file << "#cdc " << get_algorithm_name(m_algorithm) << ' ' << m_sizes.min << ' '
+           << m_sizes.average << ' ' << m_sizes.max << '\n';
+  CMappedFile mapped_file;
+  const auto streamed = m_in_file_path == "-" || m_read_engine == HashCalc::EReadEngine::stream ||
+                        !mapped_file.open(m_in_file_path.string());
+  if (streamed && m_read_engine == HashCalc::EReadEngine::mmap) {
+    throw std::runtime_error("Fatal error, couldn't map file " + m_in_file_path.string());
+  }
+  if (!streamed) {
+    m_in_size = mapped_file.size();
+    mapped_file.will_need(0, m_round_size);
+    for (uint64_t offset = 0; offset < m_in_size; offset += m_round_size) {
+      const auto end = std::min(m_in_size, offset + m_round_size);
+      mapped_file.will_need(end, m_round_size);
+      process(mapped_file.data(), 0, offset, end, end == m_in_size, out_file);
+    }
+  } else {
+    std::ifstream file;
+    const auto from_stdin = m_in_file_path == "-";
+    std::istream& fs = from_stdin ? std::cin : file;
+    if (from_stdin) {
+#ifdef _WIN32
+      _setmode(_fileno(stdin), _O_BINARY);
+#endif
+    } else if (file.open(m_in_file_path, std::ios::binary); !file.is_open()) {
+      throw std::runtime_error("Fatal error, couldn't open file " + m_in_file_path.string());
+    }
+    // The carried chunk is shorter than max, the history is shorter than the window
+    std::vector<char> buffer(m_round_size + m_sizes.max + Chunking::window);
+    uint64_t base_offset = 0;
+    uint64_t used = 0;
+    for (auto last = false; !last;) {
+      const auto read =
+          uint64_t(fs.read(buffer.data() + used, std::streamsize(m_round_size)).gcount());
+      last = read < m_round_size;
+      const auto offset = base_offset + used;
+      process(buffer.data(), base_offset, offset, offset + read, last, out_file);
+      used += read;
+      const auto end = base_offset + used;
+      const auto keep = std::min(m_cutter.start(), end - std::min(end, Chunking::window - 1));
+      std::memmove(buffer.data(), buffer.data() + (keep - base_offset), size_t(end - keep));
+      used = end - keep;
+      base_offset = keep;
+    }
+    m_in_size = base_offset + used;
+  }
+  out_file.flush();
+  if (!out_file) {
+    throw std::runtime_error("Fatal error, couldn't write output file " +
+                             m_out_file_path.string());
+  }
+  m_timer.stop();
+  if (m_print_timings) {
+    std::cout << "Chunking completed - " << m_timer.get_micro() << " us" << std::endl;
+  }
+}
+
+void CChunkCalc::process(const char* base,
+                         uint64_t base_offset,
+                         uint64_t offset,
+                         uint64_t end,
+                         bool last,
+                         std::ofstream& out_file) {
+  // Candidates of the segments in parallel, the history of a segment is in front of it
+  const auto segments = (end - offset + HashCalc::chunk_scan_segment - 1) /
+                        HashCalc::chunk_scan_segment;
+  std::vector<std::vector<uint64_t>> candidates(segments);
+  parallel_for(*m_thread_pool, segments, [&](uint64_t segment) {
+    const auto begin = offset + segment * HashCalc::chunk_scan_segment;
+    const auto size = std::min(HashCalc::chunk_scan_segment, end - begin);
+    candidates[segment].reserve(size_t(size * 4 >> Chunking::average_bits(m_sizes.average)));
+    Chunking::find_candidates(base + (begin - base_offset), size, begin - base_offset, begin,
+                              m_sizes.average, candidates[segment]);
+  });
+  const auto chunk_begin = m_cutter.start();
+  std::vector<uint64_t> ends;
+  for (uint64_t segment = 0; segment < segments; segment++) {
+    const auto segment_end = std::min(end, offset + (segment + 1) * HashCalc::chunk_scan_segment);
+    m_cutter.cut(candidates[segment], segment_end, last && segment_end == end, ends);
+  }
+  if (last && !segments) {
+    // The input ended with the previous round
+    m_cutter.cut({}, end, true, ends);
+  }
+  // The chunks of the round in parallel
+  std::vector<CDigest> digests(ends.size());
+  parallel_for(*m_thread_pool, ends.size(), [&](uint64_t i) {
+    const auto begin = i ? ends[i - 1] : chunk_begin;
+    m_hash(base + (begin - base_offset), size_t(ends[i] - begin), digests[i].data());
+  });
+  auto begin = chunk_begin;
+  for (size_t i = 0; i < ends.size(); i++) {
+    out_file << begin << ' ' << ends[i] - begin << ' ' << digest_to_hex(digests[i], m_digest_length)
+             << '\n';
+    begin = ends[i];
+  }
+  m_chunks_count += ends.size();
+}
@@ -0,0 +1,237 @@
+#ifndef SIGNATURE_CHUNKING_H
+#define SIGNATURE_CHUNKING_H
+
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "hashcalc.h"
+
+namespace HashCalc {
+//! Sizes of the content-defined chunks, min <= average <= max. The average is rounded down to a
+//! power of two, the last chunk of the input may be shorter than min
+struct CChunkSizes {
+  uint64_t min = 2048;
+  uint64_t average = 8192;
+  uint64_t max = 65536;
+};
+//! Smallest average, the masks need a few bits on either side of it
+constexpr uint64_t min_chunk_average = 64;
+//! Workers look for the cut points in segments of this size
+constexpr uint64_t chunk_scan_segment = one_megabyte;
+}  // namespace HashCalc
+
+//! FastCDC with the Gear rolling hash. <br>
+//! The hash of a position is sum(gear[byte i - k] << k) over the 64 bytes up to it, older bytes are
+//! shifted out. Unlike the original FastCDC the hash doesn't restart at every chunk, so whether a
+//! position is a cut point candidate depends on the data only, not on the previous cuts. Workers
+//! find the candidates of their segments in parallel, one pass over them in order picks the cuts
+//! the sequential algorithm would. <br>
+//! Normalized chunking: a chunk ends at the first candidate after min bytes which passes the
+//! strict mask before average bytes or the loose mask after them, at max bytes if there is none
+namespace Chunking {
+//! Bytes of the input a hash depends on
+constexpr uint64_t window = 64;
+
+//! Random table of the Gear hash, splitmix64 of the byte
+constexpr std::array<uint64_t, 256> gear = [] {
+  std::array<uint64_t, 256> table = {};
+  uint64_t state = 0;
+  for (auto& value : table) {
+    state += 0x9E3779B97F4A7C15ull;
+    uint64_t z = state;
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+    value = z ^ (z >> 31);
+  }
+  return table;
+}();
+
+//! Top bits of the hash tested by the masks, they depend on the whole window
+inline uint64_t top_bits_mask(uint32_t bits) {
+  return ~0ull << (64 - bits);
+}
+
+inline uint32_t average_bits(uint64_t average) {
+  uint32_t bits = 0;
+  while (average >> (bits + 1)) {
+    bits++;
+  }
+  return bits;
+}
+
+//! Passed by 1 of average * 4 positions
+inline uint64_t strict_mask(uint64_t average) {
+  return top_bits_mask(average_bits(average) + 2);
+}
+
+//! Passed by 1 of average / 4 positions, every strict candidate passes it as well
+inline uint64_t loose_mask(uint64_t average) {
+  return top_bits_mask(average_bits(average) - 2);
+}
+
+//! Hash of the position before data, data[-history] .. data[-1] are the bytes before it
+inline uint64_t window_hash(const char* data, uint64_t history) {
+  uint64_t hash = 0;
+  for (auto k = std::min(history, window - 1); k > 0; k--) {
+    hash = (hash << 1) + gear[static_cast<unsigned char>(data[-int64_t(k)])];
+  }
+  return hash;
+}
+
+//! Appends the candidates among the positions offset + 1 .. offset + size, a candidate p is the
+//! end of a chunk of the bytes before p: p << 1 | 1 if it passes the strict mask, p << 1 if only
+//! the loose one. data[-history] .. data[-1] are the bytes before offset, up to window - 1 of them.
+//! <br> Every hash waits for the previous one, so 4 parts of the range are hashed at once
+inline void find_candidates(const char* data,
+                            uint64_t size,
+                            uint64_t history,
+                            uint64_t offset,
+                            uint64_t average,
+                            std::vector<uint64_t>& candidates) {
+  constexpr uint32_t lanes = 4;
+  const auto strict = strict_mask(average);
+  const auto loose = loose_mask(average);
+  const auto part = size / lanes;
+  uint64_t hashes[lanes];
+  // The first lane appends to candidates straight away, the others follow it in order
+  std::vector<uint64_t> found[lanes];
+  for (uint32_t lane = 0; lane < lanes; lane++) {
+    hashes[lane] = window_hash(data + lane * part, history + lane * part);
+    found[lane].reserve(candidates.capacity() / lanes);
+  }
+  found[0].swap(candidates);
+  for (uint64_t i = 0; i < part; i++) {
+    for (uint32_t lane = 0; lane < lanes; lane++) {
+      const auto position = lane * part + i;
+      hashes[lane] = (hashes[lane] << 1) + gear[static_cast<unsigned char>(data[position])];
+      if (!(hashes[lane] & loose)) {
+        found[lane].push_back((offset + position + 1) << 1 | uint64_t(!(hashes[lane] & strict)));
+      }
+    }
+  }
+  // The rest continues the last part
+  auto& hash = hashes[lanes - 1];
+  for (auto position = lanes * part; position < size; position++) {
+    hash = (hash << 1) + gear[static_cast<unsigned char>(data[position])];
+    if (!(hash & loose)) {
+      found[lanes - 1].push_back((offset + position + 1) << 1 | uint64_t(!(hash & strict)));
+    }
+  }
+  found[0].swap(candidates);
+  for (uint32_t lane = 1; lane < lanes; lane++) {
+    candidates.insert(candidates.end(), found[lane].begin(), found[lane].end());
+  }
+}
+
+//! Picks the cuts from the candidates in order, the chunk being cut may span any number of calls
+class CCutter {
+ public:
+  explicit CCutter(const HashCalc::CChunkSizes& sizes) : m_sizes(sizes), m_start(0) {}
+
+  //! Start of the chunk which isn't cut yet
+  [[nodiscard]] uint64_t start() const { return m_start; }
+
+  //! Takes the candidates of the positions up to end and appends the ends of the chunks which are
+  //! complete. If last, end is the end of the input and the rest becomes the last chunk
+  void cut(const std::vector<uint64_t>& candidates,
+           uint64_t end,
+           bool last,
+           std::vector<uint64_t>& ends) {
+    for (const auto candidate : candidates) {
+      const auto position = candidate >> 1;
+      while (position > m_start + m_sizes.max) {
+        add(m_start + m_sizes.max, ends);
+      }
+      const auto length = position - m_start;
+      if (length >= m_sizes.min && (length >= m_sizes.average || (candidate & 1))) {
+        add(position, ends);
+      }
+    }
+    while (m_start + m_sizes.max <= end) {
+      add(m_start + m_sizes.max, ends);
+    }
+    if (last && m_start < end) {
+      add(end, ends);
+    }
+  }
+
+ private:
+  void add(uint64_t end, std::vector<uint64_t>& ends) {
+    ends.push_back(end);
+    m_start = end;
+  }
+
+  HashCalc::CChunkSizes m_sizes;
+  uint64_t m_start;
+};
+}  // namespace Chunking
+
+//! Signature of content-defined chunks: an inserted or removed byte changes the chunks around it
+//! only, the chunks after it keep their digests at shifted offsets. <br>
+//! The input is processed in rounds of options.buffer_size: workers find the cut point candidates
+//! of its segments, the cuts are picked in order, workers hash the chunks, the lines are written.
+//! A chunk which isn't complete at the end of a round is carried over. Regular files are mapped,
+//! streams are read into a buffer which keeps the carried bytes. <br>
+//! The text signature starts with "#cdc algorithm min average max", a line "offset length digest"
+//! follows for every chunk
+class CChunkCalc {
+ public:
+  //! Throws std::invalid_argument for wrong sizes and for the options of the block signatures
+  CChunkCalc(const std::string& in_path,
+             const std::string& out_path,
+             const HashCalc::CChunkSizes& sizes,
+             const HashCalc::COptions& options = {});
+
+  ~CChunkCalc() = default;
+
+  CChunkCalc(const CChunkCalc&) = delete;
+
+  CChunkCalc& operator=(CChunkCalc const&) = delete;
+
+  CChunkCalc(CChunkCalc&&) = delete;
+
+  CChunkCalc& operator=(CChunkCalc&&) = delete;
+
+  //! Can throw exceptions runtime_error and invalid_argument
+  void run();
+
+  //! Chunks written, valid after run()
+  [[nodiscard]] uint64_t get_chunks_count() const { return m_chunks_count; }
+
+  //! Size of the input, valid after run()
+  [[nodiscard]] uint64_t get_input_size() const { return m_in_size; }
+
+  //! Wall time of run()
+  [[nodiscard]] uint64_t get_wall_micro() const { return m_timer.get_micro(); }
+
+ private:
+  //! Finds the chunks of the bytes offset .. end, base holds the input from base_offset on. The
+  //! complete chunks are hashed and written
+  void process(const char* base,
+               uint64_t base_offset,
+               uint64_t offset,
+               uint64_t end,
+               bool last,
+               std::ofstream& out_file);
+
+  fs::path m_in_file_path;
+  fs::path m_out_file_path;
+  HashCalc::CChunkSizes m_sizes;
+  HashCalc::EAlgorithm m_algorithm;
+  uint64_t m_digest_length;
+  //! Hash of the chunks, SHA256 of the best backend or one of hashes.h
+  CSha256Function m_hash;
+  HashCalc::EReadEngine m_read_engine;
+  uint64_t m_round_size;
+  CThreadPool* m_thread_pool;
+  bool m_print_timings;
+  Chunking::CCutter m_cutter;
+  uint64_t m_in_size;
+  uint64_t m_chunks_count;
+  CTimer m_timer;
+};
+
+#endif  // SIGNATURE_CHUNKING_H
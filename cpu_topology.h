@@ -0,0 +1,165 @@
+#ifndef SIGNATURE_CPU_TOPOLOGY_H
+#define SIGNATURE_CPU_TOPOLOGY_H
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdlib>
+#include <fstream>
+#include <map>
+#include <string>
+#include <thread>
+#include <vector>
+
+#ifdef _WIN32
+#include <Windows.h>
+#elif defined(__linux__)
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+//! CPU and NUMA node of a worker thread, nodes are numbered from 0 among the nodes in use
+struct CWorkerPlacement {
+  int32_t cpu = -1;  //!< -1 means the thread isn't pinned
+  uint32_t node = 0;
+};
+
+//! Parses a CPU list like "0-3,8,10-11" (the format of taskset and sysfs), duplicates are
+//! dropped, the order is kept. Returns false on syntax errors
+inline bool parse_cpu_list(const std::string& text, std::vector<uint32_t>& cpus) {
+  const auto parse_number = [](const std::string& digits, uint32_t& number) {
+    if (digits.empty() || digits.size() > 5 ||
+        digits.find_first_not_of("0123456789") != std::string::npos) {
+      return false;
+    }
+    number = uint32_t(std::stoul(digits));
+    return true;
+  };
+  cpus.clear();
+  for (size_t pos = 0; pos <= text.size();) {
+    auto end = text.find(',', pos);
+    if (end == std::string::npos) {
+      end = text.size();
+    }
+    const auto item = text.substr(pos, end - pos);
+    const auto dash = item.find('-');
+    uint32_t first = 0;
+    uint32_t last = 0;
+    if (!parse_number(item.substr(0, dash), first) ||
+        !parse_number(dash == std::string::npos ? item : item.substr(dash + 1), last) ||
+        last < first) {
+      return false;
+    }
+    for (auto cpu = first; cpu <= last; cpu++) {
+      if (std::find(cpus.begin(), cpus.end(), cpu) == cpus.end()) {
+        cpus.push_back(cpu);
+      }
+    }
+    pos = end + 1;
+  }
+  return true;
+}
+
+//! Pins the calling thread to the CPU, returns false if the OS refused or doesn't support it
+inline bool pin_current_thread(uint32_t cpu) {
+#ifdef _WIN32
+  return cpu < 64 && SetThreadAffinityMask(GetCurrentThread(), DWORD_PTR(1) << cpu) != 0;
+#elif defined(__linux__)
+  if (cpu >= CPU_SETSIZE) {
+    return false;
+  }
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  CPU_SET(cpu, &set);
+  return pthread_setaffinity_np(pthread_self(), sizeof(set), &set) == 0;
+#else
+  return false;
+#endif
+}
+
+//! CPUs the process may run on, taskset and cgroup cpusets included. Empty if unknown
+inline std::vector<uint32_t> get_allowed_cpus() {
+  std::vector<uint32_t> cpus;
+#ifdef __linux__
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  if (sched_getaffinity(0, sizeof(set), &set) == 0) {
+    for (uint32_t cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+      if (CPU_ISSET(cpu, &set)) {
+        cpus.push_back(cpu);
+      }
+    }
+  }
+#endif
+  return cpus;
+}
+
+//! NUMA nodes of the CPUs. <br>
+//! Linux reads /sys/devices/system/node, elsewhere every CPU is on node 0
+class CCpuTopology {
+ public:
+  static CCpuTopology read() {
+    CCpuTopology topology;
+#ifdef __linux__
+    for (uint32_t node = 0; node < 1024; node++) {
+      std::ifstream in("/sys/devices/system/node/node" + std::to_string(node) + "/cpulist");
+      if (!in.is_open()) {
+        // Node numbers may have gaps after hot-unplug, a few missing ones end the scan
+        if (node > topology.m_last_node + 8) {
+          break;
+        }
+        continue;
+      }
+      std::string line;
+      std::vector<uint32_t> cpus;
+      if (std::getline(in, line) && parse_cpu_list(line, cpus)) {
+        for (auto cpu : cpus) {
+          topology.m_nodes[cpu] = node;
+        }
+        topology.m_last_node = node;
+      }
+    }
+#endif
+    return topology;
+  }
+
+  //! System node of the CPU, 0 if unknown
+  [[nodiscard]] uint32_t node_of(uint32_t cpu) const {
+    const auto it = m_nodes.find(cpu);
+    return it == m_nodes.end() ? 0 : it->second;
+  }
+
+  //! threads workers pinned to the cpus in turns, the nodes of the cpus are renumbered from 0.
+  //! No cpus means the CPUs allowed for the process sorted by node, no threads - one per CPU
+  [[nodiscard]] std::vector<CWorkerPlacement> place(uint32_t threads,
+                                                    std::vector<uint32_t> cpus) const {
+    if (cpus.empty()) {
+      cpus = get_allowed_cpus();
+      std::stable_sort(cpus.begin(), cpus.end(),
+                       [this](uint32_t a, uint32_t b) { return node_of(a) < node_of(b); });
+    }
+    std::vector<CWorkerPlacement> placements;
+    if (cpus.empty()) {
+      // Affinity is unknown, the workers aren't pinned
+      placements.resize(threads ? threads : std::max(std::thread::hardware_concurrency(), 1u));
+      return placements;
+    }
+    std::map<uint32_t, uint32_t> used_nodes;
+    for (auto cpu : cpus) {
+      used_nodes.emplace(node_of(cpu), uint32_t(used_nodes.size()));
+    }
+    const auto count = threads ? threads : uint32_t(cpus.size());
+    for (uint32_t i = 0; i < count; i++) {
+      const auto cpu = cpus[i % cpus.size()];
+      placements.push_back({int32_t(cpu), used_nodes[node_of(cpu)]});
+    }
+    return placements;
+  }
+
+ private:
+  CCpuTopology() : m_last_node(0) {}
+
+  std::map<uint32_t, uint32_t> m_nodes;
+  uint32_t m_last_node;
+};
+
+#endif  // SIGNATURE_CPU_TOPOLOGY_H
@@ -0,0 +1,365 @@
+#ifndef SIGNATURE_FILE_LAYOUT_H
+#define SIGNATURE_FILE_LAYOUT_H
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstdint>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <utility>
+#include <vector>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+#ifdef __linux__
+#include <linux/fiemap.h>
+#include <linux/fs.h>
+#include <sys/ioctl.h>
+#include <sys/vfs.h>
+#endif
+
+//! Sorted disjoint half-open ranges [first, second)
+using CRanges = std::vector<std::pair<uint64_t, uint64_t>>;
+
+//! Returns true if the index is inside the ranges and the end of the run of indices with the same
+//! answer
+inline std::pair<bool, uint64_t> find_run(const CRanges& ranges, uint64_t index) {
+  const auto it = std::upper_bound(ranges.begin(), ranges.end(), index,
+                                   [](uint64_t value, const std::pair<uint64_t, uint64_t>& range) {
+                                     return value < range.second;
+                                   });
+  if (it == ranges.end()) {
+    return {false, UINT64_MAX};
+  }
+  if (it->first <= index) {
+    return {true, it->second};
+  }
+  return {false, it->first};
+}
+
+//! Identity, modification time and data extents of a file. <br>
+//! Saved in the sidecar of the signature, the next run compares it with the current layout to find
+//! the blocks which can't have changed
+struct CFileLayout {
+  //! Physical offset of the extents whose data can't be compared by the location
+  static constexpr uint64_t unknown_physical = UINT64_MAX;
+  //! Btrfs, a rewrite of a copy-on-write file always allocates a new extent
+  static constexpr int64_t btrfs_magic = 0x9123683E;
+  //! File systems update mtime with a coarse granularity, a write right after the layout was read
+  //! may keep the same mtime, such mtime isn't trusted
+  static constexpr int64_t racy_mtime_ns = 2'000'000'000;
+
+  struct CExtent {
+    uint64_t logical;
+    uint64_t length;
+    uint64_t physical;
+  };
+
+  uint64_t size = 0;
+  int64_t mtime_ns = 0;
+  //! Time the layout was read, by the clock of the file times
+  int64_t captured_ns = 0;
+  uint64_t device = 0;
+  uint64_t inode = 0;
+  //! The extents are known, gaps between them are holes which read as zeros
+  bool extents_known = false;
+  //! The data never changes in place, an extent at the same physical offset holds the same data
+  bool physical_stable = false;
+  //! Data extents sorted by the logical offset
+  std::vector<CExtent> extents;
+
+  //! Returns false if the file can't be stat-ed, extents are read with FIEMAP or SEEK_DATA when
+  //! the platform supports them
+  bool read(const std::string& path, bool with_extents = true) {
+    *this = CFileLayout();
+    captured_ns = to_ns(std::filesystem::file_time_type::clock::now());
+    std::error_code ec;
+    size = uint64_t(std::filesystem::file_size(path, ec));
+    if (ec) {
+      return false;
+    }
+    mtime_ns = to_ns(std::filesystem::last_write_time(path, ec));
+    if (ec) {
+      return false;
+    }
+    if (!with_extents) {
+      return true;
+    }
+#ifndef _WIN32
+    const int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+      return false;
+    }
+    struct stat st = {};
+    if (fstat(fd, &st) == 0) {
+      device = uint64_t(st.st_dev);
+      inode = uint64_t(st.st_ino);
+    }
+#ifdef __linux__
+    extents_known = read_fiemap(fd);
+    if (extents_known) {
+      struct statfs sfs = {};
+      int flags = 0;
+      physical_stable = fstatfs(fd, &sfs) == 0 && int64_t(sfs.f_type) == btrfs_magic &&
+                        ioctl(fd, FS_IOC_GETFLAGS, &flags) == 0 && !(flags & FS_NOCOW_FL);
+    }
+#endif
+#ifdef SEEK_DATA
+    if (!extents_known) {
+      extents_known = read_seek_data(fd);
+    }
+#endif
+    ::close(fd);
+#endif
+    return true;
+  }
+
+  //! Byte ranges of the current file holding the same data as in the previous layout, both files
+  //! must be the same file
+  static CRanges unchanged_ranges(const CFileLayout& previous, const CFileLayout& current) {
+    if (previous.device != current.device || previous.inode != current.inode) {
+      return {};
+    }
+    if (previous.size == current.size && previous.mtime_ns == current.mtime_ns &&
+        previous.mtime_ns + racy_mtime_ns < previous.captured_ns) {
+      return {{0, current.size}};
+    }
+    if (!previous.extents_known || !current.extents_known) {
+      return {};
+    }
+    // Holes in both files
+    auto unchanged = intersect(previous.holes(), current.holes());
+    if (previous.physical_stable && current.physical_stable) {
+      // Extents at the same physical location with the same logical to physical shift
+      for (size_t i = 0, j = 0; i < previous.extents.size() && j < current.extents.size();) {
+        const auto& a = previous.extents[i];
+        const auto& b = current.extents[j];
+        const auto begin = std::max(a.logical, b.logical);
+        const auto end = std::min(a.logical + a.length, b.logical + b.length);
+        if (begin < end && a.physical != unknown_physical && b.physical != unknown_physical &&
+            a.physical - a.logical == b.physical - b.logical) {
+          unchanged.emplace_back(begin, end);
+        }
+        if (a.logical + a.length < b.logical + b.length) {
+          i++;
+        } else {
+          j++;
+        }
+      }
+    }
+    std::sort(unchanged.begin(), unchanged.end());
+    CRanges merged;
+    const auto limit = std::min(previous.size, current.size);
+    for (auto [begin, end] : unchanged) {
+      end = std::min(end, limit);
+      if (begin >= end) {
+        continue;
+      }
+      if (!merged.empty() && merged.back().second >= begin) {
+        merged.back().second = std::max(merged.back().second, end);
+      } else {
+        merged.emplace_back(begin, end);
+      }
+    }
+    return merged;
+  }
+
+  //! Same file with the same size, mtime and extents, the capture time isn't compared
+  [[nodiscard]] bool is_same(const CFileLayout& other) const {
+    return size == other.size && mtime_ns == other.mtime_ns && device == other.device &&
+           inode == other.inode && extents_known == other.extents_known &&
+           physical_stable == other.physical_stable && extents.size() == other.extents.size() &&
+           std::equal(extents.begin(), extents.end(), other.extents.begin(),
+                      [](const CExtent& a, const CExtent& b) {
+                        return a.logical == b.logical && a.length == b.length &&
+                               a.physical == b.physical;
+                      });
+  }
+
+  //! Writes the layout as text, the line "file ..." and an "extent ..." line per extent
+  void write(std::ostream& out) const {
+    out << "file " << size << ' ' << mtime_ns << ' ' << captured_ns << ' ' << device << ' '
+        << inode << ' ' << extents_known << ' ' << physical_stable << ' ' << extents.size() << '\n';
+    for (const auto& extent : extents) {
+      out << "extent " << extent.logical << ' ' << extent.length << ' ' << extent.physical << '\n';
+    }
+  }
+
+  //! Returns false if the text is malformed
+  bool parse(std::istream& in) {
+    *this = CFileLayout();
+    std::string tag;
+    size_t count = 0;
+    if (!(in >> tag >> size >> mtime_ns >> captured_ns >> device >> inode >> extents_known >>
+          physical_stable >> count) ||
+        tag != "file") {
+      return false;
+    }
+    extents.resize(count);
+    for (auto& extent : extents) {
+      if (!(in >> tag >> extent.logical >> extent.length >> extent.physical) || tag != "extent") {
+        return false;
+      }
+    }
+    return true;
+  }
+
+ private:
+  static int64_t to_ns(std::filesystem::file_time_type time) {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(time.time_since_epoch()).count();
+  }
+
+  //! Complement of the extents within the file
+  [[nodiscard]] CRanges holes() const {
+    CRanges result;
+    uint64_t offset = 0;
+    for (const auto& extent : extents) {
+      if (extent.logical > offset) {
+        result.emplace_back(offset, std::min(extent.logical, size));
+      }
+      offset = std::max(offset, extent.logical + extent.length);
+    }
+    if (offset < size) {
+      result.emplace_back(offset, size);
+    }
+    return result;
+  }
+
+  static CRanges intersect(const CRanges& a, const CRanges& b) {
+    CRanges result;
+    for (size_t i = 0, j = 0; i < a.size() && j < b.size();) {
+      const auto begin = std::max(a[i].first, b[j].first);
+      const auto end = std::min(a[i].second, b[j].second);
+      if (begin < end) {
+        result.emplace_back(begin, end);
+      }
+      if (a[i].second < b[j].second) {
+        i++;
+      } else {
+        j++;
+      }
+    }
+    return result;
+  }
+
+#ifdef __linux__
+  //! Pending writes are flushed first, extents without a stable location keep unknown_physical
+  bool read_fiemap(int fd) {
+    constexpr uint32_t batch = 256;
+    std::vector<char> buffer(sizeof(fiemap) + batch * sizeof(fiemap_extent));
+    for (uint64_t start = 0;;) {
+      std::fill(buffer.begin(), buffer.end(), 0);
+      auto map = reinterpret_cast<fiemap*>(buffer.data());
+      map->fm_start = start;
+      map->fm_length = FIEMAP_MAX_OFFSET - start;
+      map->fm_flags = FIEMAP_FLAG_SYNC;
+      map->fm_extent_count = batch;
+      if (ioctl(fd, FS_IOC_FIEMAP, map) != 0) {
+        extents.clear();
+        return false;
+      }
+      if (!map->fm_mapped_extents) {
+        return true;
+      }
+      constexpr auto unstable = FIEMAP_EXTENT_UNKNOWN | FIEMAP_EXTENT_DELALLOC |
+                                FIEMAP_EXTENT_ENCODED | FIEMAP_EXTENT_DATA_ENCRYPTED |
+                                FIEMAP_EXTENT_NOT_ALIGNED | FIEMAP_EXTENT_DATA_INLINE |
+                                FIEMAP_EXTENT_DATA_TAIL;
+      for (uint32_t i = 0; i < map->fm_mapped_extents; i++) {
+        const auto& extent = map->fm_extents[i];
+        extents.push_back({extent.fe_logical, extent.fe_length,
+                           extent.fe_flags & unstable ? unknown_physical : extent.fe_physical});
+        start = extent.fe_logical + extent.fe_length;
+        if (extent.fe_flags & FIEMAP_EXTENT_LAST) {
+          return true;
+        }
+      }
+    }
+  }
+#endif
+
+#ifdef SEEK_DATA
+  //! Data ranges between the holes, their physical location is unknown
+  bool read_seek_data(int fd) {
+    extents.clear();
+    for (off_t offset = 0; uint64_t(offset) < size;) {
+      const auto data = lseek(fd, offset, SEEK_DATA);
+      if (data < 0) {
+        // ENXIO: no data up to the end of the file
+        return errno == ENXIO;
+      }
+      const auto hole = lseek(fd, data, SEEK_HOLE);
+      if (hole < 0) {
+        extents.clear();
+        return false;
+      }
+      extents.push_back({uint64_t(data), uint64_t(hole - data), unknown_physical});
+      offset = hole;
+    }
+    return true;
+  }
+#endif
+};
+
+//! Sidecar of the signature, the layout of the input and the stamp of the signature it belongs to
+struct CSidecar {
+  static constexpr uint32_t current_version = 1;
+
+  uint64_t block_size = 0;
+  uint64_t signature_size = 0;
+  int64_t signature_mtime_ns = 0;
+  CFileLayout layout;
+
+  //! Path of the sidecar of the signature
+  static std::string path_for(const std::string& signature_path) {
+    return signature_path + ".sidecar";
+  }
+
+  //! Stamps the signature, which must be written already
+  bool write(const std::string& signature_path) {
+    CFileLayout signature;
+    if (!signature.read(signature_path, false)) {
+      return false;
+    }
+    signature_size = signature.size;
+    signature_mtime_ns = signature.mtime_ns;
+    std::ofstream out(path_for(signature_path), std::ios::trunc);
+    out << "signature-sidecar " << current_version << '\n'
+        << "block_size " << block_size << '\n'
+        << "signature " << signature_size << ' ' << signature_mtime_ns << '\n';
+    layout.write(out);
+    out.flush();
+    return bool(out);
+  }
+
+  //! Returns false if there is no sidecar, it is malformed or the signature changed after it was
+  //! written
+  bool read(const std::string& signature_path) {
+    std::ifstream in(path_for(signature_path));
+    std::string tag;
+    uint32_t version = 0;
+    if (!(in >> tag >> version) || tag != "signature-sidecar" || version != current_version) {
+      return false;
+    }
+    if (!(in >> tag >> block_size) || tag != "block_size") {
+      return false;
+    }
+    if (!(in >> tag >> signature_size >> signature_mtime_ns) || tag != "signature") {
+      return false;
+    }
+    if (!layout.parse(in)) {
+      return false;
+    }
+    CFileLayout signature;
+    return signature.read(signature_path, false) && signature.size == signature_size &&
+           signature.mtime_ns == signature_mtime_ns;
+  }
+};
+
+#endif  // SIGNATURE_FILE_LAYOUT_H
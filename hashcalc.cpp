@@ -1,118 +1,1323 @@
 #include "hashcalc.h"
+
+#ifdef _WIN32
+#include <fcntl.h>
+#include <io.h>
+#endif
+
+namespace {
+//! Standard input ("-"), pipes, sockets and character devices are read once in order
+bool is_streamed(const fs::path& path) {
+  std::error_code ec;
+  return path == "-" ||
+         (fs::exists(path, ec) && !fs::is_regular_file(path, ec) && !fs::is_directory(path, ec));
+}
+}  // namespace
 //!
 //! \param in_path Incoming file path
-//! \param out_path Output file path (SHA256 hashes for every block)
+//! \param out_path Output file path (digests of every block)
 //! \param size Size of block
-CHashCalc::CHashCalc(const std::string& in_path, const std::string& out_path, uint64_t size)
-    : m_in_file_path(in_path),
+//! \param options Number of read windows, input engine, algorithm and output format
+CHashCalc::CHashCalc(const std::string& in_path,
+                     const std::string& out_path,
+                     uint64_t size,
+                     const HashCalc::COptions& options)
+    : CHashCalc(CInput{in_path, false, nullptr, 0, {}}, out_path, size, options) {}
+
+CHashCalc::CHashCalc(const char* data,
+                     uint64_t data_size,
+                     uint64_t size,
+                     const HashCalc::COptions& options)
+    : CHashCalc(CInput{{}, true, data, data_size, {}}, {}, size, options) {}
+
+CHashCalc::CHashCalc(HashCalc::CReadCallback read,
+                     uint64_t size,
+                     const HashCalc::COptions& options)
+    : CHashCalc(CInput{{}, false, nullptr, 0, std::move(read)}, {}, size, options) {}
+
+CHashCalc::CHashCalc(CInput input,
+                     const std::string& out_path,
+                     uint64_t size,
+                     const HashCalc::COptions& options)
+    : m_in_file_path(input.path),
       m_out_file_path(out_path),
-      m_in_size(fs::file_size(m_in_file_path)),
+      m_streamed(input.read || is_streamed(m_in_file_path)),
+      m_memory(input.data),
+      m_read_callback(std::move(input.read)),
+      m_in_size(input.memory  ? input.size
+                : m_streamed ? HashCalc::unknown_size
+                             : fs::file_size(m_in_file_path)),
       m_block_size(size),
-      m_tasks_size(0),
-      m_thread_manager(get_threads_count()) {
+      m_window_size(0),
+      m_blocks_per_window(0),
+      m_blocks_published(0),
+      m_cpu_start(0),
+      m_cpu_micro(0),
+      m_nodes(1),
+      m_read_engine(input.memory ? HashCalc::EReadEngine::memory : options.read_engine),
+      m_direct_io(options.direct_io),
+      m_io_threads(options.io_threads ? options.io_threads : get_threads_count()),
+      m_uring(false),
+      m_algorithm(options.algorithm),
+      m_digest_length(get_digest_length(options.algorithm)),
+      m_sha256_backend(options.sha256_backend),
+      m_output_format(options.output_format),
+      m_sha256(nullptr),
+      m_sha256_lanes_count(options.sha256_lanes),
+      m_sha256_lanes(nullptr),
+      m_verify(!options.verify_path.empty()),
+      m_first_mismatch(options.first_mismatch),
+      m_mismatched_blocks(0),
+      m_previous_path(options.previous_path),
+      m_write_sidecar(options.write_sidecar || !options.previous_path.empty()),
+      m_paranoid(options.paranoid),
+      m_rehashed_blocks(0),
+      m_merkle(options.merkle || !options.merkle_tree_path.empty() ||
+               options.file_digest == HashCalc::EFileDigest::tree),
+      m_merkle_tree_path(options.merkle_tree_path),
+      m_subtree_leaves(1),
+      m_subtree_height(0),
+      m_batch_size(1),
+      m_file_digest_mode(options.file_digest),
+      m_thread_pool(options.thread_pool ? options.thread_pool : &CThreadPool::instance()),
+      m_pool_source(0),
+      m_print_timings(options.print_timings),
+      m_workers(m_thread_pool->count()),
+      m_readers(1),
+      m_progress_interval_ms(options.progress_interval_ms),
+      m_metrics_path(options.metrics_path) {
+  if (!m_block_size) {
+    throw_exception(std::invalid_argument("Block size can't be zero"));
+  }
+  if (!m_digest_length) {
+    throw_exception(std::invalid_argument("Unknown hash algorithm " +
+                                          std::to_string(uint32_t(m_algorithm))));
+  }
+  // The tree nodes and the file digest are SHA256 by definition
+  if (m_algorithm != HashCalc::EAlgorithm::sha256 &&
+      (m_merkle || m_file_digest_mode != HashCalc::EFileDigest::none)) {
+    throw_exception(std::invalid_argument(
+        std::string("Merkle tree and file digest need sha256, not ") +
+        get_algorithm_name(m_algorithm)));
+  }
+  if (m_verify) {
+    try {
+      m_signature.open(options.verify_path);
+    } catch (std::runtime_error& e) {
+      throw_exception(e);
+    }
+    // Text signatures don't keep the block size
+    const auto signature_block_size = m_signature.header().block_size;
+    if (signature_block_size && signature_block_size != m_block_size) {
+      throw_exception(std::invalid_argument("Signature was made with block size " +
+                                            std::to_string(signature_block_size)));
+    }
+    if (m_signature.header().algorithm != m_algorithm) {
+      throw_exception(std::invalid_argument(std::string("Signature was made with algorithm ") +
+                                            get_algorithm_name(m_signature.header().algorithm)));
+    }
+    std::error_code ec;
+    if (fs::equivalent(options.verify_path, m_out_file_path, ec)) {
+      throw_exception(
+          std::invalid_argument("Output file is the signature " + m_out_file_path.string()));
+    }
+    if (m_write_sidecar || m_merkle) {
+      throw_exception(std::invalid_argument("Verify mode doesn't write signatures"));
+    }
+  }
+  if (m_streamed && m_write_sidecar) {
+    throw_exception(std::invalid_argument("Streamed input can't be signed incrementally"));
+  }
+  if (input.memory && m_write_sidecar) {
+    throw_exception(std::invalid_argument("Memory can't be signed incrementally"));
+  }
+  if (!input.memory && options.read_engine == HashCalc::EReadEngine::memory) {
+    throw_exception(std::invalid_argument("Memory engine takes the memory of the caller only"));
+  }
+  if (m_file_digest_mode != HashCalc::EFileDigest::none &&
+      (m_verify || m_write_sidecar || options.merkle || !m_merkle_tree_path.empty())) {
+    throw_exception(std::invalid_argument("File digest mode doesn't write signatures"));
+  }
+  if (m_sha256_backend == HashCalc::ESha256Backend::automatic) {
+    m_sha256_backend = get_best_sha256_backend();
+    if (!m_sha256_lanes_count && m_algorithm == HashCalc::EAlgorithm::sha256) {
+      // SHA extensions outrun the narrower kernels, only the 16 lanes one is faster
+      const auto lanes = get_best_sha256_lanes();
+      const auto faster =
+          lanes >= 16 || (lanes && m_sha256_backend == HashCalc::ESha256Backend::mbedtls);
+      if (faster && m_block_size <= HashCalc::multi_buffer_max_block_size) {
+        m_sha256_lanes_count = lanes;
+      }
+    }
+  }
+  try {
+    m_sha256 = get_sha256_function(m_sha256_backend);
+    if (m_sha256_lanes_count > 1) {
+      m_sha256_lanes = get_sha256_lanes_function(m_sha256_lanes_count);
+    }
+  } catch (std::invalid_argument& e) {
+    throw_exception(e);
+  }
+  if (!m_sha256_lanes || m_algorithm != HashCalc::EAlgorithm::sha256) {
+    m_sha256_lanes = nullptr;
+    m_sha256_lanes_count = 1;
+  }
   // Throw exception if block size is bigger than max_size
-  if (m_block_size > m_buffer.max_size()) {
+  if (m_block_size > std::vector<char>().max_size()) {
     throw_exception(std::invalid_argument("Block size is too big " + std::to_string(m_block_size)));
   }
-  uint64_t allocate_size;
-  if (m_in_size <= m_block_size) {
-    allocate_size = m_block_size;
+  // Every window holds whole blocks, all windows together fit into max_buffer_size
+  const auto blocks_count = std::max(options.buffer_size / m_block_size, uint64_t(1));
+  uint64_t windows_count = std::min(uint64_t(std::max(options.buffers_count, 1u)), blocks_count);
+  m_window_size =
+      std::min(blocks_count / windows_count, HashCalc::max_window_blocks) * m_block_size;
+  if (!m_streamed && m_in_size <= m_window_size) {
+    // Whole file fits into the single window
+    windows_count = 1;
+    m_window_size = std::max(m_in_size, uint64_t(1));
   } else {
-    const auto m_expected_size = (HashCalc::max_buffer_size / m_block_size);
-    allocate_size = (m_expected_size)*m_block_size;
+    const auto needed_windows =
+        m_streamed ? windows_count : (m_in_size + m_window_size - 1) / m_window_size;
+    windows_count = std::min(windows_count, needed_windows);
+    uint32_t owners = 1;
+    if (m_read_engine == HashCalc::EReadEngine::pread) {
+      // Window g is read by the I/O thread g % m_io_threads into the slot g % windows_count, so
+      // every slot has a single owner. Windows smaller than a batch would cost more in wake-ups
+      // than they save
+      const auto max_io_threads =
+          std::max(options.buffer_size / HashCalc::task_batch_size, uint64_t(1));
+      m_io_threads = uint32_t(std::min({uint64_t(m_io_threads), needed_windows, max_io_threads}));
+      windows_count = std::max(windows_count, uint64_t(m_io_threads));
+      owners = m_io_threads;
+    } else {
+      m_nodes = std::min(m_thread_pool->nodes_count(), uint32_t(windows_count));
+      owners = m_nodes;
+    }
+    if (owners > 1) {
+      // Every node or I/O thread gets the same number of windows, they share the budget
+      windows_count = (windows_count + owners - 1) / owners * owners;
+      m_window_size = std::clamp(blocks_count / windows_count, uint64_t(1),
+                                 HashCalc::max_window_blocks) *
+                      m_block_size;
+    }
+  }
+  if (m_streamed && m_read_engine == HashCalc::EReadEngine::mmap) {
+    throw_exception(
+        std::invalid_argument("Streamed input can't be mapped " + m_in_file_path.string()));
+  }
+  // Streams have no positions to read at
+  if (m_streamed || ((m_read_engine == HashCalc::EReadEngine::async ||
+                      m_read_engine == HashCalc::EReadEngine::pread) &&
+                     !CAsyncReader::is_supported())) {
+    m_read_engine = HashCalc::EReadEngine::stream;
+  }
+  // Map regular files, pipes and special files are read by the stream reader
+  if ((m_read_engine == HashCalc::EReadEngine::automatic ||
+       m_read_engine == HashCalc::EReadEngine::mmap) &&
+      m_in_size) {
+    if (m_mapped_file.open(m_in_file_path.string())) {
+      m_read_engine = HashCalc::EReadEngine::mmap;
+      m_in_size = m_mapped_file.size();
+    } else if (m_read_engine == HashCalc::EReadEngine::mmap) {
+      throw_exception(
+          std::runtime_error("Fatal error, couldn't map file " + m_in_file_path.string()));
+    }
+  }
+  if (m_read_engine == HashCalc::EReadEngine::automatic) {
+    m_read_engine = HashCalc::EReadEngine::stream;
+  }
+  m_blocks_per_window = (m_window_size + m_block_size - 1) / m_block_size;
+  // Batches hold whole groups of lanes blocks
+  auto& batch_size = m_batch_size;
+  batch_size =
+      std::max(HashCalc::task_batch_size / m_block_size / m_sha256_lanes_count, uint64_t(1)) *
+      m_sha256_lanes_count;
+  if (m_merkle) {
+    // A full batch is a perfect subtree: a power of two of blocks, windows hold whole batches
+    while (m_subtree_leaves * 2 <= std::min(batch_size, m_blocks_per_window)) {
+      m_subtree_leaves *= 2;
+      m_subtree_height++;
+    }
+    batch_size = m_subtree_leaves;
+    if (m_streamed || m_in_size > m_window_size) {
+      m_blocks_per_window -= m_blocks_per_window % m_subtree_leaves;
+      m_window_size = m_blocks_per_window * m_block_size;
+    }
   }
   try {
-    m_buffer = std::vector<char>(allocate_size);
+    // The mapping and the memory don't need staging buffers, the ring only limits the windows in
+    // flight
+    const auto in_place = m_read_engine == HashCalc::EReadEngine::mmap ||
+                          m_read_engine == HashCalc::EReadEngine::memory;
+    m_buffers.allocate(uint32_t(windows_count), in_place ? 0 : m_window_size);
+    m_digests.resize(windows_count * m_blocks_per_window);
+    m_window_data.resize(windows_count);
+    if (m_subtree_leaves > 1) {
+      m_subtrees.resize((m_digests.size() + m_subtree_leaves - 1) / m_subtree_leaves);
+    }
   } catch (std::bad_alloc&) {
-    throw_exception(std::invalid_argument("Can't allocate " + std::to_string(m_block_size)));
+    throw_exception(std::invalid_argument("Can't allocate " + std::to_string(m_window_size)));
+  }
+  if (m_nodes > 1 && m_read_engine != HashCalc::EReadEngine::mmap &&
+      m_read_engine != HashCalc::EReadEngine::memory) {
+    // First touch places the pages of the window on the node of the workers which hash it
+    std::vector<std::future<void>> touched;
+    for (uint32_t window = 0; window < windows_count; window++) {
+      touched.push_back(m_thread_pool->submit_to_node(window % m_nodes, [this, window] {
+        std::memset(m_buffers.data(window), 0, m_buffers.window_size());
+      }));
+    }
+    for (auto& future : touched) {
+      future.get();
+    }
+  }
+  m_task_managers = std::make_unique<CTaskManager[]>(m_nodes);
+  for (uint32_t node = 0; node < m_nodes; node++) {
+    m_task_managers[node].init(uint32_t(windows_count / m_nodes), m_block_size,
+                               m_blocks_per_window, batch_size);
+  }
+  if (m_read_engine == HashCalc::EReadEngine::pread) {
+    m_readers = m_io_threads;
   }
-  auto f = std::bind(&CHashCalc::generate_hashes, this, std::placeholders::_1);
-  m_thread_manager.run(f);
+  m_metrics = std::make_unique<CThreadMetrics[]>(m_workers + 1 + m_readers);
+  m_pool_source = m_thread_pool->attach([this] { return hash_next_task(); });
+}
+
+CHashCalc::~CHashCalc() {
+  m_reporter.stop();
+  stop();
 }
 //! Starts the calculation process, can throw exceptions runtime_error and invalid_argument. <br>
-//! Generation of tasks takes place in the main thread, after this tasks processed in the number of
-//! threads equal to the number of cores
+//! Reading takes place in the main thread, it prepares the read windows one by one and breaks
+//! them into tasks, which are processed by the workers of the thread pool, one per core.
+//! The writer thread writes digests of the hashed windows in order while hashing continues
 void CHashCalc::run() {
-  std::ifstream fs(m_in_file_path);
-  if (!fs.is_open()) {
+  // Throw exception if file is empty, an empty stream gets an empty signature
+  if (!m_in_size) {
+    throw_exception(std::runtime_error("Fatal error, file is empty " + m_in_file_path.string()));
+  }
+  if (m_out_file_path.empty()) {
+    throw_exception(std::invalid_argument("No output file, the digests need a callback"));
+  }
+  // The output is written while the input is still being read
+  std::error_code ec;
+  if (fs::equivalent(m_in_file_path, m_out_file_path, ec)) {
+    throw_exception(std::invalid_argument("Output file is the input file " +
+                                          m_out_file_path.string()));
+  }
+  if (m_write_sidecar) {
+    find_unchanged_blocks();
+  }
+  // The previous signature is mapped, a new one replaces it only when it is complete
+  const auto write_path = fs::equivalent(m_previous_path, m_out_file_path, ec)
+                              ? fs::path(m_out_file_path.string() + ".tmp")
+                              : m_out_file_path;
+  // Open file with truncation
+  std::ofstream out_file(write_path,
+                         m_output_format == HashCalc::EOutputFormat::binary
+                             ? std::ios::binary | std::ios::trunc
+                             : std::ios::trunc);
+  if (!out_file.is_open()) {
     throw_exception(
-        std::runtime_error("Fatal error, couldn't open file " + m_in_file_path.string()));
+        std::runtime_error("Fatal error, couldn't open output file " + write_path.string()));
   }
-  // Throw exception if file is empty
-  if (fs.peek() == std::ifstream::traits_type::eof()) {
-    throw_exception(std::runtime_error("Fatal error, file is empty " + m_in_file_path.string()));
+  hash_input(out_file);
+  if (m_streamed && m_output_format == HashCalc::EOutputFormat::binary && !m_verify &&
+      m_file_digest_mode == HashCalc::EFileDigest::none) {
+    // The sizes are known now
+    char header[CSignatureHeader::size];
+    signature_header(m_in_size).write(header);
+    out_file.seekp(0);
+    out_file.write(header, CSignatureHeader::size);
+    out_file.flush();
+    if (!out_file) {
+      throw_exception(
+          std::runtime_error("Fatal error, couldn't write output file " + write_path.string()));
+    }
+  }
+  out_file.close();
+  if (write_path != m_out_file_path) {
+    m_previous.close();
+    fs::rename(write_path, m_out_file_path);
+  }
+  if (m_write_sidecar) {
+    write_sidecar();
   }
+  if (!m_merkle_tree_path.empty()) {
+    CSignatureFile signature;
+    signature.open(m_out_file_path.string());
+    const auto root =
+        CMerkleTree::build(signature, m_merkle_tree_path, *m_thread_pool, m_sha256);
+    if (root != m_merkle_root) {
+      throw_exception(std::runtime_error("Fatal error, Merkle tree doesn't match the signature"));
+    }
+  }
+  finish_run();
+}
+//! The same pipeline without the output file, the writer thread calls callback for every window
+//! with the digests in their slots of the ring, so they aren't copied either
+void CHashCalc::run(const HashCalc::CDigestCallback& callback) {
+  if (!m_in_size) {
+    throw_exception(std::runtime_error("Fatal error, input is empty " + m_in_file_path.string()));
+  }
+  if (m_verify || m_write_sidecar || !m_merkle_tree_path.empty() ||
+      m_file_digest_mode != HashCalc::EFileDigest::none) {
+    throw_exception(std::invalid_argument("Digest callback takes the block digests only"));
+  }
+  m_digest_callback = callback;
+  // The writer doesn't touch it
+  std::ofstream no_file;
+  hash_input(no_file);
+  finish_run();
+}
+
+void CHashCalc::run(CDigest* digests, uint64_t count) {
+  const auto blocks = (m_in_size + m_block_size - 1) / m_block_size;
+  if (!m_streamed && blocks > count) {
+    throw_exception(std::invalid_argument("Input has " + std::to_string(blocks) +
+                                          " blocks, the digests hold " + std::to_string(count)));
+  }
+  run([digests, count](uint64_t first, const CDigest* window, uint64_t window_count) {
+    // A stream may be longer than the caller expected
+    if (first + window_count > count) {
+      throw std::runtime_error("Fatal error, input has more than " + std::to_string(count) +
+                               " blocks");
+    }
+    std::copy(window, window + window_count, digests + first);
+  });
+}
+//! Reads the whole input in this thread while the writer takes the digests on a service thread of
+//! the pool, the workers and the writer are stopped at the end
+void CHashCalc::hash_input(std::ofstream& out_file) {
   // Measure execution time
+  m_pool_baseline.clear();
+  for (uint32_t worker = 0; worker < m_workers; worker++) {
+    m_pool_baseline.emplace_back(m_thread_pool->get_idle_nano(worker),
+                                 m_thread_pool->get_lock_wait_nano(worker));
+  }
   m_timer.start();
-  // Read until end, this function takes part (64mb) of file and breaks buffer into tasks, then it
-  // waits for ready flag
-  auto task_id = 0ull;
-  auto all = 0ull;
-  std::vector<std::tuple<uint64_t, uint64_t, uint64_t>> tasks;
-  tasks.reserve(256);
-  while (!fs.eof()) {
-    auto buffer_ptr = 0ull;
-    auto read = uint64_t(fs.read(m_buffer.data(), m_buffer.size()).gcount());
-    if (!read) {
-      break;
+  m_cpu_start = get_process_cpu_micro();
+  if (m_progress_interval_ms || !m_metrics_path.empty()) {
+    const auto interval =
+        m_progress_interval_ms ? m_progress_interval_ms : HashCalc::metrics_interval_ms;
+    m_reporter.start(interval, [this] { report_progress(); });
+  }
+  if (m_digest_callback) {
+    m_writer = m_thread_pool->submit_service([this] { deliver_digests(); });
+  } else {
+    auto writer = &CHashCalc::write_digests;
+    if (m_verify) {
+      writer = &CHashCalc::verify_digests;
+    } else if (m_file_digest_mode != HashCalc::EFileDigest::none) {
+      writer = &CHashCalc::write_file_digest;
     }
-    // Generate tasks
-    for (; buffer_ptr < read; buffer_ptr += m_block_size) {
-      if (all + m_block_size > m_in_size) {
-        m_block_size = m_in_size - all;
-      }
-      tasks.emplace_back(std::make_tuple(buffer_ptr, m_block_size, ++task_id));
-      all += m_block_size;
+    m_writer = m_thread_pool->submit_service([this, writer, &out_file] {
+      (this->*writer)(out_file);
+    });
+  }
+  try {
+    if (m_read_engine == HashCalc::EReadEngine::mmap ||
+        m_read_engine == HashCalc::EReadEngine::memory) {
+      read_mapped();
+    } else if (m_read_engine == HashCalc::EReadEngine::async) {
+      read_async();
+    } else if (m_read_engine == HashCalc::EReadEngine::pread) {
+      read_parallel();
+    } else {
+      read_stream();
     }
-    // Increase final tasks size
-    m_tasks_size.fetch_add(tasks.size());
-    m_task_manager.add_tasks(tasks);
-    tasks.clear();
-    m_thread_manager.wait_work();
+  } catch (...) {
+    // The read callback may throw as well
+    stop();
+    throw;
   }
-  // Stop other threads
-  m_thread_manager.stop();
-  // Open file with truncation
-  std::ofstream out_file(m_out_file_path, std::ios::trunc);
-  // If file successfully opened then run sort and write results to file
-  if (!out_file.is_open()) {
-    throw_exception(
-        std::runtime_error("Fatal error, couldn't open output file " + m_out_file_path.string()));
+  // Wait for the windows in flight
+  CTimer stall_timer;
+  stall_timer.start();
+  m_buffers.finish();
+  m_writer.get();
+  reader_metrics(0).wait_ns.add(stall_timer.stop().get_nano());
+  // Stop the writer and return the workers to the pool
+  stop();
+  if (m_writer_error) {
+    std::rethrow_exception(m_writer_error);
   }
-  // Sort results using index
-  m_hash_results.sort(sort_by_index);
-  // Write results to file
-  for (auto& i : m_hash_results) {
-    out_file << i.first << std::endl;
+}
+
+void CHashCalc::finish_run() {
+  // The final report shows the whole input
+  m_reporter.stop();
+  if (m_progress_interval_ms || !m_metrics_path.empty()) {
+    report_progress();
   }
   // Stop measurement
   m_timer.stop();
+  m_cpu_micro = get_process_cpu_micro() - m_cpu_start;
+  if (!m_print_timings) {
+    return;
+  }
   std::cout << "Hashing completed (includes read file && write "
                "results) - "
             << m_timer.get_micro() << " us" << std::endl;
+  std::cout << "Reader stalls: I/O - " << get_io_wait_micro()
+            << " us, hashing and writing - " << get_compute_wait_micro()
+            << " us, writer busy - " << get_write_micro() << " us" << std::endl;
+  std::cout << "CPU time - " << m_cpu_micro << " us, cores busy on average - "
+            << double(m_cpu_micro) / double(std::max(get_wall_micro(), uint64_t(1))) << std::endl;
+  const auto metrics = get_metrics();
+  std::cout << "Workers: idle - " << metrics.total(&CMetricsSnapshot::CThread::idle_ns) / 1000
+            << " us, lock waits - "
+            << metrics.total(&CMetricsSnapshot::CThread::lock_wait_ns) / 1000
+            << " us, lost claims - " << metrics.claim_retries << std::endl;
+}
+
+uint64_t CHashCalc::get_io_wait_micro() const {
+  uint64_t nano = 0;
+  for (uint32_t reader = 0; reader < m_readers; reader++) {
+    nano += reader_metrics(reader).read_latency.sum();
+  }
+  return nano / 1000;
 }
-//! This method is launched from the class CTaskManager
-//! \param thread_id - unique id for the thread
-void CHashCalc::generate_hashes(uint32_t thread_id) {
-  while (true) {
-    auto task = m_task_manager.get_task();
-    if (task.has_value()) {
-      auto task_v = task.value();
-      // Calculate SHA256 and insert result
-      m_hash_results.emplace_back(
-          std::make_pair(calc_sha256(m_buffer.data() + std::get<0>(task_v), std::get<1>(task_v)),
-                         std::get<2>(task_v)));
-      // Report on the completion of the task
-      m_task_manager.task_done();
-    }
-    // Check if hashes ready
-    if (m_tasks_size.load() != 0 && m_task_manager.done() == m_tasks_size.load()) {
-      m_thread_manager.work_done();
-    }
-    // Stop it!
-    if (m_thread_manager.is_stopping()) {
+
+uint64_t CHashCalc::get_compute_wait_micro() const {
+  uint64_t nano = 0;
+  for (uint32_t reader = 0; reader < m_readers; reader++) {
+    nano += reader_metrics(reader).wait_ns.get();
+  }
+  return nano / 1000;
+}
+//! Sums the counters of the threads, every one is read once without stopping the threads, so the
+//! totals may be a few tasks apart
+CMetricsSnapshot CHashCalc::get_metrics() const {
+  CMetricsSnapshot snapshot;
+  snapshot.elapsed_ns = m_timer.is_running() ? m_timer.get_running_nano() : m_timer.get_nano();
+  // The reader of a stream sets the size when the input ends
+  snapshot.input_size =
+      m_streamed && m_timer.is_running() ? HashCalc::unknown_size : m_in_size;
+  for (uint32_t node = 0; node < m_nodes; node++) {
+    snapshot.claim_retries += m_task_managers[node].get_claim_retries();
+  }
+  const auto slots = m_workers + 1 + m_readers;
+  for (uint32_t slot = 0; slot < slots; slot++) {
+    const auto& metrics = m_metrics[slot];
+    CMetricsSnapshot::CThread thread;
+    if (slot < m_workers) {
+      thread.name = "worker" + std::to_string(slot);
+      if (slot < m_pool_baseline.size()) {
+        thread.idle_ns = m_thread_pool->get_idle_nano(slot) - m_pool_baseline[slot].first;
+        thread.lock_wait_ns =
+            m_thread_pool->get_lock_wait_nano(slot) - m_pool_baseline[slot].second;
+      }
+    } else if (slot == m_workers) {
+      thread.name = "writer";
+    } else {
+      thread.name = m_readers > 1 ? "io" + std::to_string(slot - m_workers - 1) : "reader";
+    }
+    thread.bytes_read = metrics.bytes_read.get();
+    thread.blocks_hashed = metrics.blocks_hashed.get();
+    thread.bytes_hashed = metrics.bytes_hashed.get();
+    thread.hash_ns = metrics.hash_ns.get();
+    thread.blocks_copied = metrics.blocks_copied.get();
+    thread.blocks_written = metrics.blocks_written.get();
+    thread.bytes_written = metrics.bytes_written.get();
+    thread.write_ns = metrics.write_ns.get();
+    thread.wait_ns = metrics.wait_ns.get();
+    snapshot.read_latency.add(metrics.read_latency);
+    snapshot.hash_latency.add(metrics.hash_latency);
+    snapshot.write_latency.add(metrics.write_latency);
+    thread.reads = 0;
+    for (uint32_t i = 0; i < CHistogram::buckets_count; i++) {
+      thread.reads += metrics.read_latency.bucket(i);
+    }
+    snapshot.threads.push_back(std::move(thread));
+  }
+  snapshot.done_bytes =
+      std::min(writer_metrics().blocks_written.get() * m_block_size, snapshot.input_size);
+  return snapshot;
+}
+
+void CHashCalc::report_progress() {
+  auto snapshot = get_metrics();
+  if (m_progress_interval_ms) {
+    std::cerr << snapshot.progress_line(m_last_report ? &*m_last_report : nullptr) << std::endl;
+  }
+  if (!m_metrics_path.empty() && !Metrics::write_dump(m_metrics_path, snapshot)) {
+    std::cerr << "Couldn't write metrics file " << m_metrics_path << std::endl;
+  }
+  m_last_report = std::move(snapshot);
+}
+//! Stops the workers and the writer, safe to call several times
+void CHashCalc::stop() {
+  m_buffers.cancel();
+  for (uint32_t node = 0; node < m_nodes && m_task_managers; node++) {
+    m_task_managers[node].stop();
+  }
+  if (m_writer.valid()) {
+    m_writer.get();
+  }
+  if (m_pool_source) {
+    m_thread_pool->detach(m_pool_source);
+    m_pool_source = 0;
+  }
+}
+//! Reads the file or the read callback into the read windows, the next window is read while workers
+//! hash the previous ones, the reader waits only if the window it is going to fill is still being
+//! hashed
+void CHashCalc::read_stream() {
+  std::ifstream file;
+  const auto from_stdin = m_in_file_path == "-";
+  std::istream& fs = from_stdin ? std::cin : file;
+  if (from_stdin) {
+#ifdef _WIN32
+    _setmode(_fileno(stdin), _O_BINARY);
+#endif
+  } else if (!m_read_callback) {
+    if (file.open(m_in_file_path, std::ios::binary); !file.is_open()) {
+      throw_exception(
+          std::runtime_error("Fatal error, couldn't open file " + m_in_file_path.string()));
+    }
+  }
+  // Windows are filled up, only the last one may end with a short block. The callback may return
+  // less than asked
+  auto ended = false;
+  const auto read_window = [&](char* buffer, uint64_t size) {
+    uint64_t done = 0;
+    while (done < size && !ended) {
+      uint64_t read = 0;
+      if (m_read_callback) {
+        read = m_read_callback(buffer + done, size - done);
+        if (read > size - done) {
+          throw_exception(std::runtime_error("Fatal error, read callback returned " +
+                                             std::to_string(read) + " bytes of " +
+                                             std::to_string(size - done)));
+        }
+      } else {
+        read = uint64_t(fs.read(buffer + done, std::streamsize(size - done)).gcount());
+      }
+      ended = !read || fs.eof();
+      done += read;
+    }
+    return done;
+  };
+  CTimer stall_timer;
+  uint32_t window = 0;
+  // Never read past the size known in the constructor, digests are allocated for it. Streams are
+  // read until they end, the size is known then
+  uint64_t total = 0;
+  auto& metrics = reader_metrics(0);
+  while (total < m_in_size && !ended) {
+    stall_timer.start();
+    const auto is_free = m_buffers.wait_free(window);
+    metrics.wait_ns.add(stall_timer.stop().get_nano());
+    if (!is_free) {
+      return;
+    }
+
+    stall_timer.start();
+    const auto buffer = m_buffers.data(window);
+    const auto to_read = std::min(m_window_size, m_in_size - total);
+    uint64_t read = 0;
+    if (is_range_copied(total, to_read)) {
+      // Workers copy the digests of the window without looking at the data
+      read = fs.seekg(std::streamoff(to_read), std::ios::cur) ? to_read : 0;
+    } else {
+      read = read_window(buffer, to_read);
+      metrics.bytes_read.add(read);
+    }
+    metrics.read_latency.add(stall_timer.stop().get_nano());
+    if (!read) {
       break;
     }
+    publish_window(window, buffer, read);
+    total += read;
+    window = (window + 1) % m_buffers.count();
+  }
+  if (m_streamed) {
+    m_in_size = total;
+  }
+}
+//! Hands the workers slices of the file mapping or of the memory of the caller, readahead of the
+//! next window is requested while the current one is hashed, I/O happens in page faults of the
+//! workers
+void CHashCalc::read_mapped() {
+  CTimer stall_timer;
+  uint32_t window = 0;
+  const auto mapped = m_read_engine == HashCalc::EReadEngine::mmap;
+  const auto data = mapped ? m_mapped_file.data() : m_memory;
+  const auto size = mapped ? m_mapped_file.size() : m_in_size;
+  auto& metrics = reader_metrics(0);
+  for (uint64_t offset = 0; offset < size; offset += m_window_size) {
+    stall_timer.start();
+    const auto is_free = m_buffers.wait_free(window);
+    metrics.wait_ns.add(stall_timer.stop().get_nano());
+    if (!is_free) {
+      return;
+    }
+
+    stall_timer.start();
+    const auto length = std::min(m_window_size, size - offset);
+    if (mapped && !offset && !is_range_copied(offset, length)) {
+      m_mapped_file.will_need(offset, length);
+    }
+    const auto next_length = std::min(m_window_size, size - std::min(size, offset + length));
+    if (mapped && next_length && !is_range_copied(offset + length, next_length)) {
+      m_mapped_file.will_need(offset + length, next_length);
+    }
+    // The pages are read in the faults of the workers, the reader only asks for them
+    metrics.read_latency.add(stall_timer.stop().get_nano());
+    metrics.bytes_read.add(length);
+    publish_window(window, data + offset, length);
+    window = (window + 1) % m_buffers.count();
+  }
+}
+//! Submits reads of the windows ahead while they are free, the kernel fills several windows at
+//! once. Reads complete in any order, windows are published in the file order. A short read is
+//! continued, the end of the input before the size known in the constructor ends the file
+void CHashCalc::read_async() {
+  CAsyncReader reader;
+  // Direct reads need page aligned offsets, the windows start at multiples of their size
+  const auto direct = m_direct_io && m_window_size % CBufferRing::alignment == 0;
+  if (!reader.open(m_in_file_path.string(), m_buffers.count(), direct)) {
+    throw_exception(
+        std::runtime_error("Fatal error, couldn't open file " + m_in_file_path.string()));
+  }
+  m_uring = reader.is_uring();
+  struct CRead {
+    uint64_t offset = 0;
+    uint64_t size = 0;
+    uint64_t done = 0;
+    bool complete = false;
+  };
+  std::vector<CRead> reads(m_buffers.count());
+  const auto submit = [&](uint32_t window) {
+    auto& read = reads[window];
+    auto size = read.size - read.done;
+    if (reader.is_direct()) {
+      // The tail of the last window is read in whole pages, the read stops at the end of file
+      size = (size + CAsyncReader::alignment - 1) / CAsyncReader::alignment *
+             CAsyncReader::alignment;
+    }
+    reader.submit(window, m_buffers.data(window) + read.done, read.offset + read.done, size);
+  };
+  auto& metrics = reader_metrics(0);
+  CTimer stall_timer;
+  uint64_t next_offset = 0;
+  uint64_t submitted = 0;
+  uint64_t published = 0;
+  auto truncated = false;
+  while (published < submitted || (next_offset < m_in_size && !truncated)) {
+    // Fill the free windows, wait for one only if nothing is being read
+    while (next_offset < m_in_size && !truncated && submitted - published < reads.size()) {
+      const auto window = uint32_t(submitted % reads.size());
+      if (reader.in_flight() || published < submitted) {
+        if (!m_buffers.is_free(window)) {
+          break;
+        }
+      } else {
+        stall_timer.start();
+        const auto is_free = m_buffers.wait_free(window);
+        metrics.wait_ns.add(stall_timer.stop().get_nano());
+        if (!is_free) {
+          return;
+        }
+      }
+      auto& read = reads[window];
+      read = {next_offset, std::min(m_window_size, m_in_size - next_offset), 0, false};
+      if (is_range_copied(read.offset, read.size)) {
+        // Workers copy the digests of the window without looking at the data
+        read.done = read.size;
+        read.complete = true;
+      } else {
+        submit(window);
+      }
+      next_offset += read.size;
+      submitted++;
+    }
+    // Publish the windows read so far in order
+    for (; published < submitted; published++) {
+      const auto window = uint32_t(published % reads.size());
+      const auto& read = reads[window];
+      if (!read.complete) {
+        break;
+      }
+      // Nothing after a short window is published, the windows read ahead stay free
+      if (read.done && !truncated) {
+        publish_window(window, m_buffers.data(window), read.done);
+      }
+      truncated = truncated || read.done < read.size;
+    }
+    if (!reader.in_flight()) {
+      continue;
+    }
+    stall_timer.start();
+    const auto [tag, result] = reader.wait();
+    metrics.read_latency.add(stall_timer.stop().get_nano());
+    if (result < 0) {
+      throw_exception(std::runtime_error("Fatal error, couldn't read file " +
+                                         m_in_file_path.string() + ": " +
+                                         std::strerror(int(-result))));
+    }
+    auto& read = reads[tag];
+    metrics.bytes_read.add(std::min(uint64_t(result), read.size - read.done));
+    read.done = std::min(read.done + uint64_t(result), read.size);
+    if (read.done < read.size && result > 0) {
+      submit(uint32_t(tag));
+    } else {
+      read.complete = true;
+    }
+  }
+}
+//! Every I/O thread reads its own windows with pread and hashes them itself, window g belongs to
+//! thread g % m_io_threads. There is no central read loop, the writer puts the windows in order.
+//! The I/O threads are service threads of the pool, they block on reads and free windows
+void CHashCalc::read_parallel() {
+  const auto windows = (m_in_size + m_window_size - 1) / m_window_size;
+  const auto direct = m_direct_io && m_window_size % CBufferRing::alignment == 0;
+  std::mutex mutex;
+  std::exception_ptr error;
+  const auto read_windows = [&](uint32_t thread) {
+    CTimer stall_timer;
+    auto& metrics = reader_metrics(thread);
+    try {
+      CAsyncReader reader;
+      if (!reader.open(m_in_file_path.string(), 1, direct, false)) {
+        throw std::runtime_error("Fatal error, couldn't open file " + m_in_file_path.string());
+      }
+      for (auto index = uint64_t(thread); index < windows; index += m_io_threads) {
+        const auto window = uint32_t(index % m_buffers.count());
+        stall_timer.start();
+        const auto is_free = m_buffers.wait_free(window);
+        metrics.wait_ns.add(stall_timer.stop().get_nano());
+        if (!is_free) {
+          break;
+        }
+        const auto offset = index * m_window_size;
+        const auto size = std::min(m_window_size, m_in_size - offset);
+        const auto data = m_buffers.data(window);
+        if (!is_range_copied(offset, size)) {
+          stall_timer.start();
+          reader.submit(index, data, offset,
+                        direct ? (size + CAsyncReader::alignment - 1) / CAsyncReader::alignment *
+                                     CAsyncReader::alignment
+                               : size);
+          const auto result = reader.wait().second;
+          metrics.read_latency.add(stall_timer.stop().get_nano());
+          if (result < 0 || uint64_t(result) < size) {
+            // Windows after the end can't be published, the writer would wait for them
+            throw std::runtime_error("Fatal error, couldn't read file " +
+                                     m_in_file_path.string());
+          }
+          metrics.bytes_read.add(size);
+        }
+        hash_window(window, index * m_blocks_per_window, data, size, metrics);
+      }
+    } catch (...) {
+      std::unique_lock<std::mutex> lock(mutex);
+      if (!error) {
+        error = std::current_exception();
+      }
+      m_buffers.cancel();
+    }
+  };
+  std::vector<std::future<void>> threads;
+  for (uint32_t thread = 0; thread < m_io_threads; thread++) {
+    threads.push_back(m_thread_pool->submit_service([&read_windows, thread] {
+      read_windows(thread);
+    }));
+  }
+  for (auto& thread : threads) {
+    thread.get();
+  }
+  if (error) {
+    stop();
+    std::rethrow_exception(error);
+  }
+}
+//! Hashes the blocks of the window on the calling thread in batches, the window is published to
+//! the writer but not to the workers
+void CHashCalc::hash_window(uint32_t window,
+                            uint64_t first_block,
+                            const char* data,
+                            uint64_t size,
+                            CThreadMetrics& metrics) {
+  const auto count = (size + m_block_size - 1) / m_block_size;
+  m_window_data[window] = {data, size};
+  m_buffers.publish(window, first_block, count);
+  if (m_file_digest_mode == HashCalc::EFileDigest::sha256) {
+    m_buffers.task_done(window, count);
+    return;
+  }
+  for (uint64_t i = 0; i < count; i += m_batch_size) {
+    const auto batch = std::min(m_batch_size, count - i);
+    const auto offset = i * m_block_size;
+    process_task({window, data + offset, std::min(batch * m_block_size, size - offset),
+                  first_block + i, batch},
+                 metrics);
+  }
+}
+//! Reads the layout of the input and finds the blocks which can't have changed since the previous
+//! signature. Any doubt means a full rehash: no valid sidecar, another block size, the signature
+//! doesn't match the sidecar or the input differs from the size known in the constructor
+void CHashCalc::find_unchanged_blocks() {
+  if (!m_layout.read(m_in_file_path.string()) || m_layout.size != m_in_size) {
+    m_write_sidecar = false;
+    return;
+  }
+  if (m_previous_path.empty() || m_paranoid) {
+    return;
+  }
+  CSidecar sidecar;
+  if (!sidecar.read(m_previous_path.string()) || sidecar.block_size != m_block_size) {
+    return;
+  }
+  try {
+    m_previous.open(m_previous_path.string());
+  } catch (std::runtime_error&) {
+    return;
+  }
+  const auto previous_size = sidecar.layout.size;
+  const auto& header = m_previous.header();
+  if (header.algorithm != m_algorithm ||
+      m_previous.block_count() != CSignatureHeader::blocks_of(previous_size, m_block_size) ||
+      (header.block_size && (header.block_size != m_block_size ||
+                             header.input_size != previous_size))) {
+    return;
+  }
+  for (const auto& [begin, end] : CFileLayout::unchanged_ranges(sidecar.layout, m_layout)) {
+    // Only whole blocks, the short last block only if the size is the same
+    const auto first = (begin + m_block_size - 1) / m_block_size;
+    const auto last = end == m_in_size && end == previous_size
+                          ? (end + m_block_size - 1) / m_block_size
+                          : end / m_block_size;
+    if (first < last) {
+      m_copied_blocks.emplace_back(first, last);
+    }
+  }
+  // Workers parse the copied lines, a malformed one must mean a full rehash rather than an
+  // exception in a worker. The lines are checked in pieces by the pool
+  if (m_previous.format() == HashCalc::EOutputFormat::text) {
+    std::vector<std::pair<uint64_t, uint64_t>> pieces;
+    for (const auto& [first, last] : m_copied_blocks) {
+      for (auto begin = first; begin < last; begin += HashCalc::task_batch_size) {
+        pieces.emplace_back(begin, std::min(last, begin + HashCalc::task_batch_size));
+      }
+    }
+    std::atomic_bool valid(true);
+    parallel_for(*m_thread_pool, pieces.size(), [&](uint64_t piece) {
+      try {
+        for (auto index = pieces[piece].first; index < pieces[piece].second && valid; index++) {
+          (void)m_previous.digest(index);
+        }
+      } catch (std::runtime_error&) {
+        valid = false;
+      }
+    });
+    if (!valid) {
+      m_copied_blocks.clear();
+    }
+  }
+}
+//! True if the digests of all blocks of the byte range are copied, the range needn't be read
+bool CHashCalc::is_range_copied(uint64_t offset, uint64_t size) const {
+  const auto [copied, run_end] = find_run(m_copied_blocks, offset / m_block_size);
+  return copied && run_end >= (offset + size + m_block_size - 1) / m_block_size;
+}
+//! Saves the layout read before hashing for the next incremental run. If the input changed while
+//! it was hashed, the sidecar is removed and the next run rehashes everything
+void CHashCalc::write_sidecar() {
+  CSidecar sidecar;
+  sidecar.block_size = m_block_size;
+  sidecar.layout = m_layout;
+  CFileLayout current;
+  if (!current.read(m_in_file_path.string()) || !current.is_same(m_layout)) {
+    std::error_code ec;
+    fs::remove(CSidecar::path_for(m_out_file_path.string()), ec);
+    return;
+  }
+  if (!sidecar.write(m_out_file_path.string())) {
+    throw_exception(std::runtime_error("Fatal error, couldn't write sidecar " +
+                                       CSidecar::path_for(m_out_file_path.string())));
+  }
+}
+//! Publishes blocks of the window to the workers
+void CHashCalc::publish_window(uint32_t window, const char* data, uint64_t size) {
+  // The window must be marked busy before workers can claim its blocks
+  const auto count = (size + m_block_size - 1) / m_block_size;
+  m_window_data[window] = {data, size};
+  m_buffers.publish(window, m_blocks_published, count);
+  if (m_file_digest_mode == HashCalc::EFileDigest::sha256) {
+    // Nothing for the workers, the writer hashes the window as a whole
+    m_buffers.task_done(window, count);
+  } else {
+    m_task_managers[window % m_nodes].add_window(window, data, size, m_blocks_published);
+    m_thread_pool->notify();
+  }
+  m_blocks_published += count;
+}
+CSignatureHeader CHashCalc::signature_header(uint64_t input_size) const {
+  CSignatureHeader header;
+  header.algorithm = m_algorithm;
+  header.digest_length = uint32_t(m_digest_length);
+  header.block_size = m_block_size;
+  if (input_size != HashCalc::unknown_size) {
+    header.input_size = input_size;
+    header.block_count = (input_size + m_block_size - 1) / m_block_size;
+  }
+  return header;
+}
+//! Counts the blocks of a window the writer is done with
+void CHashCalc::add_written(CThreadMetrics& metrics, uint64_t blocks, uint64_t nano) {
+  metrics.blocks_written.add(blocks);
+  metrics.write_ns.add(nano);
+  metrics.write_latency.add(nano);
+}
+//! Writer thread, writes digests of the hashed windows in order and releases the windows
+void CHashCalc::write_digests(std::ofstream& out_file) {
+  try {
+    auto& metrics = writer_metrics();
+    CTimer wait_timer;
+    CTimer write_timer;
+    // Lines are encoded straight into the chunk, it is written when the next line won't fit
+    const auto binary = m_output_format == HashCalc::EOutputFormat::binary;
+    const auto line_length = binary ? m_digest_length : m_digest_length * 2 + 1;
+    std::vector<char> chunk(std::max(HashCalc::write_chunk_size, CSignatureHeader::size));
+    const auto chunk_lines = chunk.size() / line_length;
+    uint64_t chunk_used = 0;
+    CMerkleBuilder merkle(m_sha256);
+    if (binary) {
+      // The reader sets the size of a streamed input when it ends, run() rewrites the header then
+      signature_header(m_streamed ? HashCalc::unknown_size : m_in_size).write(chunk.data());
+      out_file.write(chunk.data(), CSignatureHeader::size);
+    } else {
+      out_file << text_signature_prefix(m_algorithm);
+    }
+    for (uint64_t window_index = 0;; window_index++) {
+      const auto window = uint32_t(window_index % m_buffers.count());
+      wait_timer.start();
+      const auto blocks = m_buffers.wait_hashed(window);
+      metrics.wait_ns.add(wait_timer.stop().get_nano());
+      if (!blocks) {
+        break;
+      }
+      write_timer.start();
+      const auto digests = m_digests.data() + window * m_blocks_per_window;
+      if (m_merkle) {
+        add_merkle_leaves(merkle, blocks->first, blocks->second, digests);
+      }
+      for (uint64_t i = 0; i < blocks->second;) {
+        const auto lines = std::min(blocks->second - i, chunk_lines - chunk_used);
+        const auto out = chunk.data() + chunk_used * line_length;
+        if (binary && m_digest_length == sha256_digest_length) {
+          std::memcpy(out, digests + i, lines * sha256_digest_length);
+        } else if (binary) {
+          // Shorter digests are packed without the padding of CDigest
+          for (uint64_t j = 0; j < lines; j++) {
+            std::memcpy(out + j * m_digest_length, digests[i + j].data(), m_digest_length);
+          }
+        } else {
+          digests_to_hex_lines(digests + i, lines, out, m_digest_length);
+        }
+        chunk_used += lines;
+        i += lines;
+        if (chunk_used == chunk_lines) {
+          out_file.write(chunk.data(), std::streamsize(chunk_used * line_length));
+          metrics.bytes_written.add(chunk_used * line_length);
+          chunk_used = 0;
+        }
+      }
+      // Digests are copied into the chunk, the window can be reused
+      m_buffers.release(window);
+      add_written(metrics, blocks->second, write_timer.stop().get_nano());
+    }
+    if (m_merkle) {
+      m_merkle_root = merkle.root();
+    }
+    write_timer.start();
+    out_file.write(chunk.data(), std::streamsize(chunk_used * line_length));
+    out_file.flush();
+    metrics.bytes_written.add(chunk_used * line_length);
+    metrics.write_ns.add(write_timer.stop().get_nano());
+    if (!out_file) {
+      throw std::runtime_error("Fatal error, couldn't write output file " +
+                               m_out_file_path.string());
+    }
+  } catch (...) {
+    m_writer_error = std::current_exception();
+    m_buffers.cancel();
+  }
+}
+//! Writer thread of run() with a callback, passes it the digests of the hashed windows in order
+void CHashCalc::deliver_digests() {
+  try {
+    auto& metrics = writer_metrics();
+    CTimer wait_timer;
+    CTimer write_timer;
+    CMerkleBuilder merkle(m_sha256);
+    for (uint64_t window_index = 0;; window_index++) {
+      const auto window = uint32_t(window_index % m_buffers.count());
+      wait_timer.start();
+      const auto blocks = m_buffers.wait_hashed(window);
+      metrics.wait_ns.add(wait_timer.stop().get_nano());
+      if (!blocks) {
+        break;
+      }
+      write_timer.start();
+      const auto digests = m_digests.data() + window * m_blocks_per_window;
+      if (m_merkle) {
+        add_merkle_leaves(merkle, blocks->first, blocks->second, digests);
+      }
+      m_digest_callback(blocks->first, digests, blocks->second);
+      m_buffers.release(window);
+      add_written(metrics, blocks->second, write_timer.stop().get_nano());
+    }
+    if (m_merkle) {
+      m_merkle_root = merkle.root();
+    }
+  } catch (...) {
+    m_writer_error = std::current_exception();
+    m_buffers.cancel();
+  }
+}
+//! Writer thread of the file digest mode, either folds the block digests into the tree or feeds
+//! the windows to the plain SHA256 in order. The reader keeps reading the next windows meanwhile,
+//! so even the single-threaded SHA256 doesn't wait for I/O
+void CHashCalc::write_file_digest(std::ofstream& out_file) {
+  try {
+    auto& metrics = writer_metrics();
+    CTimer wait_timer;
+    CTimer write_timer;
+    CMerkleBuilder merkle(m_sha256);
+    CSha256Stream stream(m_sha256_backend);
+    for (uint64_t window_index = 0;; window_index++) {
+      const auto window = uint32_t(window_index % m_buffers.count());
+      wait_timer.start();
+      const auto blocks = m_buffers.wait_hashed(window);
+      metrics.wait_ns.add(wait_timer.stop().get_nano());
+      if (!blocks) {
+        break;
+      }
+      write_timer.start();
+      if (m_file_digest_mode == HashCalc::EFileDigest::sha256) {
+        stream.update(m_window_data[window].first, m_window_data[window].second);
+      } else {
+        add_merkle_leaves(merkle, blocks->first, blocks->second,
+                          m_digests.data() + window * m_blocks_per_window);
+      }
+      m_buffers.release(window);
+      add_written(metrics, blocks->second, write_timer.stop().get_nano());
+    }
+    if (m_file_digest_mode == HashCalc::EFileDigest::sha256) {
+      m_file_digest = stream.finish();
+    } else {
+      m_merkle_root = merkle.root();
+      m_file_digest = Merkle::file_digest(*m_merkle_root, m_block_size, m_in_size, m_sha256);
+    }
+    out_file << digest_to_hex(*m_file_digest) << '\n';
+    out_file.flush();
+    if (!out_file) {
+      throw std::runtime_error("Fatal error, couldn't write output file " +
+                               m_out_file_path.string());
+    }
+  } catch (...) {
+    m_writer_error = std::current_exception();
+    m_buffers.cancel();
+  }
+}
+//! Adds the blocks of the window to the tree, full batches by the roots of their subtrees
+void CHashCalc::add_merkle_leaves(CMerkleBuilder& merkle,
+                                  uint64_t first_block,
+                                  uint64_t count,
+                                  const CDigest* digests) const {
+  for (uint64_t i = 0; i < count;) {
+    const auto index = first_block + i;
+    if (m_subtree_leaves > 1 && index % m_subtree_leaves == 0 && i + m_subtree_leaves <= count) {
+      merkle.add(m_subtrees[index / m_subtree_leaves % m_subtrees.size()], m_subtree_height);
+      i += m_subtree_leaves;
+    } else {
+      merkle.add(digests[i]);
+      i++;
+    }
+  }
+}
+//! Writer thread of the verify mode, compares digests of the hashed windows with the signature in
+//! order and writes ranges of mismatching blocks as "first-last" lines, block numbers from 0
+void CHashCalc::verify_digests(std::ofstream& out_file) {
+  try {
+    auto& metrics = writer_metrics();
+    CTimer wait_timer;
+    CTimer write_timer;
+    // Open range of mismatching blocks, [range_begin, range_end)
+    uint64_t range_begin = 0;
+    uint64_t range_end = 0;
+    const auto flush_range = [&] {
+      if (range_begin == range_end) {
+        return;
+      }
+      out_file << range_begin;
+      if (range_end - range_begin > 1) {
+        out_file << '-' << range_end - 1;
+      }
+      out_file << '\n';
+      m_mismatched_blocks += range_end - range_begin;
+      range_begin = range_end;
+    };
+    const auto mismatch = [&](uint64_t first, uint64_t count) {
+      if (range_end != first) {
+        flush_range();
+        range_begin = first;
+      }
+      range_end = first + count;
+    };
+    const auto expected_blocks = m_signature.block_count();
+    uint64_t blocks_total = 0;
+    auto stopped = false;
+    for (uint64_t window_index = 0; !stopped; window_index++) {
+      const auto window = uint32_t(window_index % m_buffers.count());
+      wait_timer.start();
+      const auto blocks = m_buffers.wait_hashed(window);
+      metrics.wait_ns.add(wait_timer.stop().get_nano());
+      if (!blocks) {
+        break;
+      }
+      write_timer.start();
+      const auto [first_block, count] = *blocks;
+      const auto digests = m_digests.data() + window * m_blocks_per_window;
+      for (uint64_t i = 0; i < count && !stopped; i++) {
+        // Blocks appended to the input are mismatches as well
+        const auto index = first_block + i;
+        if (index >= expected_blocks || digests[i] != m_signature.digest(index)) {
+          mismatch(index, 1);
+          stopped = m_first_mismatch;
+        }
+      }
+      blocks_total = first_block + count;
+      m_buffers.release(window);
+      add_written(metrics, count, write_timer.stop().get_nano());
+    }
+    if (stopped) {
+      // Nothing else is needed, the reader sees the cancelled ring and stops
+      m_buffers.cancel();
+    } else if (blocks_total < expected_blocks) {
+      // The input was truncated
+      mismatch(blocks_total, expected_blocks - blocks_total);
+    }
+    flush_range();
+    out_file.flush();
+    if (!out_file) {
+      throw std::runtime_error("Fatal error, couldn't write output file " +
+                               m_out_file_path.string());
+    }
+  } catch (...) {
+    m_writer_error = std::current_exception();
+    m_buffers.cancel();
+  }
+}
+//! Hashes count consecutive blocks starting from the block index, size is the number of bytes
+//! available from data, the last block of the file may be shorter. <br>
+//! The algorithm is picked once per task, the loops over the blocks call the hashers directly
+void CHashCalc::hash_blocks(const char* data, uint64_t size, uint64_t index, uint64_t count) {
+  switch (m_algorithm) {
+    case HashCalc::EAlgorithm::sha512_256:
+      hash_each<CSha512_256>(data, size, index, count);
+      break;
+    case HashCalc::EAlgorithm::blake3:
+      hash_each<CBlake3>(data, size, index, count);
+      break;
+    case HashCalc::EAlgorithm::xxh3_128:
+      hash_each<CXxh3_128>(data, size, index, count);
+      break;
+    default:
+      hash_sha256(data, size, index, count);
+  }
+  m_rehashed_blocks.fetch_add(count, std::memory_order_relaxed);
+}
+//! SHA256 of the blocks with the backend chosen at runtime, full blocks go through the multi-buffer
+//! kernel if it is enabled
+void CHashCalc::hash_sha256(const char* data, uint64_t size, uint64_t index, uint64_t count) {
+  uint64_t i = 0;
+  if (m_sha256_lanes) {
+    // Groups of full blocks, the rest and the short last block of the file are hashed one by one
+    const char* lanes_data[sha256_max_lanes];
+    unsigned char* lanes_digests[sha256_max_lanes];
+    const auto full_blocks = std::min(count, size / m_block_size);
+    for (; i + m_sha256_lanes_count <= full_blocks; i += m_sha256_lanes_count) {
+      for (uint32_t lane = 0; lane < m_sha256_lanes_count; lane++) {
+        lanes_data[lane] = data + (i + lane) * m_block_size;
+        lanes_digests[lane] = m_digests[(index + i + lane) % m_digests.size()].data();
+      }
+      m_sha256_lanes(lanes_data, m_block_size, lanes_digests);
+    }
+  }
+  for (; i < count; i++) {
+    const auto offset = i * m_block_size;
+    // Calculate SHA256 straight into the slot of the block
+    m_sha256(data + offset, std::min(m_block_size, size - offset),
+             m_digests[(index + i) % m_digests.size()].data());
+  }
+}
+
+template <typename THasher>
+void CHashCalc::hash_each(const char* data, uint64_t size, uint64_t index, uint64_t count) {
+  static_assert(THasher::digest_length <= sha256_digest_length, "Digest doesn't fit CDigest");
+  for (uint64_t i = 0; i < count; i++) {
+    const auto offset = i * m_block_size;
+    THasher::hash(data + offset, std::min(m_block_size, size - offset),
+                  m_digests[(index + i) % m_digests.size()].data());
+  }
+}
+//! Source of the thread pool, runs one task if there is one. Workers take the windows of their
+//! node first and help the other nodes when they run dry
+bool CHashCalc::hash_next_task() {
+  const auto node = CThreadPool::current_node() % m_nodes;
+  for (uint32_t i = 0; i < m_nodes; i++) {
+    if (const auto task = m_task_managers[(node + i) % m_nodes].try_get_task()) {
+      process_task(*task, m_metrics[CThreadPool::current_worker()]);
+      return true;
+    }
+  }
+  return false;
+}
+//! Hashes or copies the blocks of the task and reports them as done
+void CHashCalc::process_task(const CTask& task, CThreadMetrics& metrics) {
+  CTimer task_timer;
+  task_timer.start();
+  uint64_t copied_blocks = 0;
+  uint64_t copied_bytes = 0;
+  if (m_copied_blocks.empty()) {
+    hash_blocks(task.data, task.size, task.index, task.count);
+  } else {
+    // Runs of copied and changed blocks
+    for (uint64_t i = 0; i < task.count;) {
+      const auto index = task.index + i;
+      const auto [copied, run_end] = find_run(m_copied_blocks, index);
+      const auto count = std::min(run_end, task.index + task.count) - index;
+      if (copied) {
+        for (uint64_t j = 0; j < count; j++) {
+          m_digests[(index + j) % m_digests.size()] = m_previous.digest(index + j);
+        }
+        copied_blocks += count;
+        copied_bytes += std::min(count * m_block_size, task.size - i * m_block_size);
+      } else {
+        const auto offset = i * m_block_size;
+        hash_blocks(task.data + offset, task.size - offset, index, count);
+      }
+      i += count;
+    }
+  }
+  if (m_subtree_leaves > 1 && task.count == m_subtree_leaves &&
+      task.index % m_subtree_leaves == 0) {
+    // Windows hold whole batches, so the digests of the batch don't wrap around the ring
+    static thread_local std::vector<CDigest> scratch;
+    scratch.resize(m_subtree_leaves / 2);
+    m_subtrees[task.index / m_subtree_leaves % m_subtrees.size()] = Merkle::subtree_root(
+        &m_digests[task.index % m_digests.size()], m_subtree_leaves, scratch.data(), m_sha256);
   }
-  m_thread_manager.report_exit(thread_id);
+  const auto nano = task_timer.stop().get_nano();
+  metrics.blocks_hashed.add(task.count - copied_blocks);
+  metrics.bytes_hashed.add(task.size - copied_bytes);
+  metrics.blocks_copied.add(copied_blocks);
+  metrics.hash_ns.add(nano);
+  metrics.hash_latency.add(nano);
+  // Report on the completion of the task, the last task of the window releases it
+  m_buffers.task_done(task.window, task.count);
 }
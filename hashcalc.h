@@ -4,6 +4,7 @@
 #include <array>
 #include <atomic>
 #include <deque>
+#include <exception>
 #include <filesystem>
 #include <fstream>
 #include <functional>
@@ -15,7 +16,14 @@
 #include <vector>
 
 #include <future>
-#include "mbedtls/crypto/include/mbedtls/sha256.h"
+#include "async_reader.h"
+#include "file_layout.h"
+#include "hashes.h"
+#include "mapped_file.h"
+#include "merkle_tree.h"
+#include "metrics.h"
+#include "sha256.h"
+#include "signature_file.h"
 #include "utils.h"
 
 namespace fs = std::filesystem;
@@ -23,15 +31,113 @@ namespace fs = std::filesystem;
 namespace HashCalc {
 constexpr uint64_t one_megabyte = 1048576;
 constexpr uint64_t max_buffer_size = one_megabyte * 64;
+//! Number of read windows, max_buffer_size is shared between them
+constexpr uint32_t default_buffers_count = 3;
+//! Workers claim blocks in batches of about this size, so small blocks don't contend on the cursor
+constexpr uint64_t task_batch_size = 64 * 1024;
+//! Limits blocks in flight for small block sizes, digests of a window take 32 bytes per block
+constexpr uint64_t max_window_blocks = 1024 * 1024;
+//! Size of a streamed input until it ends
+constexpr uint64_t unknown_size = UINT64_MAX;
+//! The writer collects hex lines into chunks of this size before writing
+constexpr uint64_t write_chunk_size = one_megabyte;
+//! Metrics file is rewritten this often if there is no progress report
+constexpr uint64_t metrics_interval_ms = 1000;
+//! Automatic mode hashes blocks up to this size with the multi-buffer kernel, a task has to hold
+//! lanes blocks so bigger blocks would hurt the load balancing
+constexpr uint64_t multi_buffer_max_block_size = 64 * 1024;
+//! Input engine
+enum class EReadEngine {
+  automatic,  //!< mmap for regular files, stream otherwise
+  stream,     //!< std::ifstream reads into the read windows
+  mmap,       //!< Workers hash slices of the file mapping, no copies
+  async,      //!< Reads of several windows in flight through io_uring or pread, see CAsyncReader
+  pread,      //!< I/O service threads of the pool read their own windows with pread and hash them
+  memory      //!< Memory of the caller hashed in place, chosen by its constructor only
+};
+//! Digest of the whole file written instead of the signature
+enum class EFileDigest {
+  none,   //!< Signature of the blocks
+  tree,   //!< Merkle::file_digest() of the block digests, blocks are hashed by all cores
+  sha256  //!< Plain SHA256, hashed by the writer thread while the main thread reads ahead
+};
+//! Fills buffer with the next bytes of the input, up to size of them, and returns their number, 0
+//! at the end of the input. Short reads are fine, the reader calls again
+using CReadCallback = std::function<uint64_t(char* buffer, uint64_t size)>;
+//! Receives the digests of count blocks from the block first on, in the order of the input. A
+//! digest takes the digest length of the algorithm, the rest of CDigest is zero. The digests are
+//! valid during the call only, it runs in the writer thread
+using CDigestCallback =
+    std::function<void(uint64_t first, const CDigest* digests, uint64_t count)>;
+//! Optional settings of CHashCalc
+struct COptions {
+  uint32_t buffers_count = default_buffers_count;
+  EReadEngine read_engine = EReadEngine::automatic;
+  //! EReadEngine::async reads bypass the page cache (O_DIRECT) if the file system allows it
+  bool direct_io = false;
+  //! I/O threads of EReadEngine::pread, 0 means one per core
+  uint32_t io_threads = 0;
+  //! Algorithm of the block digests, the Merkle tree and the file digest modes take SHA256 only
+  EAlgorithm algorithm = EAlgorithm::sha256;
+  ESha256Backend sha256_backend = ESha256Backend::automatic;
+  //! Multi-buffer SHA256 kernel: 0 - automatic, 1 - disabled, 4, 8 or 16 - lanes count
+  uint32_t sha256_lanes = 0;
+  EOutputFormat output_format = EOutputFormat::text;
+  //! Signature to verify the input against, the output file receives the ranges of mismatching
+  //! blocks instead of digests
+  std::string verify_path;
+  //! Verification stops at the first mismatching block
+  bool first_mismatch = false;
+  //! Previous signature of the input, digests of the blocks which can't have changed since are
+  //! copied from it, its sidecar tells which ones
+  std::string previous_path;
+  //! Write the sidecar of the output for the next incremental run, implied by previous_path
+  bool write_sidecar = false;
+  //! Ignore previous_path and rehash every block, the sidecar is still written
+  bool paranoid = false;
+  //! Compute the root of the Merkle tree over the block digests
+  bool merkle = false;
+  //! Write the full Merkle tree into this file, implies merkle
+  std::string merkle_tree_path;
+  //! The output gets a single line with the digest of the whole file
+  EFileDigest file_digest = EFileDigest::none;
+  //! Read windows of the file share this budget, at least one block per window is allocated
+  uint64_t buffer_size = max_buffer_size;
+  //! Workers which hash the blocks, nullptr means CThreadPool::instance()
+  CThreadPool* thread_pool = nullptr;
+  //! Print the timings after run()
+  bool print_timings = true;
+  //! Progress line on stderr every interval during run(), 0 disables it
+  uint64_t progress_interval_ms = 0;
+  //! Metrics are dumped into this file every progress interval (metrics_interval_ms without one)
+  //! and after run(), JSON if it ends with .json, the text format of Prometheus otherwise
+  std::string metrics_path;
+};
 }  // namespace HashCalc
-//! Implementation of multi-thread SHA256 calculation
+//! Implementation of multi-thread calculation of the block digests, SHA256 by default. <br>
+//! The input is a file, the memory of the caller or a read callback, the digests go to the output
+//! file or to a callback
 class CHashCalc {
  public:
   CHashCalc(const std::string& in_path,
             const std::string& out_path,
-            uint64_t size = HashCalc::one_megabyte);
+            uint64_t size = HashCalc::one_megabyte,
+            const HashCalc::COptions& options = {});
+
+  //! Signs data_size bytes of the caller, they must stay unchanged until run() returns. Workers
+  //! hash them in place, nothing is copied. Use run() with a callback or an array of digests
+  CHashCalc(const char* data,
+            uint64_t data_size,
+            uint64_t size = HashCalc::one_megabyte,
+            const HashCalc::COptions& options = {});
 
-  ~CHashCalc() = default;
+  //! Signs the bytes of read, which fills the read windows like a stream. Use run() with a
+  //! callback or an array of digests
+  CHashCalc(HashCalc::CReadCallback read,
+            uint64_t size = HashCalc::one_megabyte,
+            const HashCalc::COptions& options = {});
+
+  ~CHashCalc();
 
   CHashCalc(const CHashCalc&) = delete;
 
@@ -41,28 +147,243 @@ class CHashCalc {
 
   CHashCalc& operator=(CHashCalc&&) = delete;
 
+  //! Writes the signature into the output file
   void run();
 
+  //! Passes the digests to callback instead, no file is written. Block digests and the Merkle root
+  //! only: verify, incremental and file digest modes need files
+  void run(const HashCalc::CDigestCallback& callback);
+
+  //! Copies digest i of the input into digests[i], count must cover every block
+  void run(CDigest* digests, uint64_t count);
+
+  //! Engine chosen for the input, never EReadEngine::automatic
+  [[nodiscard]] HashCalc::EReadEngine get_read_engine() const { return m_read_engine; }
+
+  //! True if EReadEngine::async reads went through io_uring rather than pread, valid after run()
+  [[nodiscard]] bool is_uring_used() const { return m_uring; }
+
+  [[nodiscard]] HashCalc::EAlgorithm get_algorithm() const { return m_algorithm; }
+
+  //! SHA256 backend chosen for the hashing, never ESha256Backend::automatic
+  [[nodiscard]] HashCalc::ESha256Backend get_sha256_backend() const { return m_sha256_backend; }
+
+  //! Lanes of the multi-buffer SHA256 kernel, 1 if every block is hashed separately
+  [[nodiscard]] uint32_t get_sha256_lanes() const { return m_sha256_lanes_count; }
+
+  //! Blocks which differ from the verified signature, including missing and extra blocks
+  [[nodiscard]] uint64_t get_mismatched_blocks() const { return m_mismatched_blocks; }
+
+  //! Root of the Merkle tree over the block digests if it was requested, valid after run()
+  [[nodiscard]] const std::optional<CDigest>& get_merkle_root() const { return m_merkle_root; }
+
+  //! Digest of the whole file if it was requested, valid after run()
+  [[nodiscard]] const std::optional<CDigest>& get_file_digest() const { return m_file_digest; }
+
+  //! Blocks hashed, the rest was copied from the previous signature, valid after run()
+  [[nodiscard]] uint64_t get_rehashed_blocks() const { return m_rehashed_blocks; }
+
+  //! Wall time of run()
+  [[nodiscard]] uint64_t get_wall_micro() const { return m_timer.get_micro(); }
+
+  //! CPU time of the process during run(), includes other calculations running at the same time
+  [[nodiscard]] uint64_t get_cpu_micro() const { return m_cpu_micro; }
+
+  //! Time the reader spent in read calls (workers may starve), valid after run()
+  [[nodiscard]] uint64_t get_io_wait_micro() const;
+
+  //! Time the reader spent waiting for a free window (hashing or writing is the bottleneck)
+  [[nodiscard]] uint64_t get_compute_wait_micro() const;
+
+  //! Time the writer spent formatting and writing digests
+  [[nodiscard]] uint64_t get_write_micro() const { return writer_metrics().write_ns.get() / 1000; }
+
+  //! Counters of the threads so far, can be called from any thread during run()
+  [[nodiscard]] CMetricsSnapshot get_metrics() const;
+
  private:
+  //! Input of the constructors: a path, the memory of the caller or a read callback
+  struct CInput {
+    std::string path;
+    bool memory = false;
+    const char* data = nullptr;
+    uint64_t size = 0;
+    HashCalc::CReadCallback read;
+  };
+
+  CHashCalc(CInput input,
+            const std::string& out_path,
+            uint64_t size,
+            const HashCalc::COptions& options);
+
   template <typename T>
   void throw_exception(T e) {
-    m_thread_manager.stop();
+    stop();
     throw e;
   }
 
-  void generate_hashes(uint32_t thread_id);
+  void stop();
+
+  //! Starts the timers and the writer, reads the whole input and waits for the writer
+  void hash_input(std::ofstream& out_file);
+
+  //! Stops the timers, prints the final report and the timings
+  void finish_run();
+
+  //! Reads the file or the standard input into the read windows in order
+  void read_stream();
+
+  void read_mapped();
+
+  //! Keeps reads of the free windows in flight, publishes the windows in order
+  void read_async();
+
+  void read_parallel();
+
+  void hash_window(uint32_t window,
+                   uint64_t first_block,
+                   const char* data,
+                   uint64_t size,
+                   CThreadMetrics& metrics);
+
+  void publish_window(uint32_t window, const char* data, uint64_t size);
+
+  void find_unchanged_blocks();
+
+  [[nodiscard]] bool is_range_copied(uint64_t offset, uint64_t size) const;
+
+  void write_sidecar();
+
+  //! Header of the binary signature, the sizes are zero if input_size is unknown_size
+  [[nodiscard]] CSignatureHeader signature_header(uint64_t input_size) const;
+
+  void hash_blocks(const char* data, uint64_t size, uint64_t index, uint64_t count);
+
+  void hash_sha256(const char* data, uint64_t size, uint64_t index, uint64_t count);
+
+  //! Block loop of the hashers of hashes.h, instantiated for each of them
+  template <typename THasher>
+  void hash_each(const char* data, uint64_t size, uint64_t index, uint64_t count);
+
+  static void add_written(CThreadMetrics& metrics, uint64_t blocks, uint64_t nano);
+
+  void write_digests(std::ofstream& out_file);
+
+  void deliver_digests();
+
+  void verify_digests(std::ofstream& out_file);
+
+  void write_file_digest(std::ofstream& out_file);
+
+  void add_merkle_leaves(CMerkleBuilder& merkle,
+                         uint64_t first_block,
+                         uint64_t count,
+                         const CDigest* digests) const;
+
+  bool hash_next_task();
+
+  void process_task(const CTask& task, CThreadMetrics& metrics);
+
+  //! Slots of m_metrics: the workers of the pool, the writer, the readers
+  [[nodiscard]] CThreadMetrics& writer_metrics() const { return m_metrics[m_workers]; }
+
+  [[nodiscard]] CThreadMetrics& reader_metrics(uint32_t reader) const {
+    return m_metrics[m_workers + 1 + reader];
+  }
+
+  //! Prints the progress line and dumps the metrics, called by m_reporter
+  void report_progress();
 
  private:
   fs::path m_in_file_path;
   fs::path m_out_file_path;
+  //! Standard input, a pipe or a device: read once in order, the size is known at the end only
+  bool m_streamed;
+  //! Memory of the caller or the read callback, if the input isn't a path
+  const char* m_memory;
+  HashCalc::CReadCallback m_read_callback;
+  //! Receives the digests instead of the output file
+  HashCalc::CDigestCallback m_digest_callback;
+  //! Size of the input, unknown_size while a streamed input is being read
   uint64_t m_in_size;
   uint64_t m_block_size;
-  std::atomic_size_t m_tasks_size;
-  CThreadManager m_thread_manager;
-  CTaskManager m_task_manager;
+  uint64_t m_window_size;
+  uint64_t m_blocks_per_window;
+  uint64_t m_blocks_published;
+  uint64_t m_cpu_start;
+  uint64_t m_cpu_micro;
+  //! NUMA nodes of the pool the windows are split between, 1 if the file has a single window
+  uint32_t m_nodes;
+  //! A manager per node, the window in slot w goes to the manager of node w % m_nodes
+  std::unique_ptr<CTaskManager[]> m_task_managers;
   CTimer m_timer;
-  std::vector<char> m_buffer;
-  CLockVec<std::pair<std::string, uint64_t>> m_hash_results;
+  HashCalc::EReadEngine m_read_engine;
+  bool m_direct_io;
+  uint32_t m_io_threads;
+  //! Set by read_async(), the reads went through io_uring
+  bool m_uring;
+  HashCalc::EAlgorithm m_algorithm;
+  //! Bytes of a digest written to the signature, the rest of CDigest is zero
+  uint64_t m_digest_length;
+  HashCalc::ESha256Backend m_sha256_backend;
+  HashCalc::EOutputFormat m_output_format;
+  CSha256Function m_sha256;
+  uint32_t m_sha256_lanes_count;
+  //! Hashes full blocks in groups of m_sha256_lanes_count, nullptr if disabled
+  CSha256LanesFunction m_sha256_lanes;
+  CMappedFile m_mapped_file;
+  CBufferRing m_buffers;
+  //! Digests of the windows in flight, block i of a window in slot w is stored at
+  //! w * m_blocks_per_window + i, each worker writes the slots of its own blocks
+  std::vector<CDigest> m_digests;
+  //! Signature being verified, mapped so no second set of digests is allocated
+  CSignatureFile m_signature;
+  bool m_verify;
+  bool m_first_mismatch;
+  uint64_t m_mismatched_blocks;
+  fs::path m_previous_path;
+  bool m_write_sidecar;
+  bool m_paranoid;
+  //! Layout of the input read before hashing, saved in the sidecar
+  CFileLayout m_layout;
+  //! Previous signature, mapped, the source of the copied digests
+  CSignatureFile m_previous;
+  //! Ranges of blocks whose digests are copied from m_previous
+  CRanges m_copied_blocks;
+  std::atomic_uint64_t m_rehashed_blocks;
+  bool m_merkle;
+  std::string m_merkle_tree_path;
+  //! Leaves in a full batch, workers compute roots of the perfect subtrees of full batches
+  uint64_t m_subtree_leaves;
+  uint32_t m_subtree_height;
+  //! Blocks a worker claims at once
+  uint64_t m_batch_size;
+  //! Subtree roots of the windows in flight, the subtree of block i is at i / m_subtree_leaves
+  std::vector<CDigest> m_subtrees;
+  std::optional<CDigest> m_merkle_root;
+  HashCalc::EFileDigest m_file_digest_mode;
+  std::optional<CDigest> m_file_digest;
+  //! Data of the published windows, the plain SHA256 reads it in the writer thread
+  std::vector<std::pair<const char*, uint64_t>> m_window_data;
+  //! Workers are borrowed from the pool, the blocks of the file are one of its sources
+  CThreadPool* m_thread_pool;
+  //! Id of the source attached to m_thread_pool, 0 if not attached
+  uint64_t m_pool_source;
+  bool m_print_timings;
+  //! Workers of m_thread_pool and reading threads: the main one or the I/O threads of pread
+  uint32_t m_workers;
+  uint32_t m_readers;
+  std::unique_ptr<CThreadMetrics[]> m_metrics;
+  //! Idle and lock wait times of the workers before run(), the pool outlives the calculation
+  std::vector<std::pair<uint64_t, uint64_t>> m_pool_baseline;
+  uint64_t m_progress_interval_ms;
+  std::string m_metrics_path;
+  //! Previous report, the throughput of the progress line is measured since it
+  std::optional<CMetricsSnapshot> m_last_report;
+  CProgressReporter m_reporter;
+  //! Writer running on a service thread of m_thread_pool
+  std::future<void> m_writer;
+  std::exception_ptr m_writer_error;
 };
 
 #endif  // HASH_CALC_H
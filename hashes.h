@@ -0,0 +1,51 @@
+#ifndef SIGNATURE_HASHES_H
+#define SIGNATURE_HASHES_H
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+#include "sha256.h"
+
+namespace HashCalc {
+//! Hash algorithm of the block digests, recorded in the binary header
+enum class EAlgorithm : uint32_t {
+  sha256 = 1,      //!< SHA256, see ESha256Backend
+  sha512_256 = 2,  //!< SHA-512/256, 64-bit arithmetic outruns SHA256 without SHA extensions
+  blake3 = 3,      //!< BLAKE3, cryptographic and several times faster than SHA256
+  xxh3_128 = 4     //!< XXH3 128 bit, not cryptographic, for dedup and change detection only
+};
+}  // namespace HashCalc
+
+//! Digest length of the algorithm, 0 if it is unknown. Shorter digests take the first bytes of
+//! CDigest, the rest is zero
+uint64_t get_digest_length(HashCalc::EAlgorithm algorithm);
+
+//! Name used on the command line and in the text signature, nullptr if the algorithm is unknown
+const char* get_algorithm_name(HashCalc::EAlgorithm algorithm);
+
+//! Parses the name of get_algorithm_name(), returns false if it is unknown
+bool parse_algorithm(const std::string& name, HashCalc::EAlgorithm& algorithm);
+
+//! Checks the implementation against known answers, SHA256 - its best backend
+bool algorithm_self_test(HashCalc::EAlgorithm algorithm);
+
+//! Hashers of the algorithms besides SHA256. <br>
+//! CHashCalc instantiates its block loop for every hasher, the per-block call is a direct one
+struct CSha512_256 {
+  static constexpr uint64_t digest_length = 32;
+  static void hash(const char* data, size_t size, unsigned char* digest);
+};
+
+struct CBlake3 {
+  static constexpr uint64_t digest_length = 32;
+  static void hash(const char* data, size_t size, unsigned char* digest);
+};
+
+//! The digest is the canonical form: the high 64 bits first, both halves big-endian
+struct CXxh3_128 {
+  static constexpr uint64_t digest_length = 16;
+  static void hash(const char* data, size_t size, unsigned char* digest);
+};
+
+#endif  // SIGNATURE_HASHES_H
@@ -1,39 +1,448 @@
+#include <climits>
 #include <iostream>
 
+#include "batch_calc.h"
+#include "chunking.h"
 #include "hashcalc.h"
 #include "utils.h"
 
+namespace {
+void print_usage() {
+  std::cout << "Should be like this: signature test_file1.bin "
+               "test_file_hash.txt 1048576 [options]"
+            << std::endl;
+  std::cout << "Input - is the standard input, it and pipes are read as they come" << std::endl;
+  std::cout << "Options:" << std::endl;
+  std::cout << "  --buffers=N                    number of read windows (default "
+            << HashCalc::default_buffers_count << ")" << std::endl;
+  std::cout << "  --engine=auto|stream|mmap|async  input engine (default auto), async keeps reads "
+               "of several windows in flight through io_uring"
+            << std::endl;
+  std::cout << "  --engine=pread                 I/O threads read and hash their own windows"
+            << std::endl;
+  std::cout << "  --io-threads=N                 I/O threads of --engine=pread (default the number "
+               "of cores)"
+            << std::endl;
+  std::cout << "  --direct                       async and pread reads bypass the page cache "
+               "(O_DIRECT)"
+            << std::endl;
+  std::cout << "  --algorithm=sha256|sha512-256|blake3|xxh3-128  hash of the blocks (default "
+               "sha256), xxh3-128 is not cryptographic"
+            << std::endl;
+  std::cout << "  --sha256=auto|mbedtls|shani|armv8  SHA256 backend (default auto)" << std::endl;
+  std::cout << "  --lanes=auto|1|4|8|16          multi-buffer SHA256 lanes, 1 disables it "
+               "(default auto)"
+            << std::endl;
+  std::cout << "  --format=text|binary           signature format (default text)" << std::endl;
+  std::cout << "  --convert=text|binary          convert the signature file: signature "
+               "in_signature out_signature [block_size input_size]"
+            << std::endl;
+  std::cout << "  --verify=signature_file        compare the input with the signature, the output "
+               "file receives ranges of mismatching blocks"
+            << std::endl;
+  std::cout << "  --first-mismatch               stop the verification at the first mismatch"
+            << std::endl;
+  std::cout << "  --previous=signature_file      copy digests of unchanged blocks from the "
+               "previous signature of the input"
+            << std::endl;
+  std::cout << "  --sidecar                      write the sidecar for the next --previous run"
+            << std::endl;
+  std::cout << "  --paranoid                     rehash every block even with --previous"
+            << std::endl;
+  std::cout << "  --merkle                       print the root of the Merkle tree over the blocks"
+            << std::endl;
+  std::cout << "  --merkle-tree=tree_file        write the full Merkle tree, implies --merkle"
+            << std::endl;
+  std::cout << "  --merkle-diff                  print ranges of differing blocks: signature "
+               "--merkle-diff tree_file1 tree_file2"
+            << std::endl;
+  std::cout << "  --digest=tree|sha256           write the digest of the whole file instead of the "
+               "signature: tree of the blocks on all cores or plain SHA256"
+            << std::endl;
+  std::cout << "  --cdc                          content-defined chunks, the block size is their "
+               "average: a line \"offset length digest\" per chunk"
+            << std::endl;
+  std::cout << "  --chunk-min=N --chunk-max=N    chunk size limits of --cdc (default a quarter "
+               "and 8 times the average)"
+            << std::endl;
+  std::cout << "  --batch=directory|list_file    sign every file: signature --batch=input out_dir "
+               "[block_size]"
+            << std::endl;
+  std::cout << "  --jobs=N                       files signed at once in the batch mode (default "
+               "the number of cores)"
+            << std::endl;
+  std::cout << "  --threads=N                    number of workers (default the number of cores)"
+            << std::endl;
+  std::cout << "  --cpus=list                    pin the workers to the CPUs in turns, e.g. "
+               "0-7,16-23, every NUMA node hashes its own read windows"
+            << std::endl;
+  std::cout << "  --progress[=seconds]           progress line on stderr every interval (default "
+               "1 second)"
+            << std::endl;
+  std::cout << "  --metrics=file                 dump per-thread counters and latency histograms "
+               "every second or progress interval, JSON for *.json, Prometheus text otherwise"
+            << std::endl;
+  std::cout << "  --self-test                    check SHA256 backends and the other algorithms, "
+               "then exit"
+            << std::endl;
+}
+
+[[noreturn]] void wrong_option(const std::string& arg) {
+  std::cout << "Wrong option " << arg << std::endl;
+  print_usage();
+  std::exit(0);
+}
+
+const std::vector<HashCalc::ESha256Backend> sha256_backends = {
+    HashCalc::ESha256Backend::mbedtls, HashCalc::ESha256Backend::shani,
+    HashCalc::ESha256Backend::armv8};
+
+bool parse_format(const std::string& value, HashCalc::EOutputFormat& format) {
+  if (value == "text") {
+    format = HashCalc::EOutputFormat::text;
+  } else if (value == "binary") {
+    format = HashCalc::EOutputFormat::binary;
+  } else {
+    return false;
+  }
+  return true;
+}
+
+//! Text signatures keep neither the block size nor the input size, they are taken from args
+[[noreturn]] void convert(HashCalc::EOutputFormat format, const std::vector<std::string>& args) {
+  if (args.size() != 2 && args.size() != 4) {
+    std::cout << "Wrong number of arguments" << std::endl;
+    print_usage();
+    std::exit(0);
+  }
+  const auto block_size = args.size() == 4 ? std::strtoull(args[2].c_str(), nullptr, 10) : 0;
+  const auto input_size = args.size() == 4 ? std::strtoull(args[3].c_str(), nullptr, 10) : 0;
+  convert_signature(args[0], args[1], format, block_size, input_size);
+  std::cout << "Converted " << args[0] << " to " << args[1] << std::endl;
+  std::exit(0);
+}
+
+//! Only the subtrees which differ are visited, the trees must have the same number of leaves
+[[noreturn]] void merkle_diff(const std::vector<std::string>& args) {
+  if (args.size() != 2) {
+    std::cout << "Wrong number of arguments" << std::endl;
+    print_usage();
+    std::exit(0);
+  }
+  CMerkleTree first;
+  CMerkleTree second;
+  first.open(args[0]);
+  second.open(args[1]);
+  const auto ranges = first.diff(second);
+  for (const auto& range : ranges) {
+    std::cout << range.first;
+    if (range.second - range.first > 1) {
+      std::cout << "-" << range.second - 1;
+    }
+    std::cout << std::endl;
+  }
+  std::cout << (ranges.empty() ? "Trees match" : "Trees differ") << std::endl;
+  std::exit(ranges.empty() ? 0 : 1);
+}
+
+//! Signatures are written below out_dir with the relative paths of the inputs
+[[noreturn]] void batch(const std::string& input,
+                        const std::vector<std::string>& args,
+                        const HashCalc::COptions& options,
+                        uint32_t jobs) {
+  if (args.empty() || args.size() > 2) {
+    std::cout << "Wrong number of arguments" << std::endl;
+    print_usage();
+    std::exit(0);
+  }
+  auto block_size = HashCalc::one_megabyte;
+  if (args.size() == 2 && std::strtoull(args[1].c_str(), nullptr, 10)) {
+    block_size = std::strtoull(args[1].c_str(), nullptr, 10);
+  }
+  const auto suffix = options.output_format == HashCalc::EOutputFormat::binary ? ".sig" : ".txt";
+  CBatchCalc calc(CBatchCalc::list_files(input, args[0], suffix), block_size, options, jobs);
+  calc.run();
+  for (const auto& [path, error] : calc.get_failed()) {
+    std::cout << "Failed " << path << ": " << error << std::endl;
+  }
+  const auto micro = std::max(calc.get_micro(), uint64_t(1));
+  std::cout << "Files: " << calc.get_files_count() << ", failed: " << calc.get_failed().size()
+            << ", bytes: " << calc.get_bytes() << ", time: " << micro << " us, throughput: "
+            << calc.get_bytes() / micro << " MB/s" << std::endl;
+  std::cout << "CPU time: " << calc.get_cpu_micro() << " us, cores busy on average: "
+            << double(calc.get_cpu_micro()) / double(micro) << std::endl;
+  std::exit(calc.get_failed().empty() ? 0 : 1);
+}
+
+[[noreturn]] void self_test() {
+  auto failed = false;
+  for (auto backend : sha256_backends) {
+    std::cout << get_sha256_backend_name(backend) << ": ";
+    if (!is_sha256_backend_supported(backend)) {
+      std::cout << "not supported" << std::endl;
+    } else if (sha256_self_test(backend)) {
+      std::cout << "passed" << std::endl;
+    } else {
+      std::cout << "FAILED" << std::endl;
+      failed = true;
+    }
+  }
+  for (uint32_t lanes : {4u, 8u, 16u}) {
+    std::cout << "lanes x" << lanes << ": ";
+    if (!is_sha256_lanes_supported(lanes)) {
+      std::cout << "not supported" << std::endl;
+    } else if (sha256_lanes_self_test(lanes)) {
+      std::cout << "passed" << std::endl;
+    } else {
+      std::cout << "FAILED" << std::endl;
+      failed = true;
+    }
+  }
+  for (auto algorithm : {HashCalc::EAlgorithm::sha512_256, HashCalc::EAlgorithm::blake3,
+                         HashCalc::EAlgorithm::xxh3_128}) {
+    const auto passed = algorithm_self_test(algorithm);
+    std::cout << get_algorithm_name(algorithm) << ": " << (passed ? "passed" : "FAILED")
+              << std::endl;
+    failed = failed || !passed;
+  }
+  std::cout << "Best: " << get_sha256_backend_name(get_best_sha256_backend()) << std::endl;
+  std::exit(failed ? 1 : 0);
+}
+}  // namespace
+
 int main(int argc, char* argv[]) {
   std::cout << "Signature tool v 1.0" << std::endl;
-  std::cout << "Thread count: " << get_threads_count() << std::endl;
   std::pair<std::string, std::string> files;
   auto block_size = HashCalc::one_megabyte;
+  HashCalc::COptions options;
+  std::vector<std::string> args;
+  std::optional<HashCalc::EOutputFormat> convert_format;
+  auto diff_trees = false;
+  std::string batch_input;
+  uint32_t jobs = 0;
+  uint32_t threads = 0;
+  std::vector<uint32_t> cpus;
+  auto cdc = false;
+  HashCalc::CChunkSizes chunk_sizes = {0, 0, 0};
 
-  if (argc != 4) {
-    std::cout << "Wrong number of arguments" << std::endl;
-    std::cout << "Should be like this: signature test_file1.bin "
-                 "test_file_hash.txt 1048576"
-              << std::endl;
-    std::exit(0);
+  for (int i = 1; i < argc; i++) {
+    const std::string arg = argv[i];
+    if (arg.rfind("--", 0) != 0) {
+      args.push_back(arg);
+      continue;
+    }
+    const auto separator = arg.find('=');
+    const auto name = arg.substr(2, separator == std::string::npos ? separator : separator - 2);
+    const auto value = separator == std::string::npos ? std::string() : arg.substr(separator + 1);
+    if (name == "buffers") {
+      const auto arg_buffers_count = std::strtoul(value.c_str(), nullptr, 10);
+      if (arg_buffers_count == 0 || arg_buffers_count > UINT32_MAX) {
+        wrong_option(arg);
+      }
+      options.buffers_count = uint32_t(arg_buffers_count);
+    } else if (name == "engine") {
+      if (value == "auto") {
+        options.read_engine = HashCalc::EReadEngine::automatic;
+      } else if (value == "stream") {
+        options.read_engine = HashCalc::EReadEngine::stream;
+      } else if (value == "mmap") {
+        options.read_engine = HashCalc::EReadEngine::mmap;
+      } else if (value == "async") {
+        options.read_engine = HashCalc::EReadEngine::async;
+      } else if (value == "pread") {
+        options.read_engine = HashCalc::EReadEngine::pread;
+      } else {
+        wrong_option(arg);
+      }
+    } else if (name == "algorithm") {
+      if (!parse_algorithm(value, options.algorithm)) {
+        wrong_option(arg);
+      }
+    } else if (name == "sha256") {
+      auto found = value == "auto";
+      for (auto backend : sha256_backends) {
+        if (value == get_sha256_backend_name(backend)) {
+          options.sha256_backend = backend;
+          found = true;
+        }
+      }
+      if (!found) {
+        wrong_option(arg);
+      }
+    } else if (name == "lanes") {
+      if (value == "auto") {
+        options.sha256_lanes = 0;
+      } else if (value == "1" || value == "4" || value == "8" || value == "16") {
+        options.sha256_lanes = uint32_t(std::stoul(value));
+      } else {
+        wrong_option(arg);
+      }
+    } else if (name == "format") {
+      if (!parse_format(value, options.output_format)) {
+        wrong_option(arg);
+      }
+    } else if (name == "convert") {
+      convert_format.emplace();
+      if (!parse_format(value, *convert_format)) {
+        wrong_option(arg);
+      }
+    } else if (name == "verify" && !value.empty()) {
+      options.verify_path = value;
+    } else if (name == "io-threads") {
+      const auto arg_io_threads = std::strtoul(value.c_str(), nullptr, 10);
+      if (arg_io_threads == 0 || arg_io_threads > UINT16_MAX) {
+        wrong_option(arg);
+      }
+      options.io_threads = uint32_t(arg_io_threads);
+    } else if (name == "direct") {
+      options.direct_io = true;
+    } else if (name == "first-mismatch") {
+      options.first_mismatch = true;
+    } else if (name == "previous" && !value.empty()) {
+      options.previous_path = value;
+    } else if (name == "sidecar") {
+      options.write_sidecar = true;
+    } else if (name == "paranoid") {
+      options.paranoid = true;
+    } else if (name == "merkle") {
+      options.merkle = true;
+    } else if (name == "merkle-tree" && !value.empty()) {
+      options.merkle_tree_path = value;
+    } else if (name == "merkle-diff") {
+      diff_trees = true;
+    } else if (name == "digest") {
+      if (value == "tree") {
+        options.file_digest = HashCalc::EFileDigest::tree;
+      } else if (value == "sha256") {
+        options.file_digest = HashCalc::EFileDigest::sha256;
+      } else {
+        wrong_option(arg);
+      }
+    } else if (name == "cdc") {
+      cdc = true;
+    } else if (name == "chunk-min" || name == "chunk-max") {
+      const auto size = std::strtoull(value.c_str(), nullptr, 10);
+      if (!size || size == ULLONG_MAX) {
+        wrong_option(arg);
+      }
+      (name == "chunk-min" ? chunk_sizes.min : chunk_sizes.max) = size;
+    } else if (name == "batch" && !value.empty()) {
+      batch_input = value;
+    } else if (name == "jobs") {
+      const auto arg_jobs = std::strtoul(value.c_str(), nullptr, 10);
+      if (arg_jobs == 0 || arg_jobs > UINT32_MAX) {
+        wrong_option(arg);
+      }
+      jobs = uint32_t(arg_jobs);
+    } else if (name == "threads") {
+      const auto arg_threads = std::strtoul(value.c_str(), nullptr, 10);
+      if (arg_threads == 0 || arg_threads > UINT16_MAX) {
+        wrong_option(arg);
+      }
+      threads = uint32_t(arg_threads);
+    } else if (name == "cpus") {
+      if (!parse_cpu_list(value, cpus)) {
+        wrong_option(arg);
+      }
+    } else if (name == "progress") {
+      const auto seconds = value.empty() ? 1.0 : std::strtod(value.c_str(), nullptr);
+      if (!(seconds > 0 && seconds < 1e6)) {
+        wrong_option(arg);
+      }
+      options.progress_interval_ms = std::max(uint64_t(seconds * 1000), uint64_t(1));
+    } else if (name == "metrics" && !value.empty()) {
+      options.metrics_path = value;
+    } else if (name == "self-test") {
+      self_test();
+    } else {
+      wrong_option(arg);
+    }
   }
 
-  if (argv[1]) {
-    if (!fs::is_regular_file(argv[1])) {
-      std::cout << "Input file is not valid" << std::endl;
-      std::exit(0);
-    }
-    files.first = argv[1];
+  // The pool lives until exit, the batch and the single file modes exit from their functions
+  static std::unique_ptr<CThreadPool> pool;
+  if (!cpus.empty()) {
+    pool = std::make_unique<CThreadPool>(CCpuTopology::read().place(threads, cpus));
+  } else if (threads) {
+    pool = std::make_unique<CThreadPool>(threads);
+  }
+  options.thread_pool = pool.get();
+  std::cout << "Thread count: " << (pool ? pool->count() : get_threads_count());
+  if (pool && pool->nodes_count() > 1) {
+    std::cout << ", NUMA nodes: " << pool->nodes_count();
+  }
+  std::cout << std::endl;
+
+  if (convert_format) {
+    convert(*convert_format, args);
+  }
+  if (diff_trees) {
+    merkle_diff(args);
+  }
+  if (!batch_input.empty()) {
+    batch(batch_input, args, options, jobs);
   }
 
-  if (argv[2]) {
-    files.second = argv[2];
+  if (args.size() != 3) {
+    std::cout << "Wrong number of arguments" << std::endl;
+    print_usage();
+    std::exit(0);
+  }
+
+  // Standard input, pipes and devices are streamed
+  if (args[0] != "-" && (!fs::exists(args[0]) || fs::is_directory(args[0]))) {
+    std::cout << "Input file is not valid" << std::endl;
+    std::exit(0);
   }
+  files.first = args[0];
+  files.second = args[1];
 
-  const auto arg_block_size = std::strtoll(argv[3], nullptr, 10);
+  const auto arg_block_size = std::strtoll(args[2].c_str(), nullptr, 10);
   if (arg_block_size != 0 && arg_block_size != LLONG_MAX && arg_block_size != LLONG_MIN) {
     block_size = uint64_t(arg_block_size);
   }
 
-  CHashCalc calc(files.first, files.second, block_size);
+  if (cdc) {
+    chunk_sizes.average = block_size;
+    chunk_sizes.min = chunk_sizes.min ? chunk_sizes.min : std::max(block_size / 4, uint64_t(1));
+    chunk_sizes.max = chunk_sizes.max ? chunk_sizes.max : block_size * 8;
+    CChunkCalc chunk_calc(files.first, files.second, chunk_sizes, options);
+    chunk_calc.run();
+    std::cout << "Chunks: " << chunk_calc.get_chunks_count() << ", average size: "
+              << chunk_calc.get_input_size() / std::max(chunk_calc.get_chunks_count(), uint64_t(1))
+              << std::endl;
+    return 0;
+  }
+
+  CHashCalc calc(files.first, files.second, block_size, options);
+  if (calc.get_algorithm() == HashCalc::EAlgorithm::sha256) {
+    std::cout << "SHA256: " << get_sha256_backend_name(calc.get_sha256_backend());
+    if (calc.get_sha256_lanes() > 1) {
+      std::cout << ", " << calc.get_sha256_lanes() << " lanes";
+    }
+  } else {
+    std::cout << "Algorithm: " << get_algorithm_name(calc.get_algorithm());
+  }
+  std::cout << std::endl;
   calc.run();
+  if (calc.get_read_engine() == HashCalc::EReadEngine::async) {
+    std::cout << "Async reads: " << (calc.is_uring_used() ? "io_uring" : "pread") << std::endl;
+  }
+  if (!options.previous_path.empty()) {
+    std::cout << "Blocks rehashed: " << calc.get_rehashed_blocks() << std::endl;
+  }
+  if (calc.get_merkle_root()) {
+    std::cout << "Merkle root: " << digest_to_hex(*calc.get_merkle_root()) << std::endl;
+  }
+  if (calc.get_file_digest()) {
+    std::cout << "File digest: " << digest_to_hex(*calc.get_file_digest()) << std::endl;
+  }
+  if (!options.verify_path.empty()) {
+    if (calc.get_mismatched_blocks()) {
+      std::cout << "Verification failed, mismatching blocks: " << calc.get_mismatched_blocks()
+                << (options.first_mismatch ? " (stopped at the first one)" : "") << std::endl;
+      return 1;
+    }
+    std::cout << "Verification passed" << std::endl;
+  }
 }
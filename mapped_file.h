@@ -0,0 +1,98 @@
+#ifndef SIGNATURE_MAPPED_FILE_H
+#define SIGNATURE_MAPPED_FILE_H
+
+#include <algorithm>
+#include <cstdint>
+#include <string>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+//! Read-only memory mapping of a regular file, workers hash slices of the mapping directly
+class CMappedFile {
+ public:
+  CMappedFile() : m_data(nullptr), m_size(0) {}
+
+  ~CMappedFile() { close(); }
+
+  CMappedFile(const CMappedFile&) = delete;
+
+  CMappedFile& operator=(CMappedFile const&) = delete;
+
+  CMappedFile(CMappedFile&&) = delete;
+
+  CMappedFile& operator=(CMappedFile&&) = delete;
+
+  //! Maps the whole file, returns false for pipes, special and empty files or if mmap is not
+  //! supported, the caller should fall back to the stream reader then
+  bool open(const std::string& path) {
+    close();
+#ifdef _WIN32
+    (void)path;
+    return false;
+#else
+    const int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+      return false;
+    }
+    struct stat st = {};
+    if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode) || st.st_size <= 0) {
+      ::close(fd);
+      return false;
+    }
+    void* data = mmap(nullptr, size_t(st.st_size), PROT_READ, MAP_PRIVATE, fd, 0);
+    // The mapping keeps its own reference to the file
+    ::close(fd);
+    if (data == MAP_FAILED) {
+      return false;
+    }
+    m_data = static_cast<const char*>(data);
+    m_size = uint64_t(st.st_size);
+    madvise(data, m_size, MADV_SEQUENTIAL);
+    return true;
+#endif
+  }
+
+  void close() {
+#ifndef _WIN32
+    if (m_data) {
+      munmap(const_cast<char*>(m_data), m_size);
+    }
+#endif
+    m_data = nullptr;
+    m_size = 0;
+  }
+
+  [[nodiscard]] bool is_open() const { return m_data != nullptr; }
+
+  [[nodiscard]] const char* data() const { return m_data; }
+
+  [[nodiscard]] uint64_t size() const { return m_size; }
+
+  //! Starts asynchronous readahead of the range
+  void will_need(uint64_t offset, uint64_t length) const {
+#ifndef _WIN32
+    if (!m_data || offset >= m_size) {
+      return;
+    }
+    length = std::min(length, m_size - offset);
+    // madvise requires page aligned address
+    const auto page = uint64_t(sysconf(_SC_PAGESIZE));
+    const auto aligned = offset - offset % page;
+    madvise(const_cast<char*>(m_data) + aligned, length + (offset - aligned), MADV_WILLNEED);
+#else
+    (void)offset;
+    (void)length;
+#endif
+  }
+
+ private:
+  const char* m_data;
+  uint64_t m_size;
+};
+
+#endif  // SIGNATURE_MAPPED_FILE_H
@@ -0,0 +1,314 @@
+#ifndef SIGNATURE_MERKLE_TREE_H
+#define SIGNATURE_MERKLE_TREE_H
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <stdexcept>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "file_layout.h"
+#include "mapped_file.h"
+#include "sha256.h"
+#include "signature_file.h"
+#include "utils.h"
+
+//! Merkle tree over the block digests. <br>
+//! Leaves are the SHA256 digests of the blocks, an interior node is SHA256(0x01 || left || right).
+//! A level of odd size promotes its last node to the next level unchanged, so the tree of n
+//! leaves is the one of RFC 6962: the left subtree holds the largest power of two below n leaves
+namespace Merkle {
+//! Prefix of the interior nodes, separates them from the leaves
+constexpr unsigned char node_prefix = 0x01;
+
+inline CDigest hash_node(const CDigest& left, const CDigest& right, CSha256Function sha256) {
+  char buffer[1 + 2 * sha256_digest_length];
+  buffer[0] = static_cast<char>(node_prefix);
+  std::memcpy(buffer + 1, left.data(), sha256_digest_length);
+  std::memcpy(buffer + 1 + sha256_digest_length, right.data(), sha256_digest_length);
+  CDigest digest = {};
+  sha256(buffer, sizeof(buffer), digest.data());
+  return digest;
+}
+
+//! Root of the perfect subtree over count leaves, count is a power of two. Interior levels are
+//! kept in scratch of count / 2 digests
+inline CDigest subtree_root(const CDigest* leaves,
+                            uint64_t count,
+                            CDigest* scratch,
+                            CSha256Function sha256) {
+  if (count == 1) {
+    return leaves[0];
+  }
+  for (uint64_t i = 0; i < count / 2; i++) {
+    scratch[i] = hash_node(leaves[2 * i], leaves[2 * i + 1], sha256);
+  }
+  for (count /= 2; count > 1; count /= 2) {
+    for (uint64_t i = 0; i < count / 2; i++) {
+      scratch[i] = hash_node(scratch[2 * i], scratch[2 * i + 1], sha256);
+    }
+  }
+  return scratch[0];
+}
+
+//! Prefix of the whole file digest, separates it from the nodes
+constexpr unsigned char file_prefix = 0x02;
+
+//! Digest of the whole file: SHA256(0x02 || block size || input size || root), the sizes are
+//! 64-bit little-endian, so the same data split into other blocks gets another digest
+inline CDigest file_digest(const CDigest& root,
+                           uint64_t block_size,
+                           uint64_t input_size,
+                           CSha256Function sha256) {
+  char buffer[1 + 8 + 8 + sha256_digest_length];
+  buffer[0] = static_cast<char>(file_prefix);
+  for (size_t i = 0; i < 8; i++) {
+    buffer[1 + i] = static_cast<char>(block_size >> (8 * i));
+    buffer[9 + i] = static_cast<char>(input_size >> (8 * i));
+  }
+  std::memcpy(buffer + 17, root.data(), sha256_digest_length);
+  CDigest digest = {};
+  sha256(buffer, sizeof(buffer), digest.data());
+  return digest;
+}
+
+//! Number of nodes of the level above the level of count nodes
+inline uint64_t parent_count(uint64_t count) {
+  return (count + 1) / 2;
+}
+}  // namespace Merkle
+
+//! Computes the root from the leaves in order with O(log n) memory, roots of perfect subtrees
+//! may be added instead of their leaves
+class CMerkleBuilder {
+ public:
+  explicit CMerkleBuilder(CSha256Function sha256) : m_sha256(sha256), m_leaves(0) {}
+
+  //! Adds the root of the perfect subtree of 2^height leaves, the number of leaves added before
+  //! must be a multiple of 2^height
+  void add(const CDigest& node, uint32_t height = 0) {
+    m_leaves += uint64_t(1) << height;
+    auto digest = node;
+    while (!m_stack.empty() && m_stack.back().second == height) {
+      digest = Merkle::hash_node(m_stack.back().first, digest, m_sha256);
+      m_stack.pop_back();
+      height++;
+    }
+    m_stack.emplace_back(digest, height);
+  }
+
+  [[nodiscard]] uint64_t leaves() const { return m_leaves; }
+
+  //! Root of the leaves added so far, smaller subtrees are on the right
+  [[nodiscard]] CDigest root() const {
+    if (m_stack.empty()) {
+      return {};
+    }
+    auto digest = m_stack.back().first;
+    for (auto it = m_stack.rbegin() + 1; it != m_stack.rend(); ++it) {
+      digest = Merkle::hash_node(it->first, digest, m_sha256);
+    }
+    return digest;
+  }
+
+ private:
+  CSha256Function m_sha256;
+  uint64_t m_leaves;
+  //! Roots of the perfect subtrees with their heights, the heights decrease to the top
+  std::vector<std::pair<CDigest, uint32_t>> m_stack;
+};
+
+//! Full tree file: a 64 bytes header (magic, version, leaf count, little-endian) and the levels
+//! from the leaves to the root, the last 32 bytes are the root. <br>
+//! Two trees are compared from the root down, only the subtrees which differ are visited
+class CMerkleTree {
+ public:
+  static constexpr uint64_t header_size = 64;
+  static constexpr char magic[8] = {'S', 'I', 'G', 'N', 'T', 'R', 'E', 'E'};
+  static constexpr uint32_t current_version = 1;
+
+  CMerkleTree() : m_data(nullptr), m_leaves(0) {}
+
+  CMerkleTree(const CMerkleTree&) = delete;
+
+  CMerkleTree& operator=(CMerkleTree const&) = delete;
+
+  CMerkleTree(CMerkleTree&&) = delete;
+
+  CMerkleTree& operator=(CMerkleTree&&) = delete;
+
+  //! Builds the tree over the digests of the signature, every level is split between the
+  //! workers of the pool. Throws std::runtime_error on write errors
+  static CDigest build(const CSignatureFile& signature,
+                       const std::string& path,
+                       CThreadPool& pool,
+                       CSha256Function sha256) {
+    const auto leaves = signature.block_count();
+    if (!leaves) {
+      throw std::runtime_error("Fatal error, signature has no blocks");
+    }
+    std::vector<CDigest> level(leaves);
+    for (uint64_t i = 0; i < leaves; i++) {
+      level[i] = signature.digest(i);
+    }
+    std::ofstream out(path, std::ios::binary | std::ios::trunc);
+    if (!out.is_open()) {
+      throw std::runtime_error("Fatal error, couldn't open output file " + path);
+    }
+    char header[header_size] = {};
+    std::memcpy(header, magic, sizeof(magic));
+    for (size_t i = 0; i < 4; i++) {
+      header[8 + i] = static_cast<char>(current_version >> (8 * i));
+    }
+    for (size_t i = 0; i < 8; i++) {
+      header[16 + i] = static_cast<char>(leaves >> (8 * i));
+    }
+    out.write(header, header_size);
+    std::vector<CDigest> parents;
+    for (;;) {
+      out.write(reinterpret_cast<const char*>(level.data()),
+                std::streamsize(level.size() * sha256_digest_length));
+      if (level.size() == 1) {
+        break;
+      }
+      parents.resize(Merkle::parent_count(level.size()));
+      parallel_for(pool, parents.size(), [&](uint64_t i) {
+        parents[i] = 2 * i + 1 < level.size()
+                         ? Merkle::hash_node(level[2 * i], level[2 * i + 1], sha256)
+                         : level[2 * i];
+      });
+      level.swap(parents);
+    }
+    out.flush();
+    if (!out) {
+      throw std::runtime_error("Fatal error, couldn't write output file " + path);
+    }
+    return level[0];
+  }
+
+  //! Throws std::runtime_error if the file can't be mapped or it isn't a valid tree
+  void open(const std::string& path) {
+    if (!m_file.open(path) || m_file.size() < header_size ||
+        std::memcmp(m_file.data(), magic, sizeof(magic)) != 0) {
+      throw std::runtime_error("Fatal error, couldn't open Merkle tree " + path);
+    }
+    uint32_t version = 0;
+    m_leaves = 0;
+    for (size_t i = 0; i < 4; i++) {
+      version |= uint32_t(static_cast<unsigned char>(m_file.data()[8 + i])) << (8 * i);
+    }
+    for (size_t i = 0; i < 8; i++) {
+      m_leaves |= uint64_t(static_cast<unsigned char>(m_file.data()[16 + i])) << (8 * i);
+    }
+    m_level_offsets.clear();
+    uint64_t nodes = 0;
+    for (auto count = m_leaves; count; count = count > 1 ? Merkle::parent_count(count) : 0) {
+      m_level_offsets.push_back(nodes);
+      nodes += count;
+    }
+    if (version != current_version || !m_leaves ||
+        m_file.size() != header_size + nodes * sha256_digest_length) {
+      throw std::runtime_error("Fatal error, corrupted Merkle tree " + path);
+    }
+    m_data = m_file.data() + header_size;
+  }
+
+  [[nodiscard]] uint64_t leaves() const { return m_leaves; }
+
+  [[nodiscard]] uint32_t levels() const { return uint32_t(m_level_offsets.size()); }
+
+  [[nodiscard]] uint64_t level_size(uint32_t level) const {
+    auto count = m_leaves;
+    for (uint32_t i = 0; i < level; i++) {
+      count = Merkle::parent_count(count);
+    }
+    return count;
+  }
+
+  [[nodiscard]] CDigest node(uint32_t level, uint64_t index) const {
+    CDigest digest = {};
+    std::memcpy(digest.data(), m_data + (m_level_offsets[level] + index) * sha256_digest_length,
+                sha256_digest_length);
+    return digest;
+  }
+
+  [[nodiscard]] CDigest root() const { return node(levels() - 1, 0); }
+
+  //! Siblings from the leaf up to the root, levels where the node is promoted have no sibling
+  [[nodiscard]] std::vector<CDigest> proof(uint64_t leaf) const {
+    std::vector<CDigest> siblings;
+    for (uint32_t level = 0; level + 1 < levels(); level++, leaf /= 2) {
+      const auto sibling = leaf ^ 1;
+      if (sibling < level_size(level)) {
+        siblings.push_back(node(level, sibling));
+      }
+    }
+    return siblings;
+  }
+
+  //! Checks the proof of the leaf of the tree of leaves_count leaves against the root
+  static bool verify_proof(const CDigest& leaf_digest,
+                           uint64_t leaf,
+                           uint64_t leaves_count,
+                           const std::vector<CDigest>& proof,
+                           const CDigest& root,
+                           CSha256Function sha256) {
+    auto digest = leaf_digest;
+    size_t used = 0;
+    for (auto count = leaves_count; count > 1; count = Merkle::parent_count(count), leaf /= 2) {
+      const auto sibling = leaf ^ 1;
+      if (sibling >= count) {
+        continue;
+      }
+      if (used == proof.size()) {
+        return false;
+      }
+      digest = leaf & 1 ? Merkle::hash_node(proof[used], digest, sha256)
+                        : Merkle::hash_node(digest, proof[used], sha256);
+      used++;
+    }
+    return used == proof.size() && digest == root;
+  }
+
+  //! Ranges of leaves which differ, the trees must have the same number of leaves. <br>
+  //! Visits O(log n) nodes per differing leaf
+  [[nodiscard]] CRanges diff(const CMerkleTree& other) const {
+    if (other.leaves() != m_leaves) {
+      return {{0, std::max(m_leaves, other.leaves())}};
+    }
+    CRanges ranges;
+    diff_node(other, levels() - 1, 0, ranges);
+    return ranges;
+  }
+
+ private:
+  void diff_node(const CMerkleTree& other, uint32_t level, uint64_t index, CRanges& ranges) const {
+    if (node(level, index) == other.node(level, index)) {
+      return;
+    }
+    if (!level) {
+      if (!ranges.empty() && ranges.back().second == index) {
+        ranges.back().second++;
+      } else {
+        ranges.emplace_back(index, index + 1);
+      }
+      return;
+    }
+    // A promoted node has the only child
+    diff_node(other, level - 1, index * 2, ranges);
+    if (index * 2 + 1 < level_size(level - 1)) {
+      diff_node(other, level - 1, index * 2 + 1, ranges);
+    }
+  }
+
+  CMappedFile m_file;
+  const char* m_data;
+  uint64_t m_leaves;
+  //! Offset of the first node of every level, in nodes
+  std::vector<uint64_t> m_level_offsets;
+};
+
+#endif  // SIGNATURE_MERKLE_TREE_H
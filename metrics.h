@@ -0,0 +1,301 @@
+#ifndef SIGNATURE_METRICS_H
+#define SIGNATURE_METRICS_H
+
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <filesystem>
+#include <fstream>
+#include <functional>
+#include <iomanip>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "utils.h"
+
+//! Counters of a thread of the calculation, written by it only, in cache lines of their own. <br>
+//! The reader fills the read fields and waits for free windows, workers and I/O threads hash,
+//! the writer waits for hashed windows and writes them
+struct alignas(64) CThreadMetrics {
+  CCounter bytes_read;
+  CCounter blocks_hashed;
+  CCounter bytes_hashed;
+  CCounter hash_ns;
+  //! Blocks whose digests were copied from the previous signature
+  CCounter blocks_copied;
+  //! Blocks the writer took: written, compared with the signature or folded into the digest
+  CCounter blocks_written;
+  //! Digests written into the signature
+  CCounter bytes_written;
+  CCounter write_ns;
+  //! Reader - waits for free windows, writer - waits for hashed ones
+  CCounter wait_ns;
+  //! A read call or a completion
+  CHistogram read_latency;
+  //! A task: a batch of blocks
+  CHistogram hash_latency;
+  //! A window of digests
+  CHistogram write_latency;
+};
+
+//! State of the calculation at a moment, the totals are summed over the threads
+struct CMetricsSnapshot {
+  struct CThread {
+    std::string name;
+    uint64_t bytes_read = 0;
+    uint64_t reads = 0;
+    uint64_t blocks_hashed = 0;
+    uint64_t bytes_hashed = 0;
+    uint64_t hash_ns = 0;
+    uint64_t blocks_copied = 0;
+    uint64_t blocks_written = 0;
+    uint64_t bytes_written = 0;
+    uint64_t write_ns = 0;
+    uint64_t wait_ns = 0;
+    //! Pool workers: parked without work and waiting for the mutex of the pool
+    uint64_t idle_ns = 0;
+    uint64_t lock_wait_ns = 0;
+  };
+
+  struct CHistogramValues {
+    std::array<uint64_t, CHistogram::buckets_count> buckets = {};
+    uint64_t sum = 0;
+
+    void add(const CHistogram& histogram) {
+      for (uint32_t i = 0; i < CHistogram::buckets_count; i++) {
+        buckets[i] += histogram.bucket(i);
+      }
+      sum += histogram.sum();
+    }
+
+    [[nodiscard]] uint64_t count() const {
+      uint64_t total = 0;
+      for (const auto value : buckets) {
+        total += value;
+      }
+      return total;
+    }
+  };
+
+  uint64_t elapsed_ns = 0;
+  //! HashCalc::unknown_size while a streamed input is being read
+  uint64_t input_size = 0;
+  //! Bytes of the input whose digests the writer took
+  uint64_t done_bytes = 0;
+  //! Claims of the task managers lost to other workers
+  uint64_t claim_retries = 0;
+  std::vector<CThread> threads;
+  CHistogramValues read_latency;
+  CHistogramValues hash_latency;
+  CHistogramValues write_latency;
+
+  //! Sum of a field over the threads
+  [[nodiscard]] uint64_t total(uint64_t CThread::*field) const {
+    uint64_t sum = 0;
+    for (const auto& thread : threads) {
+      sum += thread.*field;
+    }
+    return sum;
+  }
+
+  //! "Progress: 45.2% (4520 of 10000 MB), 1034 MB/s, ETA 5 s", the throughput is the one since
+  //! previous, the ETA is based on the average. A streamed input has no percentage and ETA
+  [[nodiscard]] std::string progress_line(const CMetricsSnapshot* previous) const {
+    const auto micro = std::max(elapsed_ns / 1000, uint64_t(1));
+    const auto interval =
+        previous ? std::max((elapsed_ns - previous->elapsed_ns) / 1000, uint64_t(1)) : micro;
+    const auto rate = (done_bytes - (previous ? previous->done_bytes : 0)) / interval;
+    std::ostringstream out;
+    out << "Progress: ";
+    if (input_size != UINT64_MAX) {
+      const auto left = input_size - std::min(input_size, done_bytes);
+      const auto eta = double(left) * double(micro) / double(std::max(done_bytes, uint64_t(1)));
+      out << std::fixed << std::setprecision(1)
+          << 100.0 * double(done_bytes) / double(std::max(input_size, uint64_t(1))) << "% ("
+          << done_bytes / 1000000 << " of " << input_size / 1000000 << " MB), " << rate
+          << " MB/s, ETA " << uint64_t(eta / 1e6) << " s";
+    } else {
+      out << done_bytes / 1000000 << " MB, " << rate << " MB/s";
+    }
+    return out.str();
+  }
+
+  //! Object with the totals, the threads and the histograms, bucket i of a histogram counts the
+  //! durations in [2^i, 2^(i+1)) ns
+  [[nodiscard]] std::string to_json() const {
+    std::ostringstream out;
+    out << "{\n  \"elapsed_ns\": " << elapsed_ns << ",\n  \"input_bytes\": ";
+    if (input_size != UINT64_MAX) {
+      out << input_size;
+    } else {
+      out << "null";
+    }
+    out << ",\n  \"done_bytes\": " << done_bytes << ",\n  \"claim_retries\": " << claim_retries
+        << ",\n  \"threads\": [";
+    for (size_t i = 0; i < threads.size(); i++) {
+      const auto& thread = threads[i];
+      out << (i ? ",\n" : "\n") << "    {\"name\": \"" << thread.name << "\"";
+      for (const auto& [name, field] : fields()) {
+        out << ", \"" << name << "\": " << thread.*field;
+      }
+      out << "}";
+    }
+    out << "\n  ],\n  \"histograms\": {";
+    auto first = true;
+    for (const auto& [name, histogram] : histograms()) {
+      out << (first ? "\n" : ",\n") << "    \"" << name << "_ns\": {\"count\": "
+          << histogram->count() << ", \"sum\": " << histogram->sum << ", \"buckets\": [";
+      for (uint32_t i = 0; i < CHistogram::buckets_count; i++) {
+        out << (i ? ", " : "") << histogram->buckets[i];
+      }
+      out << "]}";
+      first = false;
+    }
+    out << "\n  }\n}\n";
+    return out.str();
+  }
+
+  //! Text exposition format of Prometheus: counters per thread, histograms over all threads
+  [[nodiscard]] std::string to_prometheus() const {
+    std::ostringstream out;
+    out << "# TYPE signature_elapsed_seconds gauge\nsignature_elapsed_seconds "
+        << double(elapsed_ns) / 1e9 << "\n";
+    if (input_size != UINT64_MAX) {
+      out << "# TYPE signature_input_bytes gauge\nsignature_input_bytes " << input_size << "\n";
+    }
+    out << "# TYPE signature_done_bytes gauge\nsignature_done_bytes " << done_bytes << "\n";
+    out << "# TYPE signature_claim_retries_total counter\nsignature_claim_retries_total "
+        << claim_retries << "\n";
+    for (const auto& [name, field] : fields()) {
+      // Durations in seconds, the base unit of Prometheus
+      const std::string field_name = name;
+      const auto nano = field_name.size() > 3 && field_name.substr(field_name.size() - 3) == "_ns";
+      const auto metric = "signature_" +
+                          (nano ? field_name.substr(0, field_name.size() - 3) + "_seconds"
+                                : field_name) +
+                          "_total";
+      out << "# TYPE " << metric << " counter\n";
+      for (const auto& thread : threads) {
+        out << metric << "{thread=\"" << thread.name << "\"} ";
+        if (nano) {
+          out << double(thread.*field) / 1e9 << "\n";
+        } else {
+          out << thread.*field << "\n";
+        }
+      }
+    }
+    for (const auto& [name, histogram] : histograms()) {
+      const auto metric = std::string("signature_") + name + "_seconds";
+      out << "# TYPE " << metric << " histogram\n";
+      uint64_t cumulative = 0;
+      for (uint32_t i = 0; i + 1 < CHistogram::buckets_count; i++) {
+        cumulative += histogram->buckets[i];
+        out << metric << "_bucket{le=\"" << double(uint64_t(2) << i) / 1e9 << "\"} " << cumulative
+            << "\n";
+      }
+      out << metric << "_bucket{le=\"+Inf\"} " << histogram->count() << "\n";
+      out << metric << "_sum " << double(histogram->sum) / 1e9 << "\n";
+      out << metric << "_count " << histogram->count() << "\n";
+    }
+    return out.str();
+  }
+
+ private:
+  static std::vector<std::pair<const char*, uint64_t CThread::*>> fields() {
+    return {{"bytes_read", &CThread::bytes_read},
+            {"reads", &CThread::reads},
+            {"blocks_hashed", &CThread::blocks_hashed},
+            {"bytes_hashed", &CThread::bytes_hashed},
+            {"hash_ns", &CThread::hash_ns},
+            {"blocks_copied", &CThread::blocks_copied},
+            {"blocks_written", &CThread::blocks_written},
+            {"bytes_written", &CThread::bytes_written},
+            {"write_ns", &CThread::write_ns},
+            {"wait_ns", &CThread::wait_ns},
+            {"idle_ns", &CThread::idle_ns},
+            {"lock_wait_ns", &CThread::lock_wait_ns}};
+  }
+
+  [[nodiscard]] std::vector<std::pair<const char*, const CHistogramValues*>> histograms() const {
+    return {{"read_latency", &read_latency},
+            {"hash_latency", &hash_latency},
+            {"write_latency", &write_latency}};
+  }
+};
+
+namespace Metrics {
+//! Writes the dump next to path and renames it, a scraper never sees a partial file. JSON if
+//! the path ends with .json, the text format of Prometheus otherwise. Returns false on errors
+inline bool write_dump(const std::string& path, const CMetricsSnapshot& snapshot) {
+  const auto json = std::filesystem::path(path).extension() == ".json";
+  const auto temporary = path + ".tmp";
+  {
+    std::ofstream out(temporary, std::ios::trunc);
+    out << (json ? snapshot.to_json() : snapshot.to_prometheus());
+    out.flush();
+    if (!out) {
+      return false;
+    }
+  }
+  std::error_code ec;
+  std::filesystem::rename(temporary, path, ec);
+  return !ec;
+}
+}  // namespace Metrics
+
+//! Thread which calls report every interval until stop()
+class CProgressReporter {
+ public:
+  CProgressReporter() : m_stopped(false) {}
+
+  ~CProgressReporter() { stop(); }
+
+  CProgressReporter(const CProgressReporter&) = delete;
+
+  CProgressReporter& operator=(CProgressReporter const&) = delete;
+
+  CProgressReporter(CProgressReporter&&) = delete;
+
+  CProgressReporter& operator=(CProgressReporter&&) = delete;
+
+  void start(uint64_t interval_ms, std::function<void()> report) {
+    m_report = std::move(report);
+    m_stopped = false;
+    m_thread = std::thread([this, interval_ms] {
+      std::unique_lock<std::mutex> lock(m_mutex);
+      while (!m_cv.wait_for(lock, std::chrono::milliseconds(interval_ms),
+                            [this] { return m_stopped; })) {
+        lock.unlock();
+        m_report();
+        lock.lock();
+      }
+    });
+  }
+
+  //! Joins the thread, does nothing if it wasn't started
+  void stop() {
+    if (!m_thread.joinable()) {
+      return;
+    }
+    {
+      std::unique_lock<std::mutex> lock(m_mutex);
+      m_stopped = true;
+    }
+    m_cv.notify_all();
+    m_thread.join();
+  }
+
+ private:
+  std::function<void()> m_report;
+  bool m_stopped;
+  std::mutex m_mutex;
+  std::condition_variable m_cv;
+  std::thread m_thread;
+};
+
+#endif  // SIGNATURE_METRICS_H
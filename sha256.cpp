@@ -0,0 +1,596 @@
+#include "sha256.h"
+
+#include <algorithm>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <utility>
+#include <vector>
+
+#ifdef _MSC_VER
+#define SIGNATURE_FORCE_INLINE __forceinline
+#else
+#define SIGNATURE_FORCE_INLINE inline __attribute__((always_inline))
+#endif
+
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || defined(_M_IX86)
+#define SIGNATURE_SHA256_X86
+#include <immintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#define SIGNATURE_TARGET_SHANI
+#else
+#include <cpuid.h>
+#define SIGNATURE_TARGET_SHANI __attribute__((target("sha,sse4.1")))
+#endif
+#endif
+
+#if defined(SIGNATURE_SHA256_X86) && (defined(__SSE2__) || defined(_M_X64))
+#define SIGNATURE_SHA256_SSE2
+#include "sha256_lanes.h"
+#endif
+
+#if defined(__aarch64__) && (defined(__ARM_FEATURE_CRYPTO) || defined(__ARM_FEATURE_SHA2))
+#define SIGNATURE_SHA256_ARMV8
+#include <arm_neon.h>
+#if defined(__linux__)
+#include <asm/hwcap.h>
+#include <sys/auxv.h>
+#endif
+#endif
+
+#ifdef SIGNATURE_SHA256_LANES_X86
+// Compiled in separate files with the instruction set enabled
+void sha256_x8_avx2(const char* const* data, size_t size, unsigned char* const* digests);
+void sha256_x16_avx512(const char* const* data, size_t size, unsigned char* const* digests);
+#endif
+
+namespace {
+alignas(16) constexpr uint32_t round_constants[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2};
+
+constexpr uint32_t initial_state[8] = {0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+                                       0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19};
+
+//! Compression function, processes blocks_count 64 bytes blocks
+using CCompressFunction = void (*)(uint32_t* state, const unsigned char* data, size_t blocks_count);
+
+//! Pads the rest of the message of size bytes, rest_size < 64, and writes the digest
+void finish_padded(CCompressFunction compress,
+                   uint32_t* state,
+                   const unsigned char* rest,
+                   size_t rest_size,
+                   uint64_t size,
+                   unsigned char* digest) {
+  // The tail, 0x80 and the message length in bits take one or two blocks
+  unsigned char tail[128] = {};
+  std::memcpy(tail, rest, rest_size);
+  tail[rest_size] = 0x80;
+  const size_t tail_size = rest_size < 56 ? 64 : 128;
+  const auto bits = size * 8;
+  for (size_t i = 0; i < 8; i++) {
+    tail[tail_size - 1 - i] = static_cast<unsigned char>(bits >> (8 * i));
+  }
+  compress(state, tail, tail_size / 64);
+  for (size_t i = 0; i < 8; i++) {
+    digest[i * 4 + 0] = static_cast<unsigned char>(state[i] >> 24);
+    digest[i * 4 + 1] = static_cast<unsigned char>(state[i] >> 16);
+    digest[i * 4 + 2] = static_cast<unsigned char>(state[i] >> 8);
+    digest[i * 4 + 3] = static_cast<unsigned char>(state[i]);
+  }
+}
+
+//! Pads the message and runs the compression function of the backend
+template <CCompressFunction Compress>
+void sha256_padded(const char* data, size_t size, unsigned char* digest) {
+  uint32_t state[8];
+  std::memcpy(state, initial_state, sizeof(state));
+  const auto bytes = reinterpret_cast<const unsigned char*>(data);
+  const auto full_blocks = size / 64;
+  if (full_blocks) {
+    Compress(state, bytes, full_blocks);
+  }
+  finish_padded(Compress, state, bytes + full_blocks * 64, size % 64, size, digest);
+}
+
+void sha256_mbedtls(const char* data, size_t size, unsigned char* digest) {
+  mbedtls_sha256_context ctx;
+  mbedtls_sha256_init(&ctx);
+  mbedtls_sha256_starts(&ctx, 0);
+  mbedtls_sha256_update(&ctx, reinterpret_cast<const unsigned char*>(data), size);
+  mbedtls_sha256_finish(&ctx, digest);
+  mbedtls_sha256_free(&ctx);
+}
+
+#ifdef SIGNATURE_SHA256_X86
+bool cpu_has_shani() {
+#ifdef _MSC_VER
+  int regs[4] = {};
+  __cpuid(regs, 0);
+  if (regs[0] < 7) {
+    return false;
+  }
+  __cpuid(regs, 1);
+  const bool sse41 = (regs[2] & (1 << 19)) != 0;
+  __cpuidex(regs, 7, 0);
+  return sse41 && (regs[1] & (1 << 29)) != 0;
+#else
+  unsigned int eax = 0, ebx = 0, ecx = 0, edx = 0;
+  if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx) || !(ecx & (1u << 19))) {
+    return false;
+  }
+  if (!__get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx)) {
+    return false;
+  }
+  return (ebx & (1u << 29)) != 0;
+#endif
+}
+
+#ifdef SIGNATURE_SHA256_LANES_X86
+//! Returns bits of the extended features (cpuid leaf 7 ebx) and of the registers state enabled by
+//! the OS (xgetbv), zeros if the OS doesn't save the AVX state
+std::pair<uint32_t, uint64_t> cpu_avx_features() {
+#ifdef _MSC_VER
+  int regs[4] = {};
+  __cpuid(regs, 0);
+  if (regs[0] < 7) {
+    return {0, 0};
+  }
+  __cpuid(regs, 1);
+  if (!(regs[2] & (1 << 27))) {
+    return {0, 0};
+  }
+  const uint64_t xcr0 = _xgetbv(0);
+  __cpuidex(regs, 7, 0);
+  return {uint32_t(regs[1]), xcr0};
+#else
+  unsigned int eax = 0, ebx = 0, ecx = 0, edx = 0;
+  if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx) || !(ecx & (1u << 27))) {
+    return {0, 0};
+  }
+  uint32_t xcr0_low = 0, xcr0_high = 0;
+  __asm__("xgetbv" : "=a"(xcr0_low), "=d"(xcr0_high) : "c"(0));
+  if (!__get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx)) {
+    return {0, 0};
+  }
+  return {ebx, (uint64_t(xcr0_high) << 32) | xcr0_low};
+#endif
+}
+
+bool cpu_has_avx2() {
+  const auto [features, xcr0] = cpu_avx_features();
+  // XMM and YMM state
+  return (features & (1u << 5)) && (xcr0 & 0x6) == 0x6;
+}
+
+bool cpu_has_avx512f() {
+  const auto [features, xcr0] = cpu_avx_features();
+  // XMM, YMM, opmask and both halves of ZMM state
+  return (features & (1u << 16)) && (xcr0 & 0xE6) == 0xE6;
+}
+#endif
+//! Four rounds of the group G, message words of the group are kept in msg[G % 4], the schedule
+//! of the group G + 1 is finished with sha256msg2 and the group G + 3 is started with sha256msg1
+template <int G>
+SIGNATURE_TARGET_SHANI SIGNATURE_FORCE_INLINE void shani_rounds(__m128i& state0,
+                                                                __m128i& state1,
+                                                                __m128i* msg,
+                                                                const unsigned char* data) {
+  if constexpr (G < 4) {
+    const __m128i shuffle_mask = _mm_set_epi64x(0x0c0d0e0f08090a0bULL, 0x0405060700010203ULL);
+    msg[G] = _mm_shuffle_epi8(_mm_loadu_si128(reinterpret_cast<const __m128i*>(data + G * 16)),
+                              shuffle_mask);
+  }
+  __m128i words = _mm_add_epi32(
+      msg[G % 4], _mm_load_si128(reinterpret_cast<const __m128i*>(round_constants + G * 4)));
+  state1 = _mm_sha256rnds2_epu32(state1, state0, words);
+  if constexpr (G >= 3 && G <= 14) {
+    const __m128i tmp = _mm_alignr_epi8(msg[G % 4], msg[(G + 3) % 4], 4);
+    msg[(G + 1) % 4] = _mm_add_epi32(msg[(G + 1) % 4], tmp);
+    msg[(G + 1) % 4] = _mm_sha256msg2_epu32(msg[(G + 1) % 4], msg[G % 4]);
+  }
+  words = _mm_shuffle_epi32(words, 0x0E);
+  state0 = _mm_sha256rnds2_epu32(state0, state1, words);
+  if constexpr (G >= 1 && G <= 12) {
+    msg[(G + 3) % 4] = _mm_sha256msg1_epu32(msg[(G + 3) % 4], msg[G % 4]);
+  }
+}
+
+template <int... G>
+SIGNATURE_TARGET_SHANI SIGNATURE_FORCE_INLINE void shani_block(__m128i& state0,
+                                                               __m128i& state1,
+                                                               const unsigned char* data,
+                                                               std::integer_sequence<int, G...>) {
+  __m128i msg[4];
+  (shani_rounds<G>(state0, state1, msg, data), ...);
+}
+
+SIGNATURE_TARGET_SHANI void compress_shani(uint32_t* state,
+                                           const unsigned char* data,
+                                           size_t blocks_count) {
+  // State is kept as ABEF and CDGH
+  __m128i tmp = _mm_shuffle_epi32(_mm_loadu_si128(reinterpret_cast<const __m128i*>(state)), 0xB1);
+  __m128i state1 =
+      _mm_shuffle_epi32(_mm_loadu_si128(reinterpret_cast<const __m128i*>(state + 4)), 0x1B);
+  __m128i state0 = _mm_alignr_epi8(tmp, state1, 8);
+  state1 = _mm_blend_epi16(state1, tmp, 0xF0);
+
+  for (; blocks_count; blocks_count--, data += 64) {
+    const __m128i abef_save = state0;
+    const __m128i cdgh_save = state1;
+    shani_block(state0, state1, data, std::make_integer_sequence<int, 16>());
+    state0 = _mm_add_epi32(state0, abef_save);
+    state1 = _mm_add_epi32(state1, cdgh_save);
+  }
+
+  tmp = _mm_shuffle_epi32(state0, 0x1B);
+  state1 = _mm_shuffle_epi32(state1, 0xB1);
+  state0 = _mm_blend_epi16(tmp, state1, 0xF0);
+  state1 = _mm_alignr_epi8(state1, tmp, 8);
+  _mm_storeu_si128(reinterpret_cast<__m128i*>(state), state0);
+  _mm_storeu_si128(reinterpret_cast<__m128i*>(state + 4), state1);
+}
+#endif
+
+#ifdef SIGNATURE_SHA256_SSE2
+//! SSE2 is the baseline of x86-64, so the 4 lanes kernel needs no CPU check
+struct CLanesSse2 {
+  using T = __m128i;
+  static constexpr int lanes = 4;
+
+  static T add(T a, T b) { return _mm_add_epi32(a, b); }
+  static T xor3(T a, T b, T c) { return _mm_xor_si128(_mm_xor_si128(a, b), c); }
+  template <int N>
+  static T rotr(T x) {
+    return _mm_or_si128(_mm_srli_epi32(x, N), _mm_slli_epi32(x, 32 - N));
+  }
+  template <int N>
+  static T shr(T x) {
+    return _mm_srli_epi32(x, N);
+  }
+  static T choose(T e, T f, T g) {
+    return _mm_xor_si128(_mm_and_si128(e, f), _mm_andnot_si128(e, g));
+  }
+  static T majority(T a, T b, T c) {
+    return _mm_or_si128(_mm_and_si128(a, b), _mm_and_si128(c, _mm_or_si128(a, b)));
+  }
+  static T set1(uint32_t x) { return _mm_set1_epi32(static_cast<int>(x)); }
+  static T load(const uint32_t* p) { return _mm_load_si128(reinterpret_cast<const T*>(p)); }
+  static void store(uint32_t* p, T x) { _mm_store_si128(reinterpret_cast<T*>(p), x); }
+};
+
+void sha256_x4_sse2(const char* const* data, size_t size, unsigned char* const* digests) {
+  Sha256Lanes::CKernel<CLanesSse2>::hash(data, size, digests);
+}
+#endif
+
+#ifdef SIGNATURE_SHA256_ARMV8
+bool cpu_has_armv8_sha2() {
+#if defined(__linux__)
+  return (getauxval(AT_HWCAP) & HWCAP_SHA2) != 0;
+#elif defined(__APPLE__)
+  return true;
+#else
+  return false;
+#endif
+}
+//! Four rounds of the group G, message words of the group are kept in msg[G % 4] and replaced
+//! by the words of the group G + 4 after the rounds
+template <int G>
+SIGNATURE_FORCE_INLINE void armv8_rounds(uint32x4_t& state0, uint32x4_t& state1, uint32x4_t* msg) {
+  const uint32x4_t words = vaddq_u32(msg[G % 4], vld1q_u32(round_constants + G * 4));
+  const uint32x4_t state0_save = state0;
+  state0 = vsha256hq_u32(state0, state1, words);
+  state1 = vsha256h2q_u32(state1, state0_save, words);
+  if constexpr (G < 12) {
+    msg[G % 4] = vsha256su1q_u32(vsha256su0q_u32(msg[G % 4], msg[(G + 1) % 4]),
+                                 msg[(G + 2) % 4], msg[(G + 3) % 4]);
+  }
+}
+
+template <int... G>
+SIGNATURE_FORCE_INLINE void armv8_block(uint32x4_t& state0,
+                                        uint32x4_t& state1,
+                                        const unsigned char* data,
+                                        std::integer_sequence<int, G...>) {
+  uint32x4_t msg[4];
+  for (int i = 0; i < 4; i++) {
+    msg[i] = vreinterpretq_u32_u8(vrev32q_u8(vld1q_u8(data + i * 16)));
+  }
+  (armv8_rounds<G>(state0, state1, msg), ...);
+}
+
+void compress_armv8(uint32_t* state, const unsigned char* data, size_t blocks_count) {
+  uint32x4_t state0 = vld1q_u32(state);
+  uint32x4_t state1 = vld1q_u32(state + 4);
+
+  for (; blocks_count; blocks_count--, data += 64) {
+    const uint32x4_t abef_save = state0;
+    const uint32x4_t cdgh_save = state1;
+    armv8_block(state0, state1, data, std::make_integer_sequence<int, 16>());
+    state0 = vaddq_u32(state0, abef_save);
+    state1 = vaddq_u32(state1, cdgh_save);
+  }
+
+  vst1q_u32(state, state0);
+  vst1q_u32(state + 4, state1);
+}
+#endif
+
+//! Implementation of the backend, doesn't check the CPU
+CSha256Function get_backend_function(HashCalc::ESha256Backend backend) {
+  switch (backend) {
+#ifdef SIGNATURE_SHA256_X86
+    case HashCalc::ESha256Backend::shani:
+      return &sha256_padded<compress_shani>;
+#endif
+#ifdef SIGNATURE_SHA256_ARMV8
+    case HashCalc::ESha256Backend::armv8:
+      return &sha256_padded<compress_armv8>;
+#endif
+    default:
+      return &sha256_mbedtls;
+  }
+}
+
+//! Compression function of the backend, nullptr for mbedtls, doesn't check the CPU
+CCompressFunction get_compress_function(HashCalc::ESha256Backend backend) {
+  switch (backend) {
+#ifdef SIGNATURE_SHA256_X86
+    case HashCalc::ESha256Backend::shani:
+      return &compress_shani;
+#endif
+#ifdef SIGNATURE_SHA256_ARMV8
+    case HashCalc::ESha256Backend::armv8:
+      return &compress_armv8;
+#endif
+    default:
+      return nullptr;
+  }
+}
+
+//! Multi-buffer kernel of lanes messages, doesn't check the CPU
+CSha256LanesFunction get_lanes_function(uint32_t lanes) {
+  switch (lanes) {
+#ifdef SIGNATURE_SHA256_SSE2
+    case 4:
+      return &sha256_x4_sse2;
+#endif
+#ifdef SIGNATURE_SHA256_LANES_X86
+    case 8:
+      return &sha256_x8_avx2;
+    case 16:
+      return &sha256_x16_avx512;
+#endif
+    default:
+      return nullptr;
+  }
+}
+}  // namespace
+
+bool is_sha256_backend_supported(HashCalc::ESha256Backend backend) {
+  switch (backend) {
+    case HashCalc::ESha256Backend::automatic:
+    case HashCalc::ESha256Backend::mbedtls:
+      return true;
+    case HashCalc::ESha256Backend::shani:
+#ifdef SIGNATURE_SHA256_X86
+      return cpu_has_shani();
+#else
+      return false;
+#endif
+    case HashCalc::ESha256Backend::armv8:
+#ifdef SIGNATURE_SHA256_ARMV8
+      return cpu_has_armv8_sha2();
+#else
+      return false;
+#endif
+  }
+  return false;
+}
+
+HashCalc::ESha256Backend get_best_sha256_backend() {
+  static const auto best = [] {
+    for (auto backend : {HashCalc::ESha256Backend::shani, HashCalc::ESha256Backend::armv8}) {
+      if (is_sha256_backend_supported(backend) && sha256_self_test(backend)) {
+        return backend;
+      }
+    }
+    return HashCalc::ESha256Backend::mbedtls;
+  }();
+  return best;
+}
+
+CSha256Function get_sha256_function(HashCalc::ESha256Backend backend) {
+  if (backend == HashCalc::ESha256Backend::automatic) {
+    backend = get_best_sha256_backend();
+  }
+  if (!is_sha256_backend_supported(backend)) {
+    throw std::invalid_argument(std::string("SHA256 backend is not supported by the CPU ") +
+                                get_sha256_backend_name(backend));
+  }
+  return get_backend_function(backend);
+}
+
+const char* get_sha256_backend_name(HashCalc::ESha256Backend backend) {
+  switch (backend) {
+    case HashCalc::ESha256Backend::automatic:
+      return "auto";
+    case HashCalc::ESha256Backend::mbedtls:
+      return "mbedtls";
+    case HashCalc::ESha256Backend::shani:
+      return "shani";
+    case HashCalc::ESha256Backend::armv8:
+      return "armv8";
+  }
+  return "unknown";
+}
+
+bool sha256_self_test(HashCalc::ESha256Backend backend) {
+  if (!is_sha256_backend_supported(backend)) {
+    return false;
+  }
+  // Resolved directly, get_best_sha256_backend() relies on this test
+  const auto sha256 = get_backend_function(backend);
+  // Known answers: empty message and "abc"
+  const CDigest empty = {0xe3, 0xb0, 0xc4, 0x42, 0x98, 0xfc, 0x1c, 0x14, 0x9a, 0xfb, 0xf4,
+                         0xc8, 0x99, 0x6f, 0xb9, 0x24, 0x27, 0xae, 0x41, 0xe4, 0x64, 0x9b,
+                         0x93, 0x4c, 0xa4, 0x95, 0x99, 0x1b, 0x78, 0x52, 0xb8, 0x55};
+  const CDigest abc = {0xba, 0x78, 0x16, 0xbf, 0x8f, 0x01, 0xcf, 0xea, 0x41, 0x41, 0x40,
+                       0xde, 0x5d, 0xae, 0x22, 0x23, 0xb0, 0x03, 0x61, 0xa3, 0x96, 0x17,
+                       0x7a, 0x9c, 0xb4, 0x10, 0xff, 0x61, 0xf2, 0x00, 0x15, 0xad};
+  CDigest digest = {};
+  sha256("", 0, digest.data());
+  if (digest != empty) {
+    return false;
+  }
+  sha256("abc", 3, digest.data());
+  if (digest != abc) {
+    return false;
+  }
+  // Every padding case against mbedtls
+  std::vector<char> data(1024 + 64);
+  for (size_t i = 0; i < data.size(); i++) {
+    data[i] = static_cast<char>(i * 131 + 7);
+  }
+  CDigest expected = {};
+  for (size_t size = 0; size <= data.size(); size += size < 192 ? 1 : 61) {
+    sha256_mbedtls(data.data(), size, expected.data());
+    sha256(data.data(), size, digest.data());
+    if (digest != expected) {
+      return false;
+    }
+  }
+  return true;
+}
+
+CSha256Stream::CSha256Stream(HashCalc::ESha256Backend backend)
+    : m_compress(nullptr), m_state(), m_buffer(), m_buffered(0), m_size(0) {
+  if (backend == HashCalc::ESha256Backend::automatic) {
+    backend = get_best_sha256_backend();
+  }
+  if (!is_sha256_backend_supported(backend)) {
+    throw std::invalid_argument(std::string("SHA256 backend is not supported by the CPU ") +
+                                get_sha256_backend_name(backend));
+  }
+  m_compress = get_compress_function(backend);
+  std::memcpy(m_state, initial_state, sizeof(m_state));
+  mbedtls_sha256_init(&m_context);
+  mbedtls_sha256_starts(&m_context, 0);
+}
+
+CSha256Stream::~CSha256Stream() {
+  mbedtls_sha256_free(&m_context);
+}
+
+void CSha256Stream::update(const char* data, size_t size) {
+  const auto bytes = reinterpret_cast<const unsigned char*>(data);
+  m_size += size;
+  if (!m_compress) {
+    mbedtls_sha256_update(&m_context, bytes, size);
+    return;
+  }
+  const auto compress = m_compress;
+  if (m_buffered) {
+    const auto taken = std::min(size, sizeof(m_buffer) - m_buffered);
+    std::memcpy(m_buffer + m_buffered, bytes, taken);
+    m_buffered += taken;
+    if (m_buffered < sizeof(m_buffer)) {
+      return;
+    }
+    compress(m_state, m_buffer, 1);
+    m_buffered = 0;
+    data += taken;
+    size -= taken;
+  }
+  // Whole blocks are compressed straight from the data
+  const auto full_blocks = size / 64;
+  if (full_blocks) {
+    compress(m_state, reinterpret_cast<const unsigned char*>(data), full_blocks);
+  }
+  m_buffered = size % 64;
+  std::memcpy(m_buffer, data + full_blocks * 64, m_buffered);
+}
+
+CDigest CSha256Stream::finish() {
+  CDigest digest = {};
+  if (m_compress) {
+    finish_padded(m_compress, m_state, m_buffer, m_buffered, m_size, digest.data());
+  } else {
+    mbedtls_sha256_finish(&m_context, digest.data());
+  }
+  return digest;
+}
+
+bool is_sha256_lanes_supported(uint32_t lanes) {
+  if (!get_lanes_function(lanes)) {
+    return false;
+  }
+#ifdef SIGNATURE_SHA256_LANES_X86
+  if (lanes == 8) {
+    return cpu_has_avx2();
+  }
+  if (lanes == 16) {
+    return cpu_has_avx512f();
+  }
+#endif
+  return true;
+}
+
+uint32_t get_best_sha256_lanes() {
+  static const auto best = [] {
+    for (uint32_t lanes : {16u, 8u, 4u}) {
+      if (is_sha256_lanes_supported(lanes) && sha256_lanes_self_test(lanes)) {
+        return lanes;
+      }
+    }
+    return 0u;
+  }();
+  return best;
+}
+
+CSha256LanesFunction get_sha256_lanes_function(uint32_t lanes) {
+  if (!is_sha256_lanes_supported(lanes)) {
+    throw std::invalid_argument("Multi-buffer SHA256 is not supported for lanes count " +
+                                std::to_string(lanes));
+  }
+  return get_lanes_function(lanes);
+}
+
+bool sha256_lanes_self_test(uint32_t lanes) {
+  if (!is_sha256_lanes_supported(lanes)) {
+    return false;
+  }
+  const auto sha256_lanes = get_lanes_function(lanes);
+  // Every lane gets its own message, every padding case against mbedtls
+  const size_t max_size = 1024 + 64;
+  std::vector<char> data(max_size * lanes);
+  for (size_t i = 0; i < data.size(); i++) {
+    data[i] = static_cast<char>(i * 131 + 7);
+  }
+  std::vector<CDigest> digests(lanes);
+  std::vector<const char*> messages(lanes);
+  std::vector<unsigned char*> outputs(lanes);
+  for (uint32_t l = 0; l < lanes; l++) {
+    messages[l] = data.data() + l * max_size;
+    outputs[l] = digests[l].data();
+  }
+  CDigest expected = {};
+  for (size_t size = 0; size <= max_size; size += size < 192 ? 1 : 61) {
+    sha256_lanes(messages.data(), size, outputs.data());
+    for (uint32_t l = 0; l < lanes; l++) {
+      sha256_mbedtls(messages[l], size, expected.data());
+      if (digests[l] != expected) {
+        return false;
+      }
+    }
+  }
+  return true;
+}
@@ -0,0 +1,106 @@
+#ifndef SIGNATURE_SHA256_H
+#define SIGNATURE_SHA256_H
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+
+#include "mbedtls/crypto/include/mbedtls/sha256.h"
+
+//! Digest length for SHA256
+constexpr uint64_t sha256_digest_length = 32;
+//! Raw SHA256 digest
+using CDigest = std::array<unsigned char, sha256_digest_length>;
+
+namespace HashCalc {
+//! SHA256 implementation
+enum class ESha256Backend {
+  automatic,  //!< Fastest backend supported by the CPU
+  mbedtls,    //!< Portable mbedtls code
+  shani,      //!< x86 SHA extensions
+  armv8       //!< ARMv8 cryptography extensions
+};
+}  // namespace HashCalc
+
+//! Calculates SHA256 of the data into the 32 bytes digest
+using CSha256Function = void (*)(const char* data, size_t size, unsigned char* digest);
+
+//! Returns true if the backend is compiled in and the CPU supports it
+bool is_sha256_backend_supported(HashCalc::ESha256Backend backend);
+
+//! Returns the fastest supported backend which passed the self-test, detected once
+HashCalc::ESha256Backend get_best_sha256_backend();
+
+//! Returns the implementation, automatic means get_best_sha256_backend(). <br>
+//! Throws std::invalid_argument if the backend is not supported
+CSha256Function get_sha256_function(HashCalc::ESha256Backend backend);
+
+const char* get_sha256_backend_name(HashCalc::ESha256Backend backend);
+
+//! Checks the backend against known answers and the mbedtls implementation
+bool sha256_self_test(HashCalc::ESha256Backend backend);
+
+//! Incremental SHA256 of the data fed in pieces of any size, for inputs hashed as they are read
+class CSha256Stream {
+ public:
+  //! automatic means get_best_sha256_backend(). <br>
+  //! Throws std::invalid_argument if the backend is not supported
+  explicit CSha256Stream(
+      HashCalc::ESha256Backend backend = HashCalc::ESha256Backend::automatic);
+
+  ~CSha256Stream();
+
+  CSha256Stream(const CSha256Stream&) = delete;
+
+  CSha256Stream& operator=(CSha256Stream const&) = delete;
+
+  CSha256Stream(CSha256Stream&&) = delete;
+
+  CSha256Stream& operator=(CSha256Stream&&) = delete;
+
+  void update(const char* data, size_t size);
+
+  //! Digest of the data fed so far, the stream can't be updated after it
+  CDigest finish();
+
+ private:
+  //! Compression function of the accelerated backends, mbedtls keeps its own context
+  void (*m_compress)(uint32_t* state, const unsigned char* data, size_t blocks_count);
+  mbedtls_sha256_context m_context;
+  uint32_t m_state[8];
+  //! Bytes of the incomplete block
+  unsigned char m_buffer[64];
+  size_t m_buffered;
+  uint64_t m_size;
+};
+
+//! Widest multi-buffer kernel
+constexpr uint32_t sha256_max_lanes = 16;
+
+//! Calculates SHA256 of lanes messages of the same size at once, data and digests hold lanes
+//! pointers
+using CSha256LanesFunction = void (*)(const char* const* data,
+                                      size_t size,
+                                      unsigned char* const* digests);
+
+//! Returns true if the multi-buffer kernel of lanes messages (4 - SSE2, 8 - AVX2, 16 - AVX-512)
+//! is compiled in and the CPU supports it
+bool is_sha256_lanes_supported(uint32_t lanes);
+
+//! Returns the widest supported multi-buffer kernel which passed the self-test, 0 if there is none
+uint32_t get_best_sha256_lanes();
+
+//! Returns the multi-buffer kernel. <br>
+//! Throws std::invalid_argument if it is not supported
+CSha256LanesFunction get_sha256_lanes_function(uint32_t lanes);
+
+//! Checks every lane of the multi-buffer kernel against the mbedtls implementation
+bool sha256_lanes_self_test(uint32_t lanes);
+
+//! Calculates SHA256 using the best backend
+inline void calc_sha256(const char* ptr, const size_t block_size, unsigned char* digest) {
+  static const auto sha256 = get_sha256_function(HashCalc::ESha256Backend::automatic);
+  sha256(ptr, block_size, digest);
+}
+
+#endif  // SIGNATURE_SHA256_H
@@ -0,0 +1,38 @@
+//! 8 lanes SHA256 kernel, the file is compiled with AVX2 enabled and called only after the CPU
+//! check
+#include "sha256_lanes.h"
+
+#ifdef __AVX2__
+#include <immintrin.h>
+
+namespace {
+struct CLanesAvx2 {
+  using T = __m256i;
+  static constexpr int lanes = 8;
+
+  static T add(T a, T b) { return _mm256_add_epi32(a, b); }
+  static T xor3(T a, T b, T c) { return _mm256_xor_si256(_mm256_xor_si256(a, b), c); }
+  template <int N>
+  static T rotr(T x) {
+    return _mm256_or_si256(_mm256_srli_epi32(x, N), _mm256_slli_epi32(x, 32 - N));
+  }
+  template <int N>
+  static T shr(T x) {
+    return _mm256_srli_epi32(x, N);
+  }
+  static T choose(T e, T f, T g) {
+    return _mm256_xor_si256(_mm256_and_si256(e, f), _mm256_andnot_si256(e, g));
+  }
+  static T majority(T a, T b, T c) {
+    return _mm256_or_si256(_mm256_and_si256(a, b), _mm256_and_si256(c, _mm256_or_si256(a, b)));
+  }
+  static T set1(uint32_t x) { return _mm256_set1_epi32(static_cast<int>(x)); }
+  static T load(const uint32_t* p) { return _mm256_load_si256(reinterpret_cast<const T*>(p)); }
+  static void store(uint32_t* p, T x) { _mm256_store_si256(reinterpret_cast<T*>(p), x); }
+};
+}  // namespace
+
+void sha256_x8_avx2(const char* const* data, size_t size, unsigned char* const* digests) {
+  Sha256Lanes::CKernel<CLanesAvx2>::hash(data, size, digests);
+}
+#endif
@@ -0,0 +1,34 @@
+//! 16 lanes SHA256 kernel, the file is compiled with AVX-512F enabled and called only after the
+//! CPU check
+#include "sha256_lanes.h"
+
+#ifdef __AVX512F__
+#include <immintrin.h>
+
+namespace {
+struct CLanesAvx512 {
+  using T = __m512i;
+  static constexpr int lanes = 16;
+
+  static T add(T a, T b) { return _mm512_add_epi32(a, b); }
+  static T xor3(T a, T b, T c) { return _mm512_ternarylogic_epi32(a, b, c, 0x96); }
+  template <int N>
+  static T rotr(T x) {
+    return _mm512_ror_epi32(x, N);
+  }
+  template <int N>
+  static T shr(T x) {
+    return _mm512_srli_epi32(x, N);
+  }
+  static T choose(T e, T f, T g) { return _mm512_ternarylogic_epi32(e, f, g, 0xCA); }
+  static T majority(T a, T b, T c) { return _mm512_ternarylogic_epi32(a, b, c, 0xE8); }
+  static T set1(uint32_t x) { return _mm512_set1_epi32(static_cast<int>(x)); }
+  static T load(const uint32_t* p) { return _mm512_load_si512(p); }
+  static void store(uint32_t* p, T x) { _mm512_store_si512(p, x); }
+};
+}  // namespace
+
+void sha256_x16_avx512(const char* const* data, size_t size, unsigned char* const* digests) {
+  Sha256Lanes::CKernel<CLanesAvx512>::hash(data, size, digests);
+}
+#endif
@@ -0,0 +1,151 @@
+#ifndef SIGNATURE_SHA256_LANES_H
+#define SIGNATURE_SHA256_LANES_H
+
+//! Multi-buffer SHA256 kernel, hashes V::lanes messages of the same size at once, every SIMD lane
+//! holds one message. <br>
+//! Included only by the translation units compiled for the instruction set of V. Everything here
+//! has internal linkage and no standard library templates are used, so code built with wider
+//! instructions can't be picked by the linker for the rest of the program
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+#if defined(__GNUC__) || defined(__clang__)
+#define SHA256_LANES_UNROLL _Pragma("GCC unroll 64")
+#else
+#define SHA256_LANES_UNROLL
+#endif
+
+namespace Sha256Lanes {
+namespace {
+alignas(64) constexpr uint32_t round_constants[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2};
+
+constexpr uint32_t initial_state[8] = {0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+                                       0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19};
+
+inline uint32_t load_be32(const unsigned char* p) {
+  return (uint32_t(p[0]) << 24) | (uint32_t(p[1]) << 16) | (uint32_t(p[2]) << 8) | uint32_t(p[3]);
+}
+
+//! V provides the vector type T, lanes count and the operations on 32-bit lanes
+template <class V>
+class CKernel {
+  using T = typename V::T;
+  static constexpr int lanes = V::lanes;
+
+  static T big_sigma0(T x) {
+    return V::xor3(V::template rotr<2>(x), V::template rotr<13>(x), V::template rotr<22>(x));
+  }
+
+  static T big_sigma1(T x) {
+    return V::xor3(V::template rotr<6>(x), V::template rotr<11>(x), V::template rotr<25>(x));
+  }
+
+  static T small_sigma0(T x) {
+    return V::xor3(V::template rotr<7>(x), V::template rotr<18>(x), V::template shr<3>(x));
+  }
+
+  static T small_sigma1(T x) {
+    return V::xor3(V::template rotr<17>(x), V::template rotr<19>(x), V::template shr<10>(x));
+  }
+
+  //! Compresses one 64 bytes block of every lane
+  static void compress(T* state, const unsigned char* const* blocks) {
+    T w[16];
+    alignas(64) uint32_t words[lanes];
+    SHA256_LANES_UNROLL
+    for (int t = 0; t < 16; t++) {
+      for (int l = 0; l < lanes; l++) {
+        words[l] = load_be32(blocks[l] + t * 4);
+      }
+      w[t] = V::load(words);
+    }
+    T a = state[0], b = state[1], c = state[2], d = state[3];
+    T e = state[4], f = state[5], g = state[6], h = state[7];
+    SHA256_LANES_UNROLL
+    for (int t = 0; t < 64; t++) {
+      if (t >= 16) {
+        w[t % 16] = V::add(V::add(small_sigma1(w[(t - 2) % 16]), w[(t - 7) % 16]),
+                           V::add(small_sigma0(w[(t - 15) % 16]), w[t % 16]));
+      }
+      const T t1 = V::add(V::add(V::add(h, big_sigma1(e)), V::choose(e, f, g)),
+                          V::add(V::set1(round_constants[t]), w[t % 16]));
+      const T t2 = V::add(big_sigma0(a), V::majority(a, b, c));
+      h = g;
+      g = f;
+      f = e;
+      e = V::add(d, t1);
+      d = c;
+      c = b;
+      b = a;
+      a = V::add(t1, t2);
+    }
+    state[0] = V::add(state[0], a);
+    state[1] = V::add(state[1], b);
+    state[2] = V::add(state[2], c);
+    state[3] = V::add(state[3], d);
+    state[4] = V::add(state[4], e);
+    state[5] = V::add(state[5], f);
+    state[6] = V::add(state[6], g);
+    state[7] = V::add(state[7], h);
+  }
+
+ public:
+  //! data and digests hold lanes pointers, every message is size bytes long
+  static void hash(const char* const* data, size_t size, unsigned char* const* digests) {
+    T state[8];
+    for (int i = 0; i < 8; i++) {
+      state[i] = V::set1(initial_state[i]);
+    }
+    const unsigned char* blocks[lanes];
+    const auto full_blocks = size / 64;
+    for (size_t block = 0; block < full_blocks; block++) {
+      for (int l = 0; l < lanes; l++) {
+        blocks[l] = reinterpret_cast<const unsigned char*>(data[l]) + block * 64;
+      }
+      compress(state, blocks);
+    }
+    // Messages have the same size, so the padding takes the same number of blocks in every lane
+    unsigned char tails[lanes][128];
+    const auto rest = size % 64;
+    const size_t tail_size = rest < 56 ? 64 : 128;
+    const auto bits = uint64_t(size) * 8;
+    for (int l = 0; l < lanes; l++) {
+      std::memset(tails[l], 0, sizeof(tails[l]));
+      std::memcpy(tails[l], data[l] + full_blocks * 64, rest);
+      tails[l][rest] = 0x80;
+      for (size_t i = 0; i < 8; i++) {
+        tails[l][tail_size - 1 - i] = static_cast<unsigned char>(bits >> (8 * i));
+      }
+    }
+    for (size_t offset = 0; offset < tail_size; offset += 64) {
+      for (int l = 0; l < lanes; l++) {
+        blocks[l] = tails[l] + offset;
+      }
+      compress(state, blocks);
+    }
+    alignas(64) uint32_t words[lanes];
+    for (int i = 0; i < 8; i++) {
+      V::store(words, state[i]);
+      for (int l = 0; l < lanes; l++) {
+        digests[l][i * 4 + 0] = static_cast<unsigned char>(words[l] >> 24);
+        digests[l][i * 4 + 1] = static_cast<unsigned char>(words[l] >> 16);
+        digests[l][i * 4 + 2] = static_cast<unsigned char>(words[l] >> 8);
+        digests[l][i * 4 + 3] = static_cast<unsigned char>(words[l]);
+      }
+    }
+  }
+};
+}  // namespace
+}  // namespace Sha256Lanes
+
+#endif  // SIGNATURE_SHA256_LANES_H
@@ -0,0 +1,276 @@
+#ifndef SIGNATURE_FILE_H
+#define SIGNATURE_FILE_H
+
+#include <cstdint>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <iterator>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "hashes.h"
+#include "mapped_file.h"
+#include "utils.h"
+
+namespace HashCalc {
+//! Format of the signature file
+enum class EOutputFormat {
+  text,   //!< Line of lowercase hex digest per block, see text_signature_prefix()
+  binary  //!< CSignatureHeader and packed raw digests
+};
+}  // namespace HashCalc
+
+//! First line of the text signature: '#' and the name of the algorithm. SHA256 signatures have
+//! none, they stay plain lists of digests
+inline std::string text_signature_prefix(HashCalc::EAlgorithm algorithm) {
+  return algorithm == HashCalc::EAlgorithm::sha256
+             ? std::string()
+             : std::string("#") + get_algorithm_name(algorithm) + "\n";
+}
+
+//! Header of the binary signature, fields are stored little-endian. <br>
+//! Packed digests follow the header, the digest of block i starts at size + i * digest_length
+struct CSignatureHeader {
+  //! Serialized size, the digests start aligned
+  static constexpr uint64_t size = 64;
+  static constexpr char magic[8] = {'S', 'I', 'G', 'N', 'A', 'T', 'U', 'R'};
+  static constexpr uint32_t current_version = 1;
+
+  uint32_t version = current_version;
+  HashCalc::EAlgorithm algorithm = HashCalc::EAlgorithm::sha256;
+  uint32_t digest_length = uint32_t(sha256_digest_length);
+  uint64_t block_size = 0;
+  uint64_t input_size = 0;
+  uint64_t block_count = 0;
+
+  //! Writes size bytes: magic, version, algorithm, digest length, reserved 4 bytes, block size,
+  //! input size, block count, zeros up to size
+  void write(char* out) const {
+    std::memset(out, 0, size);
+    std::memcpy(out, magic, sizeof(magic));
+    store(out + 8, version, 4);
+    store(out + 12, uint32_t(algorithm), 4);
+    store(out + 16, digest_length, 4);
+    store(out + 24, block_size, 8);
+    store(out + 32, input_size, 8);
+    store(out + 40, block_count, 8);
+  }
+
+  //! Returns false if there is no magic, the header is truncated or the version is unknown
+  bool read(const char* in, uint64_t length) {
+    if (length < size || std::memcmp(in, magic, sizeof(magic)) != 0) {
+      return false;
+    }
+    version = uint32_t(load(in + 8, 4));
+    algorithm = HashCalc::EAlgorithm(load(in + 12, 4));
+    digest_length = uint32_t(load(in + 16, 4));
+    block_size = load(in + 24, 8);
+    input_size = load(in + 32, 8);
+    block_count = load(in + 40, 8);
+    return version == current_version;
+  }
+
+  //! Blocks of input_size bytes, block_size must not be 0. Doesn't overflow for the sizes of
+  //! crafted headers
+  static uint64_t blocks_of(uint64_t input_size, uint64_t block_size) {
+    return input_size / block_size + (input_size % block_size != 0);
+  }
+
+  //! Checks that the sizes agree with each other and with the file size
+  [[nodiscard]] bool is_consistent(uint64_t file_size) const {
+    return digest_length && digest_length == get_digest_length(algorithm) && block_size &&
+           block_count == blocks_of(input_size, block_size) &&
+           (file_size - size) / digest_length == block_count &&
+           (file_size - size) % digest_length == 0;
+  }
+
+ private:
+  static void store(char* out, uint64_t value, size_t bytes) {
+    for (size_t i = 0; i < bytes; i++) {
+      out[i] = static_cast<char>(value >> (8 * i));
+    }
+  }
+
+  static uint64_t load(const char* in, size_t bytes) {
+    uint64_t value = 0;
+    for (size_t i = 0; i < bytes; i++) {
+      value |= uint64_t(static_cast<unsigned char>(in[i])) << (8 * i);
+    }
+    return value;
+  }
+};
+
+//! Read-only view of a signature file of either format, block i is looked up in O(1). <br>
+//! The file is memory-mapped, it is read into memory only where mmap is not supported. Lines of
+//! the text format have the fixed length, so the text is addressed by index as well
+class CSignatureFile {
+ public:
+  CSignatureFile()
+      : m_data(nullptr), m_size(0), m_format(HashCalc::EOutputFormat::text), m_text_offset(0) {}
+
+  CSignatureFile(const CSignatureFile&) = delete;
+
+  CSignatureFile& operator=(CSignatureFile const&) = delete;
+
+  CSignatureFile(CSignatureFile&&) = delete;
+
+  CSignatureFile& operator=(CSignatureFile&&) = delete;
+
+  //! Detects the format by the magic, throws std::runtime_error if the file can't be read or
+  //! it is not a signature
+  void open(const std::string& path) {
+    m_contents.clear();
+    if (m_file.open(path)) {
+      m_data = m_file.data();
+      m_size = m_file.size();
+    } else {
+      std::ifstream in(path, std::ios::binary);
+      if (!in.is_open()) {
+        throw std::runtime_error("Fatal error, couldn't open signature file " + path);
+      }
+      m_contents.assign(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>());
+      m_data = m_contents.data();
+      m_size = m_contents.size();
+    }
+    m_header = CSignatureHeader();
+    m_text_offset = 0;
+    if (m_header.read(m_data, m_size)) {
+      m_format = HashCalc::EOutputFormat::binary;
+      if (!m_header.is_consistent(m_size)) {
+        throw std::runtime_error("Fatal error, corrupted signature file " + path);
+      }
+    } else if (m_size >= CSignatureHeader::size &&
+               std::memcmp(m_data, CSignatureHeader::magic, sizeof(CSignatureHeader::magic)) ==
+                   0) {
+      throw std::runtime_error("Fatal error, unsupported signature version " + path);
+    } else {
+      // The text format keeps neither the block size nor the input size
+      m_format = HashCalc::EOutputFormat::text;
+      if (m_size && m_data[0] == '#') {
+        const auto end = static_cast<const char*>(std::memchr(m_data, '\n', m_size));
+        if (!end || !parse_algorithm(std::string(m_data + 1, end), m_header.algorithm)) {
+          throw std::runtime_error("Fatal error, unsupported signature algorithm " + path);
+        }
+        m_text_offset = uint64_t(end - m_data) + 1;
+      }
+      m_header.digest_length = uint32_t(get_digest_length(m_header.algorithm));
+      if ((m_size - m_text_offset) % text_line_length() != 0) {
+        throw std::runtime_error("Fatal error, signature file is not valid " + path);
+      }
+      m_header.block_count = (m_size - m_text_offset) / text_line_length();
+    }
+  }
+
+  void close() {
+    m_file.close();
+    m_contents.clear();
+    m_data = nullptr;
+    m_size = 0;
+    m_text_offset = 0;
+    m_header = CSignatureHeader();
+  }
+
+  [[nodiscard]] HashCalc::EOutputFormat format() const { return m_format; }
+
+  //! Block size and input size are zero for the text format, the algorithm is known for both
+  [[nodiscard]] const CSignatureHeader& header() const { return m_header; }
+
+  [[nodiscard]] uint64_t block_count() const { return m_header.block_count; }
+
+  //! Digest of the block, shorter digests are padded with zeros. <br>
+  //! Throws std::runtime_error if the text line is malformed
+  [[nodiscard]] CDigest digest(uint64_t index) const {
+    CDigest digest = {};
+    const uint64_t digest_length = m_header.digest_length;
+    if (m_format == HashCalc::EOutputFormat::binary) {
+      std::memcpy(digest.data(), m_data + CSignatureHeader::size + index * digest_length,
+                  digest_length);
+      return digest;
+    }
+    const auto line_length = text_line_length();
+    const auto line = m_data + m_text_offset + index * line_length;
+    if (line[line_length - 1] != '\n' || !hex_to_digest(line, digest, digest_length)) {
+      throw std::runtime_error("Fatal error, malformed signature line " +
+                               std::to_string(index + 1));
+    }
+    return digest;
+  }
+
+ private:
+  [[nodiscard]] uint64_t text_line_length() const { return m_header.digest_length * 2 + 1; }
+
+  CMappedFile m_file;
+  std::vector<char> m_contents;
+  const char* m_data;
+  uint64_t m_size;
+  HashCalc::EOutputFormat m_format;
+  //! Digests of the text format start after the algorithm line
+  uint64_t m_text_offset;
+  CSignatureHeader m_header;
+};
+
+//! Converts the signature into the format, block_size and input_size are needed only to convert
+//! the text format into the binary one. <br>
+//! Throws std::runtime_error on read and write errors and std::invalid_argument if the sizes
+//! don't match the number of blocks
+inline void convert_signature(const std::string& in_path,
+                              const std::string& out_path,
+                              HashCalc::EOutputFormat format,
+                              uint64_t block_size = 0,
+                              uint64_t input_size = 0) {
+  std::error_code ec;
+  if (std::filesystem::equivalent(in_path, out_path, ec)) {
+    throw std::invalid_argument("Output file is the input file " + out_path);
+  }
+  CSignatureFile in;
+  in.open(in_path);
+  auto header = in.header();
+  if (format == HashCalc::EOutputFormat::binary && in.format() == HashCalc::EOutputFormat::text) {
+    header.block_size = block_size;
+    header.input_size = input_size;
+    if (!block_size || CSignatureHeader::blocks_of(input_size, block_size) != header.block_count) {
+      throw std::invalid_argument("Block size and input size don't match " +
+                                  std::to_string(header.block_count) + " blocks of " + in_path);
+    }
+  }
+  std::ofstream out(out_path, std::ios::binary | std::ios::trunc);
+  if (!out.is_open()) {
+    throw std::runtime_error("Fatal error, couldn't open output file " + out_path);
+  }
+  const auto binary = format == HashCalc::EOutputFormat::binary;
+  const uint64_t digest_length = header.digest_length;
+  const auto line_length = binary ? digest_length : digest_length * 2 + 1;
+  std::vector<char> chunk(std::max(uint64_t(CSignatureHeader::size), 1024 * line_length));
+  if (binary) {
+    header.write(chunk.data());
+    out.write(chunk.data(), CSignatureHeader::size);
+  } else {
+    out << text_signature_prefix(header.algorithm);
+  }
+  // The chunk holds the header or a batch of lines, reserve() may give more capacity
+  const size_t batch = chunk.size() / line_length;
+  std::vector<CDigest> digests;
+  digests.reserve(batch);
+  for (uint64_t i = 0; i < header.block_count;) {
+    digests.clear();
+    for (; i < header.block_count && digests.size() < batch; i++) {
+      digests.push_back(in.digest(i));
+    }
+    if (binary) {
+      for (size_t j = 0; j < digests.size(); j++) {
+        std::memcpy(chunk.data() + j * digest_length, digests[j].data(), digest_length);
+      }
+    } else {
+      digests_to_hex_lines(digests.data(), digests.size(), chunk.data(), digest_length);
+    }
+    out.write(chunk.data(), std::streamsize(digests.size() * line_length));
+  }
+  out.flush();
+  if (!out) {
+    throw std::runtime_error("Fatal error, couldn't write output file " + out_path);
+  }
+}
+
+#endif  // SIGNATURE_FILE_H
@@ -3,6 +3,12 @@
 #include <climits>
 #include <iostream>
 
+#ifndef _WIN32
+#include <sys/stat.h>
+#endif
+
+#include "batch_calc.h"
+#include "chunking.h"
 #include "hashcalc.h"
 #include "utils.h"
 
@@ -247,6 +253,1022 @@ TEST(HashCalc, 100mbOfSeparateBlocks3mb) {
             "30e14955ebf1352266dc2ff8067e68104607e750abb9d3b36582b8af909fcb58\n");
 }
 
+TEST(HashCalc, 100mbBuffersCountDoesNotChangeResult) {
+  std::string expected;
+  for (uint32_t buffers_count : {1u, 2u, 5u}) {
+    HashCalc::COptions options;
+    options.buffers_count = buffers_count;
+    CHashCalc calc("test_files//100mb_00.bin", "out15.result", 1000003, options);
+    calc.run();
+    const auto str = get_str("out15.result");
+    if (expected.empty()) {
+      expected = str;
+      EXPECT_EQ(str.size(), 105 * (sha256_digest_length * 2 + 1));
+    }
+    EXPECT_EQ(str, expected) << "buffers_count " << buffers_count;
+  }
+}
+
+TEST(HashCalc, ReadEnginesProduceSameResult) {
+  std::string expected;
+  for (auto engine : {HashCalc::EReadEngine::stream, HashCalc::EReadEngine::mmap,
+                      HashCalc::EReadEngine::automatic}) {
+    HashCalc::COptions options;
+    options.read_engine = engine;
+    CHashCalc calc("test_files//alphabet.txt", "out16.result", 5, options);
+    EXPECT_NE(calc.get_read_engine(), HashCalc::EReadEngine::automatic);
+    calc.run();
+    const auto str = get_str("out16.result");
+    if (expected.empty()) {
+      expected = str;
+    }
+    EXPECT_EQ(str, expected);
+  }
+  EXPECT_EQ(expected.size(), 11 * (sha256_digest_length * 2 + 1));
+}
+
+TEST(AsyncReader, UringAndPreadReadTheSameData) {
+  const auto expected = get_str("test_files//alphabet.txt");
+  for (auto uring : {true, false}) {
+    CAsyncReader reader;
+    ASSERT_TRUE(reader.open("test_files//alphabet.txt", 2, false, uring));
+    std::string first(10, '\0');
+    std::string second(100, '\0');
+    reader.submit(1, first.data(), 0, first.size());
+    reader.submit(2, second.data(), 10, second.size());
+    for (auto i = 0; i < 2; i++) {
+      const auto [tag, result] = reader.wait();
+      EXPECT_EQ(result, int64_t(tag == 1 ? 10 : expected.size() - 10));
+    }
+    EXPECT_EQ(first + second.substr(0, expected.size() - 10), expected);
+  }
+}
+
+TEST(HashCalc, AsyncEngineProducesSameResult) {
+  for (auto direct : {false, true}) {
+    HashCalc::COptions options;
+    options.read_engine = HashCalc::EReadEngine::async;
+    options.direct_io = direct;
+    options.buffers_count = 3;
+    options.buffer_size = 3 * 1024 * 1024;
+    CHashCalc calc("test_files//100mb_00.bin", "out31.result", 4096, options);
+    calc.run();
+    EXPECT_EQ(calc.get_read_engine(), HashCalc::EReadEngine::async);
+    EXPECT_EQ(get_str("out31.result"),
+              repeat("ad7facb2586fc6e966c004d7d1d16b024f5805ff7cb47c7a85dabd8b48892ca7\n",
+                     25600));
+  }
+  HashCalc::COptions options;
+  options.read_engine = HashCalc::EReadEngine::async;
+  CHashCalc calc("test_files//alphabet.txt", "out31.result", 5, options);
+  calc.run();
+  CHashCalc expected("test_files//alphabet.txt", "out31.expected", 5);
+  expected.run();
+  EXPECT_EQ(get_str("out31.result"), get_str("out31.expected"));
+}
+
+TEST(HashCalc, PreadEngineProducesSameResult) {
+  HashCalc::COptions options;
+  options.merkle = true;
+  options.buffer_size = 1024 * 1024;
+  CHashCalc expected("test_files//100mb_00.bin", "out32.expected", 4096, options);
+  expected.run();
+  for (uint32_t io_threads : {1u, 3u, 200u}) {
+    options.read_engine = HashCalc::EReadEngine::pread;
+    options.io_threads = io_threads;
+    CHashCalc calc("test_files//100mb_00.bin", "out32.result", 4096, options);
+    calc.run();
+    EXPECT_EQ(get_str("out32.result"), get_str("out32.expected")) << "io_threads " << io_threads;
+    EXPECT_EQ(calc.get_merkle_root(), expected.get_merkle_root());
+  }
+}
+
+#ifndef _WIN32
+TEST(HashCalc, StreamsFromPipe) {
+  // The size of a pipe is unknown, the binary header and the file digest get it at the end
+  const auto sign_pipe = [](const std::string& input, const std::string& output,
+                            const HashCalc::COptions& options) {
+    std::remove("out33.fifo");
+    ASSERT_EQ(mkfifo("out33.fifo", 0600), 0);
+    std::thread feeder([&input] {
+      std::ofstream pipe("out33.fifo", std::ios::binary);
+      std::ifstream in(input, std::ios::binary);
+      pipe << in.rdbuf();
+    });
+    CHashCalc calc("out33.fifo", output, 4096, options);
+    calc.run();
+    feeder.join();
+  };
+  HashCalc::COptions options;
+  options.output_format = HashCalc::EOutputFormat::binary;
+  options.buffer_size = 1024 * 1024;
+  sign_pipe("test_files//100mb_00.bin", "out33.result", options);
+  CHashCalc expected("test_files//100mb_00.bin", "out33.expected", 4096, options);
+  expected.run();
+  EXPECT_EQ(get_str("out33.result"), get_str("out33.expected"));
+  options = {};
+  options.file_digest = HashCalc::EFileDigest::tree;
+  sign_pipe("test_files//alphabet.txt", "out33.result", options);
+  CHashCalc expected_digest("test_files//alphabet.txt", "out33.expected", 4096, options);
+  expected_digest.run();
+  EXPECT_EQ(get_str("out33.result"), get_str("out33.expected"));
+}
+#endif
+
+TEST(HashCalc, 100mbDigestsRingWrapsAround) {
+  CHashCalc calc("test_files//100mb_00.bin", "out17.result", 4096);
+  calc.run();
+  const auto str = get_str("out17.result");
+  EXPECT_EQ(str, repeat("ad7facb2586fc6e966c004d7d1d16b024f5805ff7cb47c7a85dabd8b48892ca7\n",
+                        25600));
+}
+
+TEST(HashCalc, OutputIsInput) {
+  try {
+    CHashCalc calc("test_files//numbers.txt", "test_files//numbers.txt", 1);
+    calc.run();
+  } catch (const std::invalid_argument&) {
+    EXPECT_EQ(get_str("test_files//numbers.txt"), "0123456789");
+    return;
+  }
+  FAIL() << "Expected invalid argument";
+}
+
+TEST(Sha256, BackendsSelfTest) {
+  EXPECT_TRUE(sha256_self_test(HashCalc::ESha256Backend::mbedtls));
+  for (auto backend : {HashCalc::ESha256Backend::shani, HashCalc::ESha256Backend::armv8}) {
+    if (is_sha256_backend_supported(backend)) {
+      EXPECT_TRUE(sha256_self_test(backend)) << get_sha256_backend_name(backend);
+    } else {
+      EXPECT_THROW(get_sha256_function(backend), std::invalid_argument);
+    }
+  }
+  EXPECT_NE(get_best_sha256_backend(), HashCalc::ESha256Backend::automatic);
+}
+
+TEST(Sha256, BackendsMatchTestVectors) {
+  const std::vector<std::pair<std::string, uint64_t>> inputs = {
+      {"test_files//3chars.txt", 3},   {"test_files//numbers.txt", 1},
+      {"test_files//alphabet.txt", 1}, {"test_files//256a.txt", 1},
+      {"test_files//1024a.txt", 1024}, {"test_files//1mb_00.bin", 1000}};
+  for (const auto& [path, block_size] : inputs) {
+    std::string expected;
+    for (auto backend : {HashCalc::ESha256Backend::mbedtls, HashCalc::ESha256Backend::shani,
+                         HashCalc::ESha256Backend::armv8}) {
+      if (!is_sha256_backend_supported(backend)) {
+        continue;
+      }
+      HashCalc::COptions options;
+      options.sha256_backend = backend;
+      CHashCalc calc(path, "out18.result", block_size, options);
+      EXPECT_EQ(calc.get_sha256_backend(), backend);
+      calc.run();
+      const auto str = get_str("out18.result");
+      if (expected.empty()) {
+        expected = str;
+      }
+      EXPECT_EQ(str, expected) << path << " " << get_sha256_backend_name(backend);
+    }
+  }
+  EXPECT_EQ(get_str("out18.result").size(), 1049 * (sha256_digest_length * 2 + 1));
+}
+
+TEST(Sha256, LanesSelfTest) {
+  for (uint32_t lanes : {4u, 8u, 16u}) {
+    if (is_sha256_lanes_supported(lanes)) {
+      EXPECT_TRUE(sha256_lanes_self_test(lanes)) << lanes;
+    } else {
+      EXPECT_THROW(get_sha256_lanes_function(lanes), std::invalid_argument);
+    }
+  }
+  EXPECT_THROW(get_sha256_lanes_function(3), std::invalid_argument);
+}
+
+TEST(Sha256, StreamMatchesOneShot) {
+  std::vector<char> data(100000);
+  for (size_t i = 0; i < data.size(); i++) {
+    data[i] = static_cast<char>(i * 131 + 7);
+  }
+  for (auto backend : {HashCalc::ESha256Backend::mbedtls, HashCalc::ESha256Backend::shani,
+                       HashCalc::ESha256Backend::armv8}) {
+    if (!is_sha256_backend_supported(backend)) {
+      continue;
+    }
+    CDigest expected = {};
+    get_sha256_function(backend)(data.data(), data.size(), expected.data());
+    CSha256Stream stream(backend);
+    // Pieces around the block boundaries
+    size_t offset = 0;
+    for (size_t piece = 0; offset < data.size(); piece = (piece + 1) % 130) {
+      const auto size = std::min(piece, data.size() - offset);
+      stream.update(data.data() + offset, size);
+      offset += size;
+    }
+    EXPECT_EQ(stream.finish(), expected) << get_sha256_backend_name(backend);
+  }
+}
+
+TEST(Hashes, MatchTestVectors) {
+  for (auto algorithm : {HashCalc::EAlgorithm::sha256, HashCalc::EAlgorithm::sha512_256,
+                         HashCalc::EAlgorithm::blake3, HashCalc::EAlgorithm::xxh3_128}) {
+    EXPECT_TRUE(algorithm_self_test(algorithm)) << get_algorithm_name(algorithm);
+    HashCalc::EAlgorithm parsed = HashCalc::EAlgorithm::sha256;
+    EXPECT_TRUE(parse_algorithm(get_algorithm_name(algorithm), parsed));
+    EXPECT_EQ(parsed, algorithm);
+  }
+  HashCalc::EAlgorithm parsed = HashCalc::EAlgorithm::sha256;
+  EXPECT_FALSE(parse_algorithm("md5", parsed));
+  EXPECT_EQ(get_digest_length(HashCalc::EAlgorithm(7)), 0u);
+  // Official BLAKE3 vectors over i % 251, the 4 chunks kernel takes the inputs above 4096 bytes
+  const std::vector<std::pair<size_t, std::string>> blake3_vectors = {
+      {0, "af1349b9f5f9a1a6a0404dea36dcc9499bcb25c9adc112b7cc9a93cae41f3262"},
+      {1024, "42214739f095a406f3fc83deb889744ac00df831c10daa55189b5d121c855af7"},
+      {1025, "d00278ae47eb27b34faecf67b4fe263f82d5412916c1ffd97c8cb7fb814b8444"},
+      {2049, "5f4d72f40d7a5f82b15ca2b2e44b1de3c2ef86c426c95c1af0b6879522563030"},
+      {4097, "9b4052b38f1c5fc8b1f9ff7ac7b27cd242487b3d890d15c96a1c25b8aa0fb995"},
+      {8193, "bab6c09cb8ce8cf459261398d2e7aef35700bf488116ceb94a36d0f5f1b7bc3b"},
+      {102400, "bc3e3d41a1146b069abffad3c0d44860cf664390afce4d9661f7902e7943e085"}};
+  std::vector<char> data(102400);
+  for (size_t i = 0; i < data.size(); i++) {
+    data[i] = static_cast<char>(i % 251);
+  }
+  for (const auto& [size, hex] : blake3_vectors) {
+    CDigest digest = {};
+    CBlake3::hash(data.data(), size, digest.data());
+    EXPECT_EQ(digest_to_hex(digest), hex) << size;
+  }
+  CDigest digest = {};
+  CSha512_256::hash("abc", 3, digest.data());
+  EXPECT_EQ(digest_to_hex(digest),
+            "53048e2681941ef99b2e29b76b4c7dabe4c2d0c634fc6d46e0e2f13107e7af23");
+  CXxh3_128::hash("", 0, digest.data());
+  EXPECT_EQ(digest_to_hex(digest, CXxh3_128::digest_length), "99aa06d3014798d86001c324468d497f");
+}
+
+TEST(HashCalc, AlgorithmsAreRecordedInSignatures) {
+  for (auto algorithm : {HashCalc::EAlgorithm::sha512_256, HashCalc::EAlgorithm::blake3,
+                         HashCalc::EAlgorithm::xxh3_128}) {
+    const std::string name = get_algorithm_name(algorithm);
+    const auto digest_length = get_digest_length(algorithm);
+    HashCalc::COptions options;
+    options.algorithm = algorithm;
+    // Several windows of 4KB blocks
+    options.buffer_size = 64 * 1024;
+    CHashCalc text_calc("test_files//1mb_00.bin", "out34.result", 4096, options);
+    text_calc.run();
+    const auto text = get_str("out34.result");
+    const auto prefix = "#" + name + "\n";
+    ASSERT_EQ(text.substr(0, prefix.size()), prefix);
+    EXPECT_EQ(text.size(), prefix.size() + 256 * (digest_length * 2 + 1)) << name;
+    options.output_format = HashCalc::EOutputFormat::binary;
+    CHashCalc binary_calc("test_files//1mb_00.bin", "out34.sig", 4096, options);
+    binary_calc.run();
+    EXPECT_EQ(fs::file_size("out34.sig"), CSignatureHeader::size + 256 * digest_length) << name;
+    CSignatureFile text_signature;
+    text_signature.open("out34.result");
+    CSignatureFile binary_signature;
+    binary_signature.open("out34.sig");
+    EXPECT_EQ(text_signature.header().algorithm, algorithm);
+    EXPECT_EQ(binary_signature.header().algorithm, algorithm);
+    EXPECT_EQ(binary_signature.header().digest_length, digest_length);
+    ASSERT_EQ(text_signature.block_count(), 256u);
+    ASSERT_EQ(binary_signature.block_count(), 256u);
+    const std::vector<char> zeros(4096, 0);
+    CDigest expected = {};
+    if (algorithm == HashCalc::EAlgorithm::sha512_256) {
+      CSha512_256::hash(zeros.data(), zeros.size(), expected.data());
+    } else if (algorithm == HashCalc::EAlgorithm::blake3) {
+      CBlake3::hash(zeros.data(), zeros.size(), expected.data());
+    } else {
+      CXxh3_128::hash(zeros.data(), zeros.size(), expected.data());
+    }
+    for (uint64_t i = 0; i < 256; i++) {
+      ASSERT_EQ(text_signature.digest(i), expected) << name << " " << i;
+      ASSERT_EQ(binary_signature.digest(i), expected) << name << " " << i;
+    }
+    // The text signature converts to the binary one, the algorithm goes along
+    convert_signature("out34.result", "out34.bin", HashCalc::EOutputFormat::binary, 4096,
+                      fs::file_size("test_files//1mb_00.bin"));
+    EXPECT_EQ(get_str("out34.bin"), get_str("out34.sig")) << name;
+    convert_signature("out34.sig", "out34.txt", HashCalc::EOutputFormat::text);
+    EXPECT_EQ(get_str("out34.txt"), text) << name;
+    // Verification takes the algorithm of the signature only
+    HashCalc::COptions verify_options;
+    verify_options.algorithm = algorithm;
+    verify_options.verify_path = "out34.sig";
+    CHashCalc verify_calc("test_files//1mb_00.bin", "out34.report", 4096, verify_options);
+    verify_calc.run();
+    EXPECT_EQ(verify_calc.get_mismatched_blocks(), 0u) << name;
+    verify_options.algorithm = HashCalc::EAlgorithm::sha256;
+    EXPECT_THROW(CHashCalc("test_files//1mb_00.bin", "out34.report", 4096, verify_options),
+                 std::invalid_argument);
+    HashCalc::COptions merkle_options;
+    merkle_options.algorithm = algorithm;
+    merkle_options.merkle = true;
+    EXPECT_THROW(CHashCalc("test_files//1mb_00.bin", "out34.report", 4096, merkle_options),
+                 std::invalid_argument);
+  }
+  // SHA256 signatures have no algorithm line
+  CHashCalc calc("test_files//1mb_00.bin", "out34.result", 4096);
+  calc.run();
+  EXPECT_EQ(get_str("out34.result").size(), 256 * hex_line_length);
+}
+
+TEST(HashCalc, LanesProduceSameResult) {
+  // Short last blocks and the blocks left after the groups go through the single-buffer backend
+  const std::vector<std::pair<std::string, uint64_t>> inputs = {
+      {"test_files//alphabet.txt", 1},
+      {"test_files//3chars.txt", 1},
+      {"test_files//1mb_00.bin", 1000}};
+  for (const auto& [path, block_size] : inputs) {
+    std::string expected;
+    for (uint32_t lanes : {1u, 4u, 8u, 16u}) {
+      if (lanes > 1 && !is_sha256_lanes_supported(lanes)) {
+        continue;
+      }
+      HashCalc::COptions options;
+      options.sha256_lanes = lanes;
+      CHashCalc calc(path, "out19.result", block_size, options);
+      EXPECT_EQ(calc.get_sha256_lanes(), lanes);
+      calc.run();
+      const auto str = get_str("out19.result");
+      if (expected.empty()) {
+        expected = str;
+      }
+      EXPECT_EQ(str, expected) << path << " " << lanes;
+    }
+  }
+  EXPECT_EQ(get_str("out19.result").size(), 1049 * (sha256_digest_length * 2 + 1));
+}
+
+TEST(SignatureFile, BinaryFormatMatchesText) {
+  CHashCalc text_calc("test_files//alphabet.txt", "out20.result", 3);
+  text_calc.run();
+  HashCalc::COptions options;
+  options.output_format = HashCalc::EOutputFormat::binary;
+  CHashCalc binary_calc("test_files//alphabet.txt", "out20.sig", 3, options);
+  binary_calc.run();
+  EXPECT_EQ(fs::file_size("out20.sig"), CSignatureHeader::size + 18 * sha256_digest_length);
+  CSignatureFile text;
+  text.open("out20.result");
+  CSignatureFile binary;
+  binary.open("out20.sig");
+  EXPECT_EQ(text.format(), HashCalc::EOutputFormat::text);
+  ASSERT_EQ(binary.format(), HashCalc::EOutputFormat::binary);
+  EXPECT_EQ(binary.header().block_size, 3u);
+  EXPECT_EQ(binary.header().input_size, 52u);
+  ASSERT_EQ(binary.block_count(), 18u);
+  ASSERT_EQ(text.block_count(), 18u);
+  for (uint64_t i = 0; i < 18; i++) {
+    EXPECT_EQ(binary.digest(i), text.digest(i)) << i;
+  }
+  // The last block is "Z"
+  EXPECT_EQ(digest_to_hex(binary.digest(17)),
+            "bbeebd879e1dff6918546dc0c179fdde505f2a21591c9a9c96e36b054ec5af83");
+}
+
+TEST(SignatureFile, ConvertRoundTrip) {
+  CHashCalc calc("test_files//1mb_00.bin", "out21.result", 1000);
+  calc.run();
+  EXPECT_THROW(convert_signature("out21.result", "out21.sig", HashCalc::EOutputFormat::binary,
+                                 1000, 1000),
+               std::invalid_argument);
+  convert_signature("out21.result", "out21.sig", HashCalc::EOutputFormat::binary, 1000,
+                    fs::file_size("test_files//1mb_00.bin"));
+  convert_signature("out21.sig", "out21.txt", HashCalc::EOutputFormat::text);
+  EXPECT_EQ(get_str("out21.txt"), get_str("out21.result"));
+  CSignatureFile binary;
+  binary.open("out21.sig");
+  EXPECT_EQ(binary.block_count(), 1049u);
+  EXPECT_EQ(fs::file_size("out21.sig") * 2 - CSignatureHeader::size * 2,
+            fs::file_size("out21.result") - 1049);
+  // A crafted input size whose rounding up would wrap around to no blocks
+  CSignatureHeader crafted;
+  crafted.block_size = 4096;
+  crafted.input_size = UINT64_MAX - 10;
+  EXPECT_FALSE(crafted.is_consistent(CSignatureHeader::size));
+  crafted.block_count = UINT64_MAX / 4096 + 1;
+  EXPECT_EQ(CSignatureHeader::blocks_of(crafted.input_size, 4096), crafted.block_count);
+}
+
+TEST(HashCalc, VerifyReportsMismatchingRanges) {
+  CHashCalc sign("test_files//1mb_00.bin", "out22.result", 1000);
+  sign.run();
+  auto data = get_str("test_files//1mb_00.bin");
+  const auto verify = [](const std::string& path, bool first_mismatch) {
+    HashCalc::COptions options;
+    options.verify_path = "out22.result";
+    options.first_mismatch = first_mismatch;
+    CHashCalc calc(path, "out22.report", 1000, options);
+    calc.run();
+    return calc.get_mismatched_blocks();
+  };
+  EXPECT_EQ(verify("test_files//1mb_00.bin", false), 0u);
+  EXPECT_EQ(get_str("out22.report"), "");
+  for (auto offset : {5000, 6999, 7500, 100123}) {
+    data[offset] = 'x';
+  }
+  std::ofstream("out22.bin", std::ios::binary) << data;
+  EXPECT_EQ(verify("out22.bin", false), 4u);
+  EXPECT_EQ(get_str("out22.report"), "5-7\n100\n");
+  EXPECT_EQ(verify("out22.bin", true), 1u);
+  EXPECT_EQ(get_str("out22.report"), "5\n");
+  // The short last block differs, the rest of the blocks is missing
+  std::ofstream("out22.bin", std::ios::binary | std::ios::trunc) << data.substr(0, 10001);
+  EXPECT_EQ(verify("out22.bin", false), 1042u);
+  EXPECT_EQ(get_str("out22.report"), "5-7\n10-1048\n");
+  // Binary signatures keep the block size
+  HashCalc::COptions options;
+  options.output_format = HashCalc::EOutputFormat::binary;
+  CHashCalc binary("test_files//1mb_00.bin", "out22.sig", 1000, options);
+  binary.run();
+  options.verify_path = "out22.sig";
+  EXPECT_THROW(CHashCalc("test_files//1mb_00.bin", "out22.report", 1024, options),
+               std::invalid_argument);
+}
+
+TEST(HashCalc, IncrementalCopiesUnchangedBlocks) {
+  std::string data(1000000, '\0');
+  for (size_t i = 0; i < data.size(); i++) {
+    data[i] = static_cast<char>(i * 131 + 7);
+  }
+  std::ofstream("out23.bin", std::ios::binary | std::ios::trunc) << data;
+  // Fresh mtime isn't trusted, it may not change on the next write
+  fs::last_write_time("out23.bin", fs::file_time_type::clock::now() - std::chrono::hours(1));
+  const auto sign = [](const std::string& out, const std::string& previous, bool paranoid) {
+    HashCalc::COptions options;
+    options.write_sidecar = true;
+    options.previous_path = previous;
+    options.paranoid = paranoid;
+    CHashCalc calc("out23.bin", out, 4096, options);
+    calc.run();
+    return calc.get_rehashed_blocks();
+  };
+  EXPECT_EQ(sign("out23.result", "", false), 245u);
+  EXPECT_TRUE(fs::exists("out23.result.sidecar"));
+  const auto expected = get_str("out23.result");
+  EXPECT_EQ(sign("out23.next", "out23.result", false), 0u);
+  EXPECT_EQ(get_str("out23.next"), expected);
+  EXPECT_EQ(sign("out23.next", "out23.result", true), 245u);
+  EXPECT_EQ(get_str("out23.next"), expected);
+  // In place, the previous signature is replaced when the new one is complete
+  EXPECT_EQ(sign("out23.result", "out23.result", false), 0u);
+  EXPECT_EQ(get_str("out23.result"), expected);
+  // A malformed line of the previous signature means a full rehash
+  fs::copy_file("out23.result", "out23.prev", fs::copy_options::overwrite_existing);
+  fs::copy_file("out23.result.sidecar", "out23.prev.sidecar",
+                fs::copy_options::overwrite_existing);
+  const auto signed_time = fs::last_write_time("out23.prev");
+  {
+    std::fstream prev("out23.prev", std::ios::in | std::ios::out | std::ios::binary);
+    prev.seekp(4 * 65 + 10);
+    prev.put('g');
+  }
+  fs::last_write_time("out23.prev", signed_time);
+  EXPECT_EQ(sign("out23.next", "out23.prev", false), 245u);
+  EXPECT_EQ(get_str("out23.next"), expected);
+  // The data changed, without holes or copy-on-write extents everything is rehashed
+  data[5000] = 'x';
+  std::ofstream("out23.bin", std::ios::binary | std::ios::trunc) << data;
+  sign("out23.next", "out23.result", false);
+  CHashCalc full("out23.bin", "out23.full", 4096);
+  full.run();
+  EXPECT_EQ(get_str("out23.next"), get_str("out23.full"));
+  EXPECT_NE(get_str("out23.next"), expected);
+}
+
+TEST(HashCalc, IncrementalCopiesHoles) {
+  // 8MB sparse file, data in the first 10000 bytes only
+  std::string data(10000, 'a');
+  {
+    std::ofstream("out24.bin", std::ios::binary | std::ios::trunc) << data;
+  }
+  fs::resize_file("out24.bin", 8 * HashCalc::one_megabyte);
+  HashCalc::COptions options;
+  options.write_sidecar = true;
+  CHashCalc first("out24.bin", "out24.result", 4096, options);
+  first.run();
+  data[100] = 'b';
+  {
+    std::fstream file("out24.bin", std::ios::binary | std::ios::in | std::ios::out);
+    file.write(data.data(), std::streamsize(data.size()));
+  }
+  options.previous_path = "out24.result";
+  CHashCalc incremental("out24.bin", "out24.next", 4096, options);
+  incremental.run();
+  CHashCalc full("out24.bin", "out24.full", 4096);
+  full.run();
+  EXPECT_EQ(get_str("out24.next"), get_str("out24.full"));
+  CFileLayout layout;
+  ASSERT_TRUE(layout.read("out24.bin"));
+  if (layout.extents_known) {
+    EXPECT_LT(incremental.get_rehashed_blocks(), 2048u);
+  }
+}
+
+TEST(Merkle, RootMatchesFullTree) {
+  const auto sha256 = get_sha256_function(get_best_sha256_backend());
+  // Workers hash subtrees of full batches, the writer the rest, run() checks against the tree
+  HashCalc::COptions options;
+  options.merkle_tree_path = "out25.tree";
+  for (const auto& [path, block_size] :
+       {std::pair<std::string, uint64_t>{"test_files//100mb_00.bin", 4096},
+        {"test_files//1mb_00.bin", 100},
+        {"test_files//3chars.txt", 5}}) {
+    CHashCalc calc(path, "out25.result", block_size, options);
+    calc.run();
+    ASSERT_TRUE(calc.get_merkle_root());
+    CMerkleTree tree;
+    tree.open("out25.tree");
+    EXPECT_EQ(tree.root(), *calc.get_merkle_root()) << path;
+  }
+  // The odd leaf is promoted
+  CSignatureFile signature;
+  signature.open("out25.result");
+  ASSERT_EQ(signature.block_count(), 3u);
+  CMerkleTree tree;
+  tree.open("out25.tree");
+  const auto left = Merkle::hash_node(signature.digest(0), signature.digest(1), sha256);
+  EXPECT_EQ(tree.root(), Merkle::hash_node(left, signature.digest(2), sha256));
+  options.verify_path = "out25.result";
+  EXPECT_THROW(CHashCalc("test_files//3chars.txt", "out25.report", 5, options),
+               std::invalid_argument);
+}
+
+TEST(Merkle, ProofsAndDiff) {
+  const auto sha256 = get_sha256_function(get_best_sha256_backend());
+  std::string data(1000000, '\0');
+  for (size_t i = 0; i < data.size(); i++) {
+    data[i] = static_cast<char>(i * 131 + 7);
+  }
+  std::ofstream("out25.bin", std::ios::binary | std::ios::trunc) << data;
+  HashCalc::COptions options;
+  options.merkle_tree_path = "out25.tree";
+  CHashCalc calc("out25.bin", "out25.result", 1000, options);
+  calc.run();
+  CMerkleTree tree;
+  tree.open("out25.tree");
+  ASSERT_EQ(tree.leaves(), 1000u);
+  CSignatureFile signature;
+  signature.open("out25.result");
+  for (uint64_t leaf : {0u, 5u, 511u, 512u, 999u}) {
+    const auto proof = tree.proof(leaf);
+    EXPECT_TRUE(CMerkleTree::verify_proof(signature.digest(leaf), leaf, tree.leaves(), proof,
+                                          tree.root(), sha256))
+        << leaf;
+    EXPECT_FALSE(CMerkleTree::verify_proof(signature.digest(leaf ^ 1), leaf, tree.leaves(), proof,
+                                           tree.root(), sha256))
+        << leaf;
+  }
+  data[5000] = 'x';
+  data[7500] = 'x';
+  data[999999] = 'x';
+  std::ofstream("out25.bin", std::ios::binary | std::ios::trunc) << data;
+  options.merkle_tree_path = "out25.next";
+  CHashCalc changed("out25.bin", "out25.result", 1000, options);
+  changed.run();
+  CMerkleTree next;
+  next.open("out25.next");
+  EXPECT_EQ(tree.diff(next), CRanges({{5, 6}, {7, 8}, {999, 1000}}));
+  EXPECT_TRUE(tree.diff(tree).empty());
+}
+
+TEST(HashCalc, FileDigest) {
+  const auto sha256 = get_sha256_function(get_best_sha256_backend());
+  const auto digest = [](const std::string& path, uint64_t block_size, HashCalc::EFileDigest mode,
+                         HashCalc::EReadEngine engine, uint32_t buffers_count) {
+    HashCalc::COptions options;
+    options.file_digest = mode;
+    options.read_engine = engine;
+    options.buffers_count = buffers_count;
+    CHashCalc calc(path, "out26.result", block_size, options);
+    calc.run();
+    EXPECT_EQ(get_str("out26.result"), digest_to_hex(*calc.get_file_digest()) + "\n");
+    return digest_to_hex(*calc.get_file_digest());
+  };
+  // Plain SHA256 doesn't depend on the blocks
+  for (auto engine : {HashCalc::EReadEngine::stream, HashCalc::EReadEngine::mmap}) {
+    EXPECT_EQ(digest("test_files//1mb_00.bin", 1000, HashCalc::EFileDigest::sha256, engine, 3),
+              "30e14955ebf1352266dc2ff8067e68104607e750abb9d3b36582b8af909fcb58");
+    EXPECT_EQ(
+        digest("test_files//100mb_00.bin", 4096, HashCalc::EFileDigest::sha256, engine, 5),
+        "20492a4d0d84f8beb1767f6616229f85d44c2827b64bdbfb260ee12fa1109e0e");
+  }
+  // The tree digest binds the sizes to the root of the block digests
+  HashCalc::COptions options;
+  options.merkle = true;
+  CHashCalc merkle("test_files//100mb_00.bin", "out26.result", 4096, options);
+  merkle.run();
+  const auto expected = digest_to_hex(Merkle::file_digest(*merkle.get_merkle_root(), 4096,
+                                                          100 * HashCalc::one_megabyte, sha256));
+  for (uint32_t buffers_count : {1u, 3u}) {
+    EXPECT_EQ(digest("test_files//100mb_00.bin", 4096, HashCalc::EFileDigest::tree,
+                     HashCalc::EReadEngine::automatic, buffers_count),
+              expected);
+  }
+  EXPECT_NE(digest("test_files//100mb_00.bin", 8192, HashCalc::EFileDigest::tree,
+                   HashCalc::EReadEngine::automatic, 3),
+            expected);
+  options.file_digest = HashCalc::EFileDigest::tree;
+  EXPECT_THROW(CHashCalc("test_files//1mb_00.bin", "out26.result", 1000, options),
+               std::invalid_argument);
+}
+
+TEST(BatchCalc, SignsEveryFileWithSharedWorkers) {
+  fs::remove_all("out27");
+  const auto files = CBatchCalc::list_files("test_files", "out27", ".txt");
+  ASSERT_GE(files.size(), 8u);
+  HashCalc::COptions options;
+  CBatchCalc batch(files, 1000, options, 3);
+  batch.run();
+  // The empty file can't be signed
+  ASSERT_EQ(batch.get_failed().size(), 1u);
+  EXPECT_EQ(fs::path(batch.get_failed()[0].first).filename(), "empty.bin");
+  uint64_t bytes = 0;
+  for (const auto& file : files) {
+    if (!fs::file_size(file.in_path)) {
+      continue;
+    }
+    bytes += fs::file_size(file.in_path);
+    CHashCalc calc(file.in_path, "out27.result", 1000);
+    calc.run();
+    EXPECT_EQ(get_str(file.out_path), get_str("out27.result")) << file.in_path;
+  }
+  EXPECT_EQ(batch.get_bytes(), bytes);
+  EXPECT_TRUE(fs::exists("out27/1mb_00.bin.txt"));
+  options.verify_path = "out27.result";
+  EXPECT_THROW(CBatchCalc(files, 1000, options), std::invalid_argument);
+}
+
+//! Random bytes with repeated runs, so some chunks are forced at the maximal size
+std::string chunking_data(size_t size) {
+  std::string data(size, '\0');
+  uint64_t state = 1;
+  for (size_t i = 0; i < size; i++) {
+    state = state * 6364136223846793005ull + 1442695040888963407ull;
+    data[i] = (i / 100000) % 4 == 3 ? 'x' : static_cast<char>(state >> 56);
+  }
+  return data;
+}
+
+//! Lines "offset length digest" after the first one
+std::vector<std::tuple<uint64_t, uint64_t, std::string>> read_chunks(const std::string& path) {
+  std::vector<std::tuple<uint64_t, uint64_t, std::string>> chunks;
+  std::ifstream in(path);
+  std::string line;
+  std::getline(in, line);
+  uint64_t offset = 0;
+  uint64_t length = 0;
+  std::string digest;
+  while (in >> offset >> length >> digest) {
+    chunks.emplace_back(offset, length, digest);
+  }
+  return chunks;
+}
+
+TEST(Chunking, ParallelCutsMatchSequential) {
+  const auto data = chunking_data(3 * 1024 * 1024 + 777);
+  std::ofstream("out35.bin", std::ios::binary) << data;
+  const HashCalc::CChunkSizes sizes = {1024, 4096, 16384};
+  // FastCDC one byte at a time
+  std::vector<uint64_t> expected;
+  const auto strict = Chunking::strict_mask(sizes.average);
+  const auto loose = Chunking::loose_mask(sizes.average);
+  uint64_t hash = 0;
+  for (uint64_t i = 0, start = 0; i < data.size(); i++) {
+    hash = (hash << 1) + Chunking::gear[static_cast<unsigned char>(data[i])];
+    const auto length = i + 1 - start;
+    if (length == sizes.max ||
+        (length >= sizes.min && !(hash & (length < sizes.average ? strict : loose)))) {
+      expected.push_back(i + 1);
+      start = i + 1;
+    }
+  }
+  if (expected.back() != data.size()) {
+    expected.push_back(data.size());
+  }
+  // Rounds which end inside segments and chunks, the stream reader carries the open chunk
+  for (auto engine : {HashCalc::EReadEngine::mmap, HashCalc::EReadEngine::stream}) {
+    for (uint64_t buffer_size : {uint64_t(300001), HashCalc::max_buffer_size}) {
+      HashCalc::COptions options;
+      options.read_engine = engine;
+      options.buffer_size = buffer_size;
+      CChunkCalc calc("out35.bin", "out35.result", sizes, options);
+      calc.run();
+      EXPECT_EQ(get_str("out35.result").substr(0, 28), "#cdc sha256 1024 4096 16384\n");
+      const auto chunks = read_chunks("out35.result");
+      ASSERT_EQ(chunks.size(), expected.size());
+      EXPECT_EQ(calc.get_chunks_count(), expected.size());
+      uint64_t offset = 0;
+      for (size_t i = 0; i < chunks.size(); i++) {
+        const auto& [chunk_offset, length, digest] = chunks[i];
+        ASSERT_EQ(chunk_offset, offset);
+        ASSERT_EQ(offset + length, expected[i]);
+        CDigest sha256 = {};
+        calc_sha256(data.data() + offset, length, sha256.data());
+        ASSERT_EQ(digest, digest_to_hex(sha256));
+        offset += length;
+      }
+    }
+  }
+  EXPECT_THROW(CChunkCalc("out35.bin", "out35.result", {4096, 1024, 16384}),
+               std::invalid_argument);
+  HashCalc::COptions options;
+  options.output_format = HashCalc::EOutputFormat::binary;
+  EXPECT_THROW(CChunkCalc("out35.bin", "out35.result", sizes, options), std::invalid_argument);
+}
+
+TEST(Chunking, InsertedByteKeepsLaterChunks) {
+  auto data = chunking_data(2 * 1024 * 1024);
+  std::ofstream("out35.bin", std::ios::binary) << data;
+  HashCalc::COptions options;
+  options.algorithm = HashCalc::EAlgorithm::blake3;
+  CChunkCalc before("out35.bin", "out35.result", {}, options);
+  before.run();
+  const auto chunks = read_chunks("out35.result");
+  data.insert(data.begin() + 5000, 'y');
+  std::ofstream("out35.bin", std::ios::binary) << data;
+  CChunkCalc after("out35.bin", "out35.result", {}, options);
+  after.run();
+  const auto shifted = read_chunks("out35.result");
+  // Only the chunks around the inserted byte differ, the rest moved by one byte
+  size_t same = 0;
+  for (const auto& [offset, length, digest] : shifted) {
+    same += std::count_if(chunks.begin(), chunks.end(), [&](const auto& chunk) {
+      return std::get<0>(chunk) + 1 == offset && std::get<1>(chunk) == length &&
+             std::get<2>(chunk) == digest;
+    });
+    EXPECT_EQ(digest.size(), 64u);
+  }
+  EXPECT_GT(chunks.size(), 100u);
+  EXPECT_GE(same + 2, chunks.size());
+}
+
+TEST(ThreadPool, FuturesSourcesAndOwnPools) {
+  CThreadPool pool(3);
+  auto answer = pool.submit([] { return 42; });
+  auto error = pool.submit([]() -> int { throw std::runtime_error("job failed"); });
+  EXPECT_EQ(answer.get(), 42);
+  EXPECT_THROW(error.get(), std::runtime_error);
+  std::vector<uint64_t> squares(1000);
+  parallel_for(pool, squares.size(), [&squares](uint64_t i) { squares[i] = i * i; });
+  EXPECT_EQ(squares[999], 999u * 999u);
+  // A source runs until it has nothing left, detach() waits for the workers inside it
+  std::atomic_int left(100);
+  const auto id = pool.attach([&left] { return left-- > 0; });
+  while (left > 0) {
+    std::this_thread::yield();
+  }
+  pool.detach(id);
+  EXPECT_LE(left, 0);
+  // Workers drain a source without the mutex, detach() stops one which never runs dry
+  std::atomic_uint64_t runs(0);
+  const auto endless = pool.attach([&runs] { return ++runs > 0; });
+  while (runs < 1000) {
+    std::this_thread::yield();
+  }
+  pool.detach(endless);
+  const auto detached_runs = runs.load();
+  EXPECT_EQ(pool.submit([] { return 7; }).get(), 7);
+  EXPECT_EQ(runs, detached_runs);
+  // Calculations borrow the workers of any pool
+  HashCalc::COptions options;
+  options.thread_pool = &pool;
+  CHashCalc calc("test_files//1mb_00.bin", "out28.result", 1000, options);
+  calc.run();
+  CHashCalc expected("test_files//1mb_00.bin", "out28.expected", 1000);
+  expected.run();
+  EXPECT_EQ(get_str("out28.result"), get_str("out28.expected"));
+}
+
+TEST(ThreadPool, ServiceThreadsAreReused) {
+  CThreadPool pool(1);
+  // A service job may wait for the only worker
+  auto answer = pool.submit_service([&pool] { return pool.submit([] { return 42; }).get(); });
+  EXPECT_EQ(answer.get(), 42);
+  EXPECT_EQ(pool.services_count(), 1u);
+  // The writer and the I/O threads of the runs after the first one start no threads
+  HashCalc::COptions options;
+  options.thread_pool = &pool;
+  options.read_engine = HashCalc::EReadEngine::pread;
+  options.io_threads = 2;
+  CHashCalc expected("test_files//1mb_00.bin", "out38.expected", 1000);
+  expected.run();
+  for (int i = 0; i < 3; i++) {
+    CHashCalc calc("test_files//1mb_00.bin", "out38.result", 1000, options);
+    calc.run();
+    EXPECT_EQ(get_str("out38.result"), get_str("out38.expected"));
+    EXPECT_EQ(pool.services_count(), 3u);
+  }
+}
+
+TEST(ThreadPool, IdleWorkersDontSpin) {
+  CThreadPool pool(4);
+  pool.submit([] {}).get();
+  // Parked workers, the global pool and the writer of no calculation take no CPU time
+  const auto cpu_start = get_process_cpu_micro();
+  std::this_thread::sleep_for(std::chrono::milliseconds(200));
+  EXPECT_LT(get_process_cpu_micro() - cpu_start, 50000u);
+  CHashCalc calc("test_files//100mb_00.bin", "out29.result", 4096);
+  calc.run();
+  EXPECT_GT(calc.get_cpu_micro(), 0u);
+  EXPECT_GT(calc.get_wall_micro(), 0u);
+}
+
+TEST(HashCalc, MetricsAndProgress) {
+  CThreadPool pool(2);
+  HashCalc::COptions options;
+  options.thread_pool = &pool;
+  options.read_engine = HashCalc::EReadEngine::stream;
+  options.progress_interval_ms = 10;
+  options.metrics_path = "out36.prom";
+  testing::internal::CaptureStderr();
+  CHashCalc calc("test_files//100mb_00.bin", "out36.result", 4096, options);
+  calc.run();
+  const auto progress = testing::internal::GetCapturedStderr();
+  EXPECT_NE(progress.find("Progress: 100.0% (104 of 104 MB)"), std::string::npos);
+  // Every block was hashed by a worker and taken by the writer once
+  const auto metrics = calc.get_metrics();
+  ASSERT_EQ(metrics.threads.size(), 4u);
+  EXPECT_EQ(metrics.threads[1].name, "worker1");
+  EXPECT_EQ(metrics.threads[2].name, "writer");
+  EXPECT_EQ(metrics.threads[3].name, "reader");
+  EXPECT_EQ(metrics.total(&CMetricsSnapshot::CThread::blocks_hashed), 25600u);
+  EXPECT_EQ(metrics.total(&CMetricsSnapshot::CThread::bytes_hashed), 104857600u);
+  EXPECT_EQ(metrics.threads[2].blocks_written, 25600u);
+  EXPECT_EQ(metrics.threads[2].bytes_written, 25600u * 65);
+  EXPECT_EQ(metrics.threads[3].bytes_read, 104857600u);
+  EXPECT_EQ(metrics.done_bytes, 104857600u);
+  EXPECT_GT(metrics.hash_latency.count(), 0u);
+  EXPECT_GT(metrics.read_latency.count(), 0u);
+  EXPECT_EQ(metrics.write_latency.count(), 5u);
+  const auto prometheus = get_str("out36.prom");
+  EXPECT_NE(prometheus.find("signature_blocks_hashed_total{thread=\"worker0\"}"),
+            std::string::npos);
+  EXPECT_NE(prometheus.find("signature_hash_latency_seconds_bucket{le=\"+Inf\"}"),
+            std::string::npos);
+  EXPECT_NE(prometheus.find("signature_done_bytes 104857600"), std::string::npos);
+  // JSON by the extension, the metrics file alone runs the reporter
+  options.progress_interval_ms = 0;
+  options.metrics_path = "out36.json";
+  CHashCalc json("test_files//100mb_00.bin", "out36.result", 4096, options);
+  json.run();
+  const auto dump = get_str("out36.json");
+  EXPECT_NE(dump.find("\"done_bytes\": 104857600"), std::string::npos);
+  EXPECT_NE(dump.find("\"name\": \"writer\""), std::string::npos);
+  EXPECT_NE(dump.find("\"hash_latency_ns\": {\"count\": "), std::string::npos);
+  EXPECT_FALSE(fs::exists("out36.json.tmp"));
+}
+
+TEST(HashCalc, MemoryAndCallbackInput) {
+  const auto data = get_str("test_files//1mb_00.bin");
+  HashCalc::COptions options;
+  options.buffer_size = 64 * 1024;
+  for (auto algorithm : {HashCalc::EAlgorithm::sha256, HashCalc::EAlgorithm::blake3}) {
+    options.algorithm = algorithm;
+    // The tree takes SHA256 only
+    options.merkle = algorithm == HashCalc::EAlgorithm::sha256;
+    CHashCalc file("test_files//1mb_00.bin", "out37.result", 1000, options);
+    file.run();
+    const auto length = get_digest_length(algorithm);
+    std::string lines = text_signature_prefix(algorithm);
+    uint64_t next = 0;
+    const auto add_lines = [&lines, &next, length](uint64_t first, const CDigest* digests,
+                                                   uint64_t count) {
+      EXPECT_EQ(first, next);
+      next += count;
+      for (uint64_t i = 0; i < count; i++) {
+        lines += digest_to_hex(digests[i], length) + '\n';
+      }
+    };
+    // The memory is hashed in place
+    CHashCalc memory(data.data(), data.size(), 1000, options);
+    EXPECT_EQ(memory.get_read_engine(), HashCalc::EReadEngine::memory);
+    memory.run(add_lines);
+    EXPECT_EQ(lines, get_str("out37.result"));
+    EXPECT_EQ(memory.get_merkle_root(), file.get_merkle_root());
+    // Short reads of the callback still fill whole windows
+    lines = text_signature_prefix(algorithm);
+    next = 0;
+    size_t offset = 0;
+    CHashCalc callback(
+        [&data, &offset](char* buffer, uint64_t size) {
+          const auto read = std::min({uint64_t(777), size, uint64_t(data.size() - offset)});
+          std::memcpy(buffer, data.data() + offset, read);
+          offset += read;
+          return read;
+        },
+        1000, options);
+    callback.run(add_lines);
+    EXPECT_EQ(lines, get_str("out37.result"));
+    EXPECT_EQ(callback.get_merkle_root(), file.get_merkle_root());
+  }
+  // Digests into an array of the caller, which must hold all of them
+  const auto blocks = (data.size() + 4095) / 4096;
+  std::vector<CDigest> digests(blocks);
+  CHashCalc array(data.data(), data.size(), 4096);
+  array.run(digests.data(), digests.size());
+  CDigest last = {};
+  calc_sha256(data.data() + (blocks - 1) * 4096, data.size() - (blocks - 1) * 4096, last.data());
+  EXPECT_EQ(digests.back(), last);
+  CHashCalc short_array(data.data(), data.size(), 4096);
+  EXPECT_THROW(short_array.run(digests.data(), blocks - 1), std::invalid_argument);
+  auto left = data.size();
+  CHashCalc long_stream(
+      [&left](char* buffer, uint64_t size) {
+        const auto read = std::min(uint64_t(left), size);
+        std::memset(buffer, 'x', read);
+        left -= read;
+        return read;
+      },
+      4096);
+  EXPECT_THROW(long_stream.run(digests.data(), blocks - 1), std::runtime_error);
+  // Errors of the callbacks reach the caller, the files need run() without one
+  CHashCalc failing([](char*, uint64_t) -> uint64_t { throw std::runtime_error("read failed"); });
+  EXPECT_THROW(failing.run([](uint64_t, const CDigest*, uint64_t) {}), std::runtime_error);
+  CHashCalc rejected(data.data(), data.size(), 4096);
+  EXPECT_THROW(
+      rejected.run([](uint64_t, const CDigest*, uint64_t) { throw std::logic_error("full"); }),
+      std::logic_error);
+  EXPECT_THROW(CHashCalc(data.data(), data.size(), 4096).run(), std::invalid_argument);
+  options = {};
+  options.file_digest = HashCalc::EFileDigest::sha256;
+  CHashCalc file_digest(data.data(), data.size(), 1000, options);
+  EXPECT_THROW(file_digest.run([](uint64_t, const CDigest*, uint64_t) {}),
+               std::invalid_argument);
+  options = {};
+  options.read_engine = HashCalc::EReadEngine::memory;
+  EXPECT_THROW(CHashCalc("test_files//1mb_00.bin", "out37.result", 1000, options),
+               std::invalid_argument);
+}
+
+TEST(ThreadPool, ParsesCpuLists) {
+  std::vector<uint32_t> cpus;
+  EXPECT_TRUE(parse_cpu_list("0-3,8,10-11,2", cpus));
+  EXPECT_EQ(cpus, std::vector<uint32_t>({0, 1, 2, 3, 8, 10, 11}));
+  EXPECT_FALSE(parse_cpu_list("3-1", cpus));
+  EXPECT_FALSE(parse_cpu_list("a", cpus));
+  EXPECT_FALSE(parse_cpu_list("1,,2", cpus));
+  EXPECT_FALSE(parse_cpu_list("", cpus));
+}
+
+TEST(ThreadPool, NodesHashTheirWindows) {
+  // Two nodes of workers which aren't pinned, so it runs on any machine
+  CThreadPool pool({{-1, 0}, {-1, 1}, {-1, 1}});
+  EXPECT_EQ(pool.nodes_count(), 2u);
+  EXPECT_EQ(pool.submit_to_node(1, [] { return CThreadPool::current_node(); }).get(), 1u);
+  EXPECT_EQ(CThreadPool::current_node(), 0u);
+  {
+    std::ofstream out("out30.bin", std::ios::binary);
+    for (uint32_t i = 0; i < 3000000; i++) {
+      out.put(static_cast<char>(i * 7 + i / 4096));
+    }
+  }
+  HashCalc::COptions options;
+  options.read_engine = HashCalc::EReadEngine::stream;
+  options.buffers_count = 3;
+  options.buffer_size = 300000;
+  options.merkle = true;
+  CHashCalc expected("out30.bin", "out30.expected", 4096, options);
+  expected.run();
+  options.thread_pool = &pool;
+  CHashCalc calc("out30.bin", "out30.result", 4096, options);
+  calc.run();
+  EXPECT_EQ(get_str("out30.result"), get_str("out30.expected"));
+  EXPECT_EQ(calc.get_merkle_root(), expected.get_merkle_root());
+}
+
+TEST(TaskManager, BatchesDontCrossWindows) {
+  const std::string data(25, 'a');
+  CTaskManager manager;
+  manager.init(2, 1, 10, 4);
+  manager.add_window(0, data.data(), 10);
+  manager.add_window(1, data.data() + 10, 10);
+  std::vector<std::pair<uint64_t, uint64_t>> claimed;
+  for (auto i = 0; i < 6; i++) {
+    auto task = manager.get_task();
+    ASSERT_TRUE(task.has_value());
+    EXPECT_EQ(task->window, uint32_t(task->index / 10));
+    EXPECT_EQ(task->data, data.data() + task->index);
+    claimed.emplace_back(task->index, task->count);
+  }
+  const std::vector<std::pair<uint64_t, uint64_t>> expected = {{0, 4},  {4, 4},  {8, 2},
+                                                               {10, 4}, {14, 4}, {18, 2}};
+  EXPECT_EQ(claimed, expected);
+  // The first window is reused for the last 5 bytes
+  manager.add_window(0, data.data() + 20, 5);
+  auto task = manager.get_task();
+  ASSERT_TRUE(task.has_value());
+  EXPECT_EQ(task->window, 0u);
+  EXPECT_EQ(task->size, 4u);
+  task = manager.get_task();
+  ASSERT_TRUE(task.has_value());
+  EXPECT_EQ(task->index, 24u);
+  EXPECT_EQ(task->size, 1u);
+  manager.stop();
+  EXPECT_FALSE(manager.get_task().has_value());
+}
+
 int main(int argc, char* argv[]) {
   ::testing::InitGoogleTest(&argc, argv);
   return RUN_ALL_TESTS();
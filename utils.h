@@ -2,32 +2,45 @@
 #define SIGNATURE_UTILS_H
 
 #include <algorithm>
+#include <array>
+#include <atomic>
 #include <chrono>
 #include <condition_variable>
+#include <cstring>
 #include <cstdint>
+#include <deque>
+#include <functional>
+#include <future>
+#include <iomanip>
 #include <iostream>
+#include <memory>
 #include <mutex>
+#include <optional>
+#include <sstream>
+#include <string>
 #include <thread>
+#include <type_traits>
 #include <vector>
 
+#include "cpu_topology.h"
+#include "sha256.h"
+
 #ifdef _WIN32
 #include <Windows.h>
 #else
 
+#include <sys/resource.h>
 #include <unistd.h>
 
 #endif
 
-//! Digest length for SHA256
-constexpr uint64_t sha256_digest_length = 32;
-//! Lambda for sorting
-const auto sort_by_index = [](const std::pair<std::string, uint64_t>& a,
-                              const std::pair<std::string, uint64_t>& b) {
-  return (a.second < b.second);
-};
-//! Returns the number of cores,
+//! Returns the number of cores the process may run on
 inline uint32_t get_threads_count() {
-  uint32_t core_count = std::thread::hardware_concurrency();
+  // taskset and cgroup cpusets limit the cores
+  uint32_t core_count = uint32_t(get_allowed_cpus().size());
+  if (!core_count) {
+    core_count = std::thread::hardware_concurrency();
+  }
   if (!core_count) {
 #ifdef _WIN32
     SYSTEM_INFO sysinfo;
@@ -39,6 +52,28 @@ inline uint32_t get_threads_count() {
   }
   return core_count;
 }
+//! CPU time of the whole process, user and system, in microseconds. Compared with the wall time
+//! it tells how many cores were busy, spinning threads show up as CPU time without progress
+inline uint64_t get_process_cpu_micro() {
+#ifdef _WIN32
+  FILETIME creation, exit, kernel, user;
+  if (!GetProcessTimes(GetCurrentProcess(), &creation, &exit, &kernel, &user)) {
+    return 0;
+  }
+  const auto ticks = [](const FILETIME& time) {
+    return (uint64_t(time.dwHighDateTime) << 32) | time.dwLowDateTime;
+  };
+  // 100 ns ticks
+  return (ticks(kernel) + ticks(user)) / 10;
+#else
+  rusage usage = {};
+  if (getrusage(RUSAGE_SELF, &usage)) {
+    return 0;
+  }
+  return uint64_t(usage.ru_utime.tv_sec + usage.ru_stime.tv_sec) * 1000000 +
+         uint64_t(usage.ru_utime.tv_usec + usage.ru_stime.tv_usec);
+#endif
+}
 //! This class provides execution time measurement.
 class CTimer {
  public:
@@ -81,224 +116,743 @@ class CTimer {
     return uint64_t(std::chrono::duration_cast<std::chrono::milliseconds>(m_t2 - m_t1).count());
   }
 
+  //! Time since start() of a running timer, other threads may ask once they see it running
+  [[nodiscard]] inline uint64_t get_running_nano() const {
+    return uint64_t(std::chrono::duration_cast<std::chrono::nanoseconds>(
+                        std::chrono::high_resolution_clock::now() - m_t1)
+                        .count());
+  }
+
  private:
   std::chrono::high_resolution_clock::time_point m_t1;
   std::chrono::high_resolution_clock::time_point m_t2;
   std::atomic_bool m_is_running;
 };
-//! Calculates SHA256 using mbedtls
-static std::string calc_sha256(const char* ptr, const size_t block_size) {
-  unsigned char hash[sha256_digest_length] = {};
-  mbedtls_sha256_context ctx;
-  mbedtls_sha256_init(&ctx);
-  mbedtls_sha256_starts(&ctx, 0);
-  mbedtls_sha256_update(&ctx, reinterpret_cast<const unsigned char*>(ptr), block_size);
-  mbedtls_sha256_finish(&ctx, hash);
-
-  std::ostringstream os;
-  os << std::hex << std::setfill('0');
-
-  for (auto i : hash) {
-    os << std::setw(2) << static_cast<unsigned int>(i);
-  }
-  return os.str();
-}
-//! Implementation of the vector for use in a multi-threaded environment
-template <typename T>
-class CLockVec {
+//! Counter of a single thread which others read at any time, e.g. for a progress report. <br>
+//! Relaxed load and store instead of a locked add, the hot paths pay for a plain increment
+class CCounter {
  public:
-  CLockVec() = default;
+  void add(uint64_t value) {
+    m_value.store(m_value.load(std::memory_order_relaxed) + value, std::memory_order_relaxed);
+  }
 
-  CLockVec(const CLockVec&) = delete;
+  [[nodiscard]] uint64_t get() const { return m_value.load(std::memory_order_relaxed); }
 
-  CLockVec& operator=(CLockVec const&) = delete;
+ private:
+  std::atomic_uint64_t m_value{0};
+};
+//! Durations of a single thread in power of two buckets: bucket i counts [2^i, 2^(i+1)) ns, the
+//! last one everything longer
+class CHistogram {
+ public:
+  static constexpr uint32_t buckets_count = 40;
 
-  CLockVec(CLockVec&&) = delete;
+  void add(uint64_t nano) {
+    uint32_t bucket = 0;
+    while (bucket + 1 < buckets_count && nano >> (bucket + 1)) {
+      bucket++;
+    }
+    m_buckets[bucket].add(1);
+    m_sum.add(nano);
+  }
 
-  CLockVec& operator=(CLockVec&&) = delete;
+  [[nodiscard]] uint64_t bucket(uint32_t index) const { return m_buckets[index].get(); }
 
-  T& operator[](std::size_t index) {
-    std::scoped_lock<std::mutex> lock(m_mutex);
-    return m_vec[index];
-  }
+  [[nodiscard]] uint64_t sum() const { return m_sum.get(); }
 
-  std::size_t size() {
-    std::scoped_lock<std::mutex> lock(m_mutex);
-    return m_vec.size();
+ private:
+  std::array<CCounter, buckets_count> m_buckets;
+  CCounter m_sum;
+};
+//! Length of the output line of a digest: lowercase hex and '\n'
+constexpr uint64_t hex_line_length = sha256_digest_length * 2 + 1;
+//! Writes count digests as lowercase hex lines terminated by '\n' straight into out, which must
+//! hold count * (digest_length * 2 + 1) bytes. <br>
+//! Every byte is looked up in a table of 256 two-character entries
+inline void digests_to_hex_lines(const CDigest* digests,
+                                 size_t count,
+                                 char* out,
+                                 uint64_t digest_length = sha256_digest_length) {
+  static constexpr auto table = [] {
+    constexpr char digits[] = "0123456789abcdef";
+    std::array<char, 512> pairs = {};
+    for (size_t i = 0; i < 256; i++) {
+      pairs[i * 2] = digits[i >> 4];
+      pairs[i * 2 + 1] = digits[i & 0xF];
+    }
+    return pairs;
+  }();
+  const auto line_length = digest_length * 2 + 1;
+  for (size_t i = 0; i < count; i++, out += line_length) {
+    for (size_t byte = 0; byte < digest_length; byte++) {
+      std::memcpy(out + byte * 2, table.data() + digests[i][byte] * 2, 2);
+    }
+    out[line_length - 1] = '\n';
   }
-
-  void clear() {
-    std::scoped_lock<std::mutex> lock(m_mutex);
-    m_vec.clear();
+}
+//! Parses digest_length * 2 hex characters of either case into the digest, the rest of it is
+//! zeroed. Returns false on other characters
+inline bool hex_to_digest(const char* hex,
+                          CDigest& digest,
+                          uint64_t digest_length = sha256_digest_length) {
+  static constexpr auto table = [] {
+    std::array<int8_t, 256> values = {};
+    for (size_t i = 0; i < 256; i++) {
+      values[i] = i >= '0' && i <= '9'   ? int8_t(i - '0')
+                  : i >= 'a' && i <= 'f' ? int8_t(i - 'a' + 10)
+                  : i >= 'A' && i <= 'F' ? int8_t(i - 'A' + 10)
+                                         : int8_t(-1);
+    }
+    return values;
+  }();
+  digest = {};
+  for (size_t byte = 0; byte < digest_length; byte++) {
+    const auto high = table[static_cast<unsigned char>(hex[byte * 2])];
+    const auto low = table[static_cast<unsigned char>(hex[byte * 2 + 1])];
+    if (high < 0 || low < 0) {
+      return false;
+    }
+    digest[byte] = static_cast<unsigned char>((high << 4) | low);
   }
+  return true;
+}
+//! Formats the first digest_length bytes of the digest as lowercase hex string
+inline std::string digest_to_hex(const CDigest& digest,
+                                 uint64_t digest_length = sha256_digest_length) {
+  std::string hex(digest_length * 2 + 1, '\0');
+  digests_to_hex_lines(&digest, 1, hex.data(), digest_length);
+  hex.pop_back();
+  return hex;
+}
+//! Consecutive blocks of one read window claimed by a worker
+struct CTask {
+  uint32_t window;    //!< Index of the read window
+  const char* data;   //!< Data of the first block, points into the window or into the file mapping
+  uint64_t size;      //!< Size of all blocks, the last block of the file may be shorter
+  uint64_t index;     //!< Sequence number of the first block in the file
+  uint64_t count;     //!< Number of blocks
+};
+//! Provides job management methods. <br>
+//! The reader publishes whole windows, workers claim batches of blocks by moving the atomic
+//! block cursor, the mutex is taken only to park idle workers
+class CTaskManager {
+ public:
+  CTaskManager()
+      : m_windows_count(0),
+        m_block_size(0),
+        m_blocks_per_window(0),
+        m_batch_size(1),
+        m_next(0),
+        m_published(0),
+        m_sleepers(0),
+        m_should_stop(false) {}
 
-  void push_back(T& element) {
-    std::scoped_lock<std::mutex> lock(m_mutex);
-    m_vec.push_back(element);
-  }
+  ~CTaskManager() = default;
 
-  void emplace_back(T&& element) {
-    std::scoped_lock<std::mutex> lock(m_mutex);
-    m_vec.emplace_back(element);
+  CTaskManager(const CTaskManager&) = delete;
+
+  CTaskManager& operator=(CTaskManager const&) = delete;
+
+  CTaskManager(CTaskManager&&) = delete;
+
+  CTaskManager& operator=(CTaskManager&&) = delete;
+
+  //! Every window except the last one must hold blocks_per_window blocks, workers claim up to
+  //! batch_size blocks at once
+  void init(uint32_t windows_count,
+            uint64_t block_size,
+            uint64_t blocks_per_window,
+            uint64_t batch_size) {
+    m_windows = std::make_unique<CWindow[]>(windows_count);
+    m_windows_count = windows_count;
+    m_block_size = block_size;
+    m_blocks_per_window = blocks_per_window;
+    m_batch_size = std::max(batch_size, uint64_t(1));
   }
 
-  bool empty() {
-    std::scoped_lock<std::mutex> lock(m_mutex);
-    return m_vec.empty();
+  //! Blocks until a task is available, returns std::nullopt after stop()
+  std::optional<CTask> get_task() {
+    while (!m_should_stop.load(std::memory_order_acquire)) {
+      if (auto task = try_get_task()) {
+        return task;
+      }
+      park();
+    }
+    return std::nullopt;
   }
 
-  void reserve(std::size_t n) {
-    std::scoped_lock<std::mutex> lock(m_mutex);
-    m_vec.reserve(n);
+  //! Claims a task without blocking, std::nullopt if nothing is published or after stop()
+  std::optional<CTask> try_get_task() {
+    auto next = m_next.load(std::memory_order_relaxed);
+    while (!m_should_stop.load(std::memory_order_acquire)) {
+      const auto published = m_published.load(std::memory_order_acquire);
+      if (next >= published) {
+        return std::nullopt;
+      }
+      // Batches never cross window boundaries
+      const auto window_index = next / m_blocks_per_window;
+      const auto window_end = std::min(published, (window_index + 1) * m_blocks_per_window);
+      const auto count = std::min(m_batch_size, window_end - next);
+      if (!m_next.compare_exchange_weak(next, next + count, std::memory_order_acq_rel,
+                                        std::memory_order_relaxed)) {
+        m_claim_retries.fetch_add(1, std::memory_order_relaxed);
+        continue;
+      }
+      // The window can't be reused until the claimed blocks are reported as hashed
+      const auto& descriptor = m_windows[window_index % m_windows_count];
+      const auto offset = (next - descriptor.first_block) * m_block_size;
+      return CTask{descriptor.window, descriptor.data + offset,
+                   std::min(count * m_block_size, descriptor.size - offset),
+                   descriptor.index + next - descriptor.first_block, count};
+    }
+    return std::nullopt;
   }
 
-  std::size_t capacity() {
-    std::scoped_lock<std::mutex> lock(m_mutex);
-    return m_vec.capacity();
+  //! Publishes blocks of the window, returns the number of blocks
+  uint64_t add_window(uint32_t window, const char* data, uint64_t size) {
+    return add_window(window, data, size, m_published.load(std::memory_order_relaxed));
   }
 
-  template <typename FT>
-  void sort(FT func) {
-    std::scoped_lock<std::mutex> lock(m_mutex);
-    std::sort(m_vec.begin(), m_vec.end(), func);
+  //! Publishes blocks of the window, the first one is index in the file. Used when the windows of
+  //! the file are split between several managers, tasks keep the window and the block indices
+  uint64_t add_window(uint32_t window, const char* data, uint64_t size, uint64_t index) {
+    const auto first_block = m_published.load(std::memory_order_relaxed);
+    const auto count = (size + m_block_size - 1) / m_block_size;
+    m_windows[first_block / m_blocks_per_window % m_windows_count] = {data, size, first_block,
+                                                                       index, window};
+    m_published.store(first_block + count, std::memory_order_seq_cst);
+    if (m_sleepers.load(std::memory_order_seq_cst)) {
+      wake_all();
+    }
+    return count;
   }
 
-  typename std::vector<T>::iterator begin() { return m_vec.begin(); }
+  //! Claims lost to other workers and retried, a measure of the contention on the cursor
+  [[nodiscard]] uint64_t get_claim_retries() const {
+    return m_claim_retries.load(std::memory_order_relaxed);
+  }
 
-  typename std::vector<T>::iterator end() { return m_vec.end(); }
+  //! Wakes up all waiting threads, get_task() returns std::nullopt from now on
+  void stop() {
+    m_should_stop.store(true, std::memory_order_seq_cst);
+    wake_all();
+  }
 
-  typename std::vector<T>::const_iterator cbegin() const { return m_vec.begin(); }
+ private:
+  struct CWindow {
+    const char* data;
+    uint64_t size;
+    uint64_t first_block;  //!< Block of the manager
+    uint64_t index;        //!< Block of the file
+    uint32_t window;
+  };
+
+  void park() {
+    std::unique_lock lock(m_mutex);
+    m_sleepers.fetch_add(1, std::memory_order_seq_cst);
+    m_cv.wait(lock, [this] {
+      return m_published.load(std::memory_order_seq_cst) >
+                 m_next.load(std::memory_order_relaxed) ||
+             m_should_stop.load(std::memory_order_seq_cst);
+    });
+    m_sleepers.fetch_sub(1, std::memory_order_relaxed);
+  }
 
-  typename std::vector<T>::const_iterator cend() const { return m_vec.end(); }
+  void wake_all() {
+    // Taking the mutex guarantees that a worker between the check and the wait gets the signal
+    { std::unique_lock lock(m_mutex); }
+    m_cv.notify_all();
+  }
 
  private:
-  std::vector<T> m_vec;
+  std::unique_ptr<CWindow[]> m_windows;
+  uint32_t m_windows_count;
+  uint64_t m_block_size;
+  uint64_t m_blocks_per_window;
+  uint64_t m_batch_size;
+  alignas(64) std::atomic_uint64_t m_next;
+  alignas(64) std::atomic_uint64_t m_published;
+  alignas(64) std::atomic_uint32_t m_sleepers;
+  std::atomic_uint64_t m_claim_retries{0};
+  std::atomic_bool m_should_stop;
   std::mutex m_mutex;
+  std::condition_variable m_cv;
 };
-//! Provides job management methods
-class CTaskManager {
+//! Ring of read windows, the reader fills the next window while workers hash the previous ones
+//! and the writer drains hashed windows in order. <br>
+//! A window is reused only after its digests are taken by the writer
+class CBufferRing {
  public:
-  CTaskManager() : m_task_index(0), m_tasks_done(0) {}
+  CBufferRing() : m_windows_count(0), m_window_size(0), m_finished(false), m_cancelled(false) {}
 
-  ~CTaskManager() = default;
+  ~CBufferRing() = default;
 
-  CTaskManager(const CTaskManager&) = delete;
+  CBufferRing(const CBufferRing&) = delete;
 
-  CTaskManager& operator=(CTaskManager const&) = delete;
+  CBufferRing& operator=(CBufferRing const&) = delete;
 
-  CTaskManager(CTaskManager&&) = delete;
+  CBufferRing(CBufferRing&&) = delete;
 
-  CTaskManager& operator=(CTaskManager&&) = delete;
+  CBufferRing& operator=(CBufferRing&&) = delete;
 
-  std::optional<std::tuple<uint64_t, uint64_t, uint64_t>> get_task() {
-    std::unique_lock lock(m_mutex);
-    if (m_tasks.empty() || m_task_index >= m_tasks.size()) {
-      return std::nullopt;
+  //! Windows start at page boundaries and their capacity is a multiple of the page, so direct
+  //! I/O can read into them
+  static constexpr uint64_t alignment = 4096;
+
+  //! Allocates count windows of window_size bytes, can throw std::bad_alloc. <br>
+  //! Zero window_size only tracks the windows in flight, data is owned by the caller. Memory isn't
+  //! initialized, pages land on the NUMA node of the thread which touches them first
+  void allocate(uint32_t count, uint64_t window_size) {
+    m_windows.clear();
+    const auto capacity = (window_size + alignment - 1) / alignment * alignment;
+    for (uint32_t i = 0; i < count && window_size; i++) {
+      m_windows.emplace_back(
+          static_cast<char*>(::operator new(capacity, std::align_val_t(alignment))));
     }
-    return m_tasks[m_task_index++];
+    m_states = std::make_unique<CState[]>(count);
+    m_windows_count = count;
+    m_window_size = window_size;
   }
 
-  void add_tasks(std::vector<std::tuple<uint64_t, uint64_t, uint64_t>> tasks) {
-    std::unique_lock lock(m_mutex);
-    m_task_index = 0;
-    m_tasks = std::move(tasks);
+  [[nodiscard]] uint32_t count() const { return m_windows_count; }
+
+  [[nodiscard]] uint64_t window_size() const { return m_window_size; }
+
+  char* data(uint32_t window) { return m_windows[window].get(); }
+
+  //! Reader: true if the window can be filled without waiting
+  bool is_free(uint32_t window) {
+    std::unique_lock<std::mutex> lock(m_mutex);
+    return !m_states[window].busy;
   }
 
-  bool empty() {
-    std::unique_lock lock(m_mutex);
-    return m_tasks.empty();
+  //! Reader: blocks until the window is hashed and written, returns false after cancel()
+  bool wait_free(uint32_t window) {
+    std::unique_lock<std::mutex> lock(m_mutex);
+    m_cv.wait(lock, [this, window] { return !m_states[window].busy || m_cancelled; });
+    return !m_cancelled;
   }
 
-  void task_done() {
-    std::unique_lock lock(m_mutex);
-    m_tasks_done++;
+  //! Reader: blocks until all windows are hashed and written
+  void wait_all() {
+    for (uint32_t i = 0; i < count(); i++) {
+      wait_free(i);
+    }
   }
 
-  std::size_t done() {
-    std::unique_lock lock(m_mutex);
-    return m_tasks_done;
+  //! Reader: marks the window as busy until count blocks starting from first_block are hashed
+  //! and taken by the writer
+  void publish(uint32_t window, uint64_t first_block, uint64_t count) {
+    std::unique_lock<std::mutex> lock(m_mutex);
+    auto& state = m_states[window];
+    state.busy = true;
+    state.first_block = first_block;
+    state.count = count;
+    state.pending.store(count, std::memory_order_release);
+  }
+
+  //! Reader: no more windows will be published
+  void finish() {
+    {
+      std::unique_lock<std::mutex> lock(m_mutex);
+      m_finished = true;
+    }
+    m_cv.notify_all();
+  }
+
+  //! Wakes up everybody, used on errors
+  void cancel() {
+    {
+      std::unique_lock<std::mutex> lock(m_mutex);
+      m_cancelled = true;
+    }
+    m_cv.notify_all();
+  }
+
+  //! Workers: called after every task, the last one of the window wakes the writer
+  void task_done(uint32_t window, uint64_t count = 1) {
+    if (m_states[window].pending.fetch_sub(count, std::memory_order_acq_rel) == count) {
+      { std::unique_lock<std::mutex> lock(m_mutex); }
+      m_cv.notify_all();
+    }
+  }
+
+  //! Writer: blocks until the window is hashed, returns its first block and blocks count. <br>
+  //! Returns std::nullopt when the reader finished and nothing is left, or after cancel()
+  std::optional<std::pair<uint64_t, uint64_t>> wait_hashed(uint32_t window) {
+    std::unique_lock<std::mutex> lock(m_mutex);
+    const auto& state = m_states[window];
+    m_cv.wait(lock, [this, &state] {
+      return m_cancelled || (state.busy && !state.pending.load(std::memory_order_acquire)) ||
+             (m_finished && !state.busy);
+    });
+    if (m_cancelled || !state.busy) {
+      return std::nullopt;
+    }
+    return std::make_pair(state.first_block, state.count);
+  }
+
+  //! Writer: the window can be reused by the reader
+  void release(uint32_t window) {
+    {
+      std::unique_lock<std::mutex> lock(m_mutex);
+      m_states[window].busy = false;
+    }
+    m_cv.notify_all();
   }
 
  private:
+  struct CAlignedDelete {
+    void operator()(char* data) const { ::operator delete(data, std::align_val_t(alignment)); }
+  };
+
+  struct CState {
+    std::atomic_uint64_t pending{0};
+    bool busy = false;
+    uint64_t first_block = 0;
+    uint64_t count = 0;
+  };
+
+  std::vector<std::unique_ptr<char, CAlignedDelete>> m_windows;
+  std::unique_ptr<CState[]> m_states;
+  uint32_t m_windows_count;
+  uint64_t m_window_size;
+  bool m_finished;
+  bool m_cancelled;
   std::mutex m_mutex;
-  std::size_t m_task_index;
-  std::vector<std::tuple<uint64_t, uint64_t, uint64_t>> m_tasks;
-  std::size_t m_tasks_done;
+  std::condition_variable m_cv;
 };
-//! Provides simple thread pool management methods
-class CThreadManager {
+//! Pool of joinable worker threads, one per core for the whole process. <br>
+//! Runs submitted jobs and polls attached sources: a source runs one of its small tasks and
+//! returns false if it has none at the moment, e.g. the blocks of a file being signed. Jobs go
+//! first, sources are taken in turns. Idle workers park on the condition variable until the next
+//! submit(), attach() or notify(). <br>
+//! Workers may be pinned to CPUs, the NUMA node of a worker is known to the code it runs. <br>
+//! Jobs which block, e.g. a writer waiting for hashed windows, run on service threads instead of
+//! the workers. Service threads are started when all of them are busy and kept until the pool is
+//! destroyed, so they are reused by the next calculations
+class CThreadPool {
  public:
-  explicit CThreadManager(uint32_t thread_count)
-      : m_thread_count(thread_count),
-        m_exit_counter(0),
-        m_should_stop(false),
-        m_should_wake(false),
-        m_ready(false),
-        m_threads_started(0) {}
+  //! count workers which aren't pinned, all of them on node 0
+  explicit CThreadPool(uint32_t count)
+      : CThreadPool(std::vector<CWorkerPlacement>(std::max(count, 1u))) {}
+
+  //! A worker per placement, the nodes of the placements must be numbered densely from 0
+  explicit CThreadPool(const std::vector<CWorkerPlacement>& placements)
+      : m_nodes_count(1),
+        m_last_id(0),
+        m_epoch(0),
+        m_next_source(0),
+        m_free_services(0),
+        m_should_stop(false) {
+    for (const auto& placement : placements) {
+      m_nodes_count = std::max(m_nodes_count, placement.node + 1);
+    }
+    m_node_jobs.resize(m_nodes_count);
+    m_stats = std::make_unique<CWorkerStats[]>(std::max(placements.size(), size_t(1)));
+    for (const auto& placement : placements) {
+      m_threads.emplace_back(&CThreadPool::work, this, placement, uint32_t(m_threads.size()));
+    }
+    if (m_threads.empty()) {
+      m_threads.emplace_back(&CThreadPool::work, this, CWorkerPlacement(), 0u);
+    }
+  }
+
+  ~CThreadPool() {
+    {
+      std::unique_lock<std::mutex> lock(m_mutex);
+      m_should_stop = true;
+    }
+    m_cv.notify_all();
+    m_service_cv.notify_all();
+    for (auto& thread : m_threads) {
+      thread.join();
+    }
+    for (auto& thread : m_services) {
+      thread.join();
+    }
+  }
+
+  CThreadPool(const CThreadPool&) = delete;
+
+  CThreadPool& operator=(CThreadPool const&) = delete;
 
-  ~CThreadManager() = default;
+  CThreadPool(CThreadPool&&) = delete;
 
-  CThreadManager(const CThreadManager&) = delete;
+  CThreadPool& operator=(CThreadPool&&) = delete;
+
+  //! Pool of get_threads_count() workers, started on the first call and joined at exit
+  static CThreadPool& instance() {
+    static CThreadPool pool(get_threads_count());
+    return pool;
+  }
 
-  CThreadManager& operator=(CThreadManager const&) = delete;
+  [[nodiscard]] uint32_t count() const { return uint32_t(m_threads.size()); }
 
-  CThreadManager(CThreadManager&&) = delete;
+  [[nodiscard]] uint32_t nodes_count() const { return m_nodes_count; }
+
+  //! Node of the calling worker in its pool, 0 for threads outside of pools
+  static uint32_t current_node() { return worker_node(); }
+
+  //! Index of the calling worker in its pool, UINT32_MAX for threads outside of pools
+  static uint32_t current_worker() { return worker_index(); }
+
+  //! Time the worker spent parked without work
+  [[nodiscard]] uint64_t get_idle_nano(uint32_t worker) const {
+    return m_stats[worker].idle_ns.get();
+  }
+
+  //! Time the worker waited for the mutex held by another thread
+  [[nodiscard]] uint64_t get_lock_wait_nano(uint32_t worker) const {
+    return m_stats[worker].lock_wait_ns.get();
+  }
+
+  //! Runs f on a worker, the future gets its result or exception. Jobs must not wait for other
+  //! jobs of the pool
+  template <typename F>
+  std::future<std::invoke_result_t<F>> submit(F f) {
+    auto job = std::make_shared<std::packaged_task<std::invoke_result_t<F>()>>(std::move(f));
+    auto future = job->get_future();
+    {
+      std::unique_lock<std::mutex> lock(m_mutex);
+      m_jobs.emplace_back([job] { (*job)(); });
+      m_epoch++;
+    }
+    m_cv.notify_one();
+    return future;
+  }
 
-  CThreadManager& operator=(CThreadManager&&) = delete;
+  //! Runs f on a worker of the node, e.g. to touch memory first from there
+  template <typename F>
+  std::future<std::invoke_result_t<F>> submit_to_node(uint32_t node, F f) {
+    auto job = std::make_shared<std::packaged_task<std::invoke_result_t<F>()>>(std::move(f));
+    auto future = job->get_future();
+    {
+      std::unique_lock<std::mutex> lock(m_mutex);
+      m_node_jobs[node % m_nodes_count].emplace_back([job] { (*job)(); });
+      m_epoch++;
+    }
+    // Only the workers of the node may take it
+    m_cv.notify_all();
+    return future;
+  }
 
+  //! Runs f on a service thread, it may block and wait for the workers or other service jobs. A
+  //! service thread is started only if every one of them has a job
   template <typename F>
-  void run(F f) {
-    for (uint32_t i = 0; i < m_thread_count; i++) {
-      try {
-        std::thread(f, i).detach();
-        m_threads_started++;
-      } catch (...) {
+  std::future<std::invoke_result_t<F>> submit_service(F f) {
+    // The thread is free again before the future is ready, the next job of the caller reuses it
+    auto job = std::make_shared<std::packaged_task<std::invoke_result_t<F>()>>(
+        [this, f = std::move(f)]() mutable {
+          CServiceRelease release{this};
+          return f();
+        });
+    auto future = job->get_future();
+    {
+      std::unique_lock<std::mutex> lock(m_mutex);
+      m_service_jobs.emplace_back([job] { (*job)(); });
+      if (m_service_jobs.size() > m_free_services) {
+        m_free_services++;
+        m_services.emplace_back(&CThreadPool::serve, this);
       }
     }
+    m_service_cv.notify_one();
+    return future;
+  }
+
+  //! Service threads started so far
+  [[nodiscard]] uint32_t services_count() const {
+    std::unique_lock<std::mutex> lock(m_mutex);
+    return uint32_t(m_services.size());
   }
 
-  [[nodiscard]] inline bool is_stopping() const {
-    return m_should_stop.load(std::memory_order_relaxed);
+  //! Returns the id for detach()
+  uint64_t attach(std::function<bool()> source) {
+    std::unique_lock<std::mutex> lock(m_mutex);
+    auto entry = std::make_shared<CSource>();
+    entry->id = ++m_last_id;
+    entry->run = std::move(source);
+    m_sources.push_back(entry);
+    m_epoch++;
+    lock.unlock();
+    m_cv.notify_all();
+    return entry->id;
   }
 
-  void stop() {
-    // If no threads were started
-    if (!m_threads_started) {
+  //! Blocks until no worker runs the source, it is never called again
+  void detach(uint64_t id) {
+    std::unique_lock<std::mutex> lock(m_mutex);
+    const auto it = std::find_if(m_sources.begin(), m_sources.end(),
+                                 [id](const auto& source) { return source->id == id; });
+    if (it == m_sources.end()) {
       return;
     }
-    m_should_stop.store(true, std::memory_order_relaxed);
-    while (m_exit_counter.load(std::memory_order_relaxed) != m_threads_started) {
-      m_sleep_cv.notify_all();
+    const auto source = *it;
+    m_sources.erase(it);
+    source->detached = true;
+    m_idle_cv.wait(lock, [&source] { return !source->busy; });
+  }
+
+  //! The source has new tasks
+  void notify() {
+    {
+      std::unique_lock<std::mutex> lock(m_mutex);
+      m_epoch++;
     }
+    m_cv.notify_all();
+  }
+
+ private:
+  struct CSource {
+    uint64_t id = 0;
+    std::function<bool()> run;
+    //! Workers inside run, incremented under the mutex so that detach() sees them
+    std::atomic_uint32_t busy = 0;
+    //! Set by detach() under the mutex, stops the workers draining the source
+    std::atomic_bool detached = false;
+  };
+
+  //! Counters of a worker, written by it only
+  struct alignas(64) CWorkerStats {
+    CCounter idle_ns;
+    CCounter lock_wait_ns;
+  };
+
+  static uint32_t& worker_node() {
+    static thread_local uint32_t node = 0;
+    return node;
   }
 
-  void wait_work() {
-    m_ready.store(false, std::memory_order_relaxed);
-    m_sleep_cv.notify_all();
-    while (!m_ready.load(std::memory_order_relaxed))
-      ;
+  static uint32_t& worker_index() {
+    static thread_local uint32_t index = UINT32_MAX;
+    return index;
   }
 
-  void work_done() {
-    m_ready.store(true, std::memory_order_relaxed);
+  //! Takes the mutex, the wait is timed only if another thread holds it
+  static void lock_timed(std::unique_lock<std::mutex>& lock, CWorkerStats& stats) {
+    if (lock.try_lock()) {
+      return;
+    }
+    CTimer timer;
+    timer.start();
+    lock.lock();
+    stats.lock_wait_ns.add(timer.stop().get_nano());
+  }
+
+  //! Frees the service thread when its job returns
+  struct CServiceRelease {
+    CThreadPool* pool;
+
+    ~CServiceRelease() {
+      std::unique_lock<std::mutex> lock(pool->m_mutex);
+      pool->m_free_services++;
+    }
+  };
+
+  //! Loop of a service thread, it is free while it has no job
+  void serve() {
     std::unique_lock<std::mutex> lock(m_mutex);
-    m_sleep_cv.wait(lock, [this] {
-      return !m_ready.load(std::memory_order_relaxed) ||
-             m_should_stop.load(std::memory_order_relaxed);
-    });
+    while (true) {
+      m_service_cv.wait(lock, [this] { return m_should_stop || !m_service_jobs.empty(); });
+      if (m_should_stop) {
+        return;
+      }
+      auto job = std::move(m_service_jobs.front());
+      m_service_jobs.pop_front();
+      m_free_services--;
+      lock.unlock();
+      job();
+      lock.lock();
+    }
   }
 
-  void report_exit(uint32_t id) { m_exit_counter.fetch_add(1, std::memory_order_relaxed); }
+  void work(CWorkerPlacement placement, uint32_t index) {
+    // A refused pin leaves the worker to the scheduler, the results are the same
+    if (placement.cpu >= 0) {
+      pin_current_thread(uint32_t(placement.cpu));
+    }
+    worker_node() = placement.node;
+    worker_index() = index;
+    auto& stats = m_stats[index];
+    auto& node_jobs = m_node_jobs[placement.node];
+    std::unique_lock<std::mutex> lock(m_mutex, std::defer_lock);
+    lock_timed(lock, stats);
+    while (!m_should_stop) {
+      if (!node_jobs.empty() || !m_jobs.empty()) {
+        auto& jobs = node_jobs.empty() ? m_jobs : node_jobs;
+        auto job = std::move(jobs.front());
+        jobs.pop_front();
+        lock.unlock();
+        job();
+        lock_timed(lock, stats);
+        continue;
+      }
+      // A notify() during the round changes the epoch, so the worker doesn't park
+      const auto epoch = m_epoch;
+      auto worked = false;
+      for (size_t i = 0; i < m_sources.size() && !worked && !m_should_stop; i++) {
+        const auto source = m_sources[m_next_source++ % m_sources.size()];
+        source->busy++;
+        lock.unlock();
+        // The source is drained without the mutex, it is taken once when it has nothing left
+        while (!source->detached && !m_should_stop && source->run()) {
+          worked = true;
+        }
+        const auto last = source->busy.fetch_sub(1) == 1;
+        lock_timed(lock, stats);
+        // detach() checks busy and waits under the mutex, so the notification can't be lost
+        if (last && source->detached) {
+          m_idle_cv.notify_all();
+        }
+      }
+      if (!worked) {
+        CTimer idle_timer;
+        idle_timer.start();
+        m_cv.wait(lock, [this, epoch] { return m_should_stop || m_epoch != epoch; });
+        stats.idle_ns.add(idle_timer.stop().get_nano());
+      }
+    }
+  }
 
- private:
-  std::mutex m_mutex;
-  std::condition_variable m_sleep_cv;
-  uint32_t m_thread_count;
-  std::atomic_uint32_t m_exit_counter;
+  uint32_t m_nodes_count;
+  std::vector<std::thread> m_threads;
+  std::unique_ptr<CWorkerStats[]> m_stats;
+  std::deque<std::function<void()>> m_jobs;
+  std::vector<std::deque<std::function<void()>>> m_node_jobs;
+  std::vector<std::shared_ptr<CSource>> m_sources;
+  std::vector<std::thread> m_services;
+  std::deque<std::function<void()>> m_service_jobs;
+  uint64_t m_last_id;
+  uint64_t m_epoch;
+  size_t m_next_source;
+  //! Service threads without a job, each of them takes one of m_service_jobs
+  size_t m_free_services;
   std::atomic_bool m_should_stop;
-  std::atomic_bool m_should_wake;
-  std::atomic_bool m_ready;
-  std::uint32_t m_threads_started;
+  mutable std::mutex m_mutex;
+  std::condition_variable m_cv;
+  std::condition_variable m_service_cv;
+  std::condition_variable m_idle_cv;
 };
 
+//! Runs f(i) for i in [0, count) on the pool in chunks and waits, rethrows the first exception
+template <typename F>
+void parallel_for(CThreadPool& pool, uint64_t count, F f) {
+  const auto chunk = std::max((count + pool.count() - 1) / pool.count(), uint64_t(1));
+  std::vector<std::future<void>> futures;
+  for (uint64_t begin = 0; begin < count; begin += chunk) {
+    futures.push_back(pool.submit([&f, begin, end = std::min(count, begin + chunk)] {
+      for (auto i = begin; i < end; i++) {
+        f(i);
+      }
+    }));
+  }
+  // Every chunk refers to f, so all of them finish before an exception leaves
+  for (auto& future : futures) {
+    future.wait();
+  }
+  for (auto& future : futures) {
+    future.get();
+  }
+}
+
 #endif  // SIGNATURE_UTILS_H